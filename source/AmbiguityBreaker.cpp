@@ -320,14 +320,9 @@ void AmbiguityBreaker::makeCorrelationGrid()
         }
     }
 
-    boost::thread_group threads;
-    for (int i = 0; i < 1; i++)
-    {
-        boost::thread *thr = new boost::thread(calculateCorrelations, this, i);
-        threads.add_thread(thr);
-    }
-
-    threads.join_all();
+    // not submitted to the thread pool: flipping the active ambiguity
+    // of one crystal changes what every other comparison sees.
+    calculateCorrelations(this, 0);
 }
 
 // Call constructor and then run()
@@ -0,0 +1,442 @@
+//
+//  CrystalPack.cpp
+//   cppxfel - a collection of processing algorithms for XFEL diffraction data.
+
+//    Copyright (C) 2017  Helen Ginn
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "CrystalPack.h"
+#include "MtzManager.h"
+#include "FileParser.h"
+#include "FileReader.h"
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+CrystalPackPtr CrystalPack::outputPack;
+CrystalPackPtr CrystalPack::inputPack;
+bool CrystalPack::setupPacks = false;
+std::mutex CrystalPack::setupMutex;
+
+CrystalPack::CrystalPack(std::string newFilename)
+{
+    filename = newFilename;
+    output = NULL;
+    outputBytes = 0;
+    map = NULL;
+    mapBytes = 0;
+}
+
+CrystalPack::~CrystalPack()
+{
+    if (output)
+    {
+        fclose(output);
+    }
+
+    if (map)
+    {
+        munmap(map, mapBytes);
+    }
+}
+
+static void makePackHeader(CrystalPackHeader *header)
+{
+    memset(header, 0, sizeof(CrystalPackHeader));
+    memcpy(header->magic, CRYSTAL_PACK_MAGIC, sizeof(header->magic));
+    header->version = CRYSTAL_PACK_VERSION;
+    header->columns = MTZ_ROW_COLUMNS;
+}
+
+// 0 if the record header cannot be right
+size_t CrystalPack::recordLength(const CrystalPackRecord *record)
+{
+    if (record->nameLength < 0 || record->rowCount < 0)
+    {
+        return 0;
+    }
+
+    size_t nameBytes = paddedLength(record->nameLength);
+    size_t rowBytes = paddedLength((size_t)record->rowCount * MTZ_ROW_COLUMNS * sizeof(float));
+
+    return sizeof(CrystalPackRecord) + nameBytes + rowBytes;
+}
+
+// length of the header and every complete record which follows it
+size_t CrystalPack::completeLength(FILE *file, size_t fileBytes)
+{
+    size_t offset = sizeof(CrystalPackHeader);
+    CrystalPackRecord record;
+
+    while (offset + sizeof(CrystalPackRecord) <= fileBytes)
+    {
+        if (fseek(file, offset, SEEK_SET) != 0 ||
+            fread(&record, sizeof(CrystalPackRecord), 1, file) != 1)
+        {
+            break;
+        }
+
+        size_t recordBytes = recordLength(&record);
+
+        if (recordBytes == 0 || offset + recordBytes > fileBytes)
+        {
+            break;
+        }
+
+        offset += recordBytes;
+    }
+
+    return offset;
+}
+
+bool CrystalPack::openForWriting()
+{
+    CrystalPackHeader header;
+    makePackHeader(&header);
+
+    output = fopen(filename.c_str(), "ab");
+
+    if (!output)
+    {
+        logged << "Could not open crystal pack " << filename << " for writing." << std::endl;
+        sendLog();
+        return false;
+    }
+
+    fseek(output, 0, SEEK_END);
+    size_t fileBytes = ftell(output);
+
+    if (fileBytes == 0)
+    {
+        bool written = (fwrite(&header, sizeof(CrystalPackHeader), 1, output) == 1);
+        written &= (fflush(output) == 0);
+
+        if (!written)
+        {
+            fclose(output);
+            output = NULL;
+            logged << "Could not write to crystal pack " << filename << "." << std::endl;
+            sendLog();
+            return false;
+        }
+
+        outputBytes = sizeof(CrystalPackHeader);
+        return true;
+    }
+
+    // appending to an existing pack, which must be of this version
+    CrystalPackHeader existing;
+    FILE *check = fopen(filename.c_str(), "rb");
+    bool matches = (check && fread(&existing, sizeof(CrystalPackHeader), 1, check) == 1 &&
+                    memcmp(&existing, &header, sizeof(CrystalPackHeader)) == 0);
+
+    if (matches)
+    {
+        outputBytes = completeLength(check, fileBytes);
+    }
+
+    if (check)
+    {
+        fclose(check);
+    }
+
+    if (!matches)
+    {
+        fclose(output);
+        output = NULL;
+        logged << "Cannot append to " << filename << " which is not a crystal pack of version "
+        << CRYSTAL_PACK_VERSION << "." << std::endl;
+        sendLog();
+        return false;
+    }
+
+    // otherwise everything appended from now on would be lost behind it
+    if (outputBytes < fileBytes)
+    {
+        logged << "Removing incomplete crystal from the end of " << filename << "." << std::endl;
+        sendLog();
+
+        if (ftruncate(fileno(output), outputBytes) != 0)
+        {
+            fclose(output);
+            output = NULL;
+            logged << "Could not remove it, so not appending to " << filename << "." << std::endl;
+            sendLog();
+            return false;
+        }
+
+        fseek(output, 0, SEEK_END);
+    }
+
+    return true;
+}
+
+bool CrystalPack::openForReading()
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+
+    if (fd < 0)
+    {
+        logged << "Could not open crystal pack " << filename << "." << std::endl;
+        sendLog();
+        return false;
+    }
+
+    struct stat fileStat;
+
+    if (fstat(fd, &fileStat) != 0 || fileStat.st_size < (off_t)sizeof(CrystalPackHeader))
+    {
+        close(fd);
+        logged << "Crystal pack " << filename << " is empty." << std::endl;
+        sendLog();
+        return false;
+    }
+
+    mapBytes = fileStat.st_size;
+    map = mmap(NULL, mapBytes, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED)
+    {
+        map = NULL;
+        logged << "Could not map crystal pack " << filename << "." << std::endl;
+        sendLog();
+        return false;
+    }
+
+    CrystalPackHeader header;
+    makePackHeader(&header);
+
+    if (memcmp(map, &header, sizeof(CrystalPackHeader)) != 0)
+    {
+        munmap(map, mapBytes);
+        map = NULL;
+        logged << filename << " is not a crystal pack of version " << CRYSTAL_PACK_VERSION << "." << std::endl;
+        sendLog();
+        return false;
+    }
+
+    char *bytes = (char *)map;
+    size_t offset = sizeof(CrystalPackHeader);
+
+    while (offset + sizeof(CrystalPackRecord) <= mapBytes)
+    {
+        CrystalPackRecord *record = (CrystalPackRecord *)&bytes[offset];
+        size_t recordBytes = recordLength(record);
+
+        if (recordBytes == 0 || offset + recordBytes > mapBytes)
+        {
+            // a crystal was being written when the pack was opened
+            logged << "Ignoring incomplete crystal at the end of " << filename << "." << std::endl;
+            sendLog(LogLevelDetailed);
+            break;
+        }
+
+        std::string name(&bytes[offset + sizeof(CrystalPackRecord)], record->nameLength);
+        nameIndex[name] = (int)recordOffsets.size();
+        recordOffsets.push_back(offset);
+        offset += recordBytes;
+    }
+
+    logged << "Opened crystal pack " << filename << " with " << nameIndex.size()
+    << " crystals." << std::endl;
+    sendLog();
+
+    return true;
+}
+
+bool CrystalPack::addCrystal(MtzManager *mtz, std::string name, bool announce)
+{
+    std::vector<float> rows;
+    int num = mtz->reflectionRows(&rows);
+    std::vector<double> unitCell = mtz->getUnitCell();
+
+    CrystalPackRecord record;
+    memset(&record, 0, sizeof(CrystalPackRecord));
+    record.nameLength = (int)name.length();
+    record.rowCount = num;
+    record.spaceGroup = mtz->getSpaceGroup() ? mtz->getSpaceGroupNum() : 0;
+
+    for (int i = 0; i < 6 && i < unitCell.size(); i++)
+    {
+        record.unitCell[i] = unitCell[i];
+    }
+
+    record.mosaicity = mtz->getMosaicity();
+    record.spotSize = mtz->getSpotSize();
+    record.wavelength = mtz->getWavelength();
+    record.bFactor = mtz->bFactor;
+    record.scale = mtz->getScale();
+
+    // the whole record is put together first so that it goes out in one write
+    size_t nameBytes = paddedLength(name.length());
+    size_t rowBytes = (size_t)num * MTZ_ROW_COLUMNS * sizeof(float);
+    std::vector<char> bytes(recordLength(&record), 0);
+
+    memcpy(&bytes[0], &record, sizeof(CrystalPackRecord));
+    memcpy(&bytes[sizeof(CrystalPackRecord)], name.c_str(), name.length());
+
+    if (rowBytes)
+    {
+        memcpy(&bytes[sizeof(CrystalPackRecord) + nameBytes], &rows[0], rowBytes);
+    }
+
+    bool success = false;
+
+    {
+        std::lock_guard<std::mutex> lock(writeMutex);
+
+        if (output)
+        {
+            success = (fwrite(&bytes[0], 1, bytes.size(), output) == bytes.size());
+            success &= (fflush(output) == 0);
+
+            if (success)
+            {
+                outputBytes += bytes.size();
+            }
+            else
+            {
+                // cut off whatever part of the record did get written, and
+                // write nothing more rather than append after a gap
+                fclose(output);
+                output = NULL;
+                truncate(filename.c_str(), outputBytes);
+            }
+        }
+    }
+
+    if (!success)
+    {
+        logged << "Could not write " << name << " to crystal pack " << filename
+        << "; no more crystals will be written to it." << std::endl;
+        sendLog();
+        return false;
+    }
+
+    logged << "Written " << num << " refls for " << name << " to " << filename << std::endl;
+    sendLog(announce ? LogLevelNormal : LogLevelDebug);
+
+    return true;
+}
+
+int CrystalPack::crystalForName(std::string name)
+{
+    std::map<std::string, int>::iterator it = nameIndex.find(name);
+
+    if (it == nameIndex.end())
+    {
+        return -1;
+    }
+
+    return it->second;
+}
+
+std::string CrystalPack::crystalName(int i)
+{
+    const CrystalPackRecord *aRecord = record(i);
+    const char *name = (const char *)aRecord + sizeof(CrystalPackRecord);
+
+    return std::string(name, aRecord->nameLength);
+}
+
+const CrystalPackRecord *CrystalPack::record(int i)
+{
+    return (const CrystalPackRecord *)((char *)map + recordOffsets[i]);
+}
+
+const float *CrystalPack::rows(int i)
+{
+    const CrystalPackRecord *aRecord = record(i);
+    const char *name = (const char *)aRecord + sizeof(CrystalPackRecord);
+
+    return (const float *)(name + paddedLength(aRecord->nameLength));
+}
+
+bool CrystalPack::loadCrystal(int i, MtzManager *mtz)
+{
+    if (i < 0 || i >= crystalCount())
+    {
+        return false;
+    }
+
+    mtz->loadPackedReflections(record(i), rows(i));
+
+    return true;
+}
+
+void CrystalPack::setup()
+{
+    std::lock_guard<std::mutex> lock(setupMutex);
+
+    if (setupPacks)
+    {
+        return;
+    }
+
+    std::string outputName = FileParser::getKey("CRYSTAL_PACK_OUTPUT", std::string(""));
+    std::string inputName = FileParser::getKey("CRYSTAL_PACK_INPUT", std::string(""));
+
+    if (inputName.length())
+    {
+        inputPack = CrystalPackPtr(new CrystalPack(inputName));
+
+        if (!inputPack->openForReading())
+        {
+            inputPack = CrystalPackPtr();
+        }
+    }
+
+    if (outputName.length())
+    {
+        outputPack = CrystalPackPtr(new CrystalPack(FileReader::addOutputDirectory(outputName)));
+
+        if (!outputPack->openForWriting())
+        {
+            outputPack = CrystalPackPtr();
+        }
+    }
+
+    setupPacks = true;
+}
+
+CrystalPackPtr CrystalPack::getOutputPack()
+{
+    setup();
+
+    return outputPack;
+}
+
+CrystalPackPtr CrystalPack::getInputPack()
+{
+    setup();
+
+    return inputPack;
+}
+
+bool CrystalPack::loadPackedCrystal(MtzManager *mtz)
+{
+    CrystalPackPtr pack = getInputPack();
+
+    if (!pack)
+    {
+        return false;
+    }
+
+    return pack->loadCrystal(pack->crystalForName(mtz->getFilename()), mtz);
+}
@@ -0,0 +1,120 @@
+//
+//  CrystalPack.h
+//   cppxfel - a collection of processing algorithms for XFEL diffraction data.
+
+//    Copyright (C) 2017  Helen Ginn
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifndef __cppxfel__CrystalPack__
+#define __cppxfel__CrystalPack__
+
+#include <stdio.h>
+#include <map>
+#include <mutex>
+#include "parameters.h"
+#include "LoggableObject.h"
+
+#define CRYSTAL_PACK_MAGIC "CXFLPACK"
+#define CRYSTAL_PACK_VERSION 1
+
+/* A crystal pack holds the reflections of many crystals in one file, in
+ * place of one MTZ file per crystal. After a short file header, crystals
+ * are appended one after another, each as a record header (below), its
+ * name padded to a multiple of eight bytes, and then rowCount rows of
+ * MTZ_ROW_COLUMNS floats, the same columns as MtzManager::writeToFile.
+ * The file is mapped into memory when read and indexed by crystal name;
+ * a crystal written more than once is read from its last record, just as
+ * rewriting an MTZ file replaces it. Records are never changed once
+ * written, so a pack may be appended to while it is being read. Each
+ * record goes out in a single write; an incomplete record left at the
+ * end by a failed write or a crashed writer is cut off before anything
+ * more is appended. */
+
+typedef struct
+{
+    char magic[8];
+    int version;
+    int columns;
+} CrystalPackHeader;
+
+struct CrystalPackRecord
+{
+    int nameLength;
+    int rowCount;
+    int spaceGroup;
+    int padding;
+    double unitCell[6];
+    double mosaicity;
+    double spotSize;
+    double wavelength;
+    double bFactor;
+    double scale;
+} ;
+
+class CrystalPack : public LoggableObject
+{
+private:
+    std::string filename;
+    FILE *output;
+    size_t outputBytes;
+    std::mutex writeMutex;
+
+    void *map;
+    size_t mapBytes;
+    std::vector<size_t> recordOffsets;
+    std::map<std::string, int> nameIndex;
+
+    static CrystalPackPtr outputPack;
+    static CrystalPackPtr inputPack;
+    static bool setupPacks;
+    static std::mutex setupMutex;
+    static void setup();
+
+    static size_t paddedLength(size_t length)
+    {
+        return (length + 7) / 8 * 8;
+    }
+
+    static size_t recordLength(const CrystalPackRecord *record);
+    size_t completeLength(FILE *file, size_t fileBytes);
+
+public:
+    CrystalPack(std::string newFilename);
+    ~CrystalPack();
+
+    bool openForWriting();
+    bool openForReading();
+
+    bool addCrystal(MtzManager *mtz, std::string name, bool announce = false);
+
+    int crystalCount()
+    {
+        return (int)recordOffsets.size();
+    }
+
+    int crystalForName(std::string name);
+    std::string crystalName(int i);
+    const CrystalPackRecord *record(int i);
+    const float *rows(int i);
+
+    bool loadCrystal(int i, MtzManager *mtz);
+
+    static CrystalPackPtr getOutputPack();
+    static CrystalPackPtr getInputPack();
+    static bool loadPackedCrystal(MtzManager *mtz);
+};
+
+#endif /* defined(__cppxfel__CrystalPack__) */
@@ -37,6 +37,8 @@
 
 ParametersMap FileParser::parameters;
 std::ostringstream FileParser::log;
+std::atomic<int> FileParser::parameterGeneration(0);
+std::mutex FileParser::cachedKeyMutex;
 int FileParser::threadsFound = 0;
 char FileParser::splitCharMajor = ' ';
 char FileParser::splitCharMinor = ' ';
@@ -456,6 +458,7 @@ void FileParser::generateCodeList()
         codeMap["detailed"] = 1;
         codeMap["debug"] = 2;
         codeMaps["VERBOSITY_LEVEL"] = codeMap;
+        codeMaps["LOG_GUARANTEED_LEVEL"] = codeMap;
     }
     {
         CodeMap codeMap;
@@ -532,6 +535,9 @@ void FileParser::generateCategories()
         hardIndexingParameters.push_back("MAX_LATTICES_PER_IMAGE");
     hardIndexingParameters.push_back("CHECKING_COMMON_SPOTS");
     hardIndexingParameters.push_back("NETWORK_TRIAL_LIMIT");
+    hardIndexingParameters.push_back("LOOKUP_CACHE_DIRECTORY");
+    hardIndexingParameters.push_back("STREAMING_PIPELINE");
+    hardIndexingParameters.push_back("PIPELINE_QUEUE_SIZE");
 
         std::vector<std::string> powderPatternSpecific;
         powderPatternSpecific.push_back("ALWAYS_FILTER_SPOTS");
@@ -556,6 +562,7 @@ void FileParser::generateCategories()
 
     std::vector<std::string> hardHdf5Imports;
     hardHdf5Imports.push_back("HDF5_AS_FLOAT");
+    hardHdf5Imports.push_back("HDF5_PREFETCH_FRAMES");
     hardHdf5Imports.push_back("CHEETAH_DATA_ADDRESSES");
     hardHdf5Imports.push_back("HDF5_MASK_ADDRESS");
     hardHdf5Imports.push_back("CHEETAH_ID_ADDRESSES");
@@ -659,6 +666,12 @@ void FileParser::generateCategories()
     postRefGeneral.push_back("OUTPUT_INDIVIDUAL_CYCLES");
     postRefGeneral.push_back("DEFAULT_TARGET_FUNCTION");
     postRefGeneral.push_back("BINARY_PARTIALITY");
+    postRefGeneral.push_back("FLAT_OBSERVATIONS");
+    postRefGeneral.push_back("MERGE_LOCAL_BUFFERS");
+    postRefGeneral.push_back("MERGE_STREAMING");
+    postRefGeneral.push_back("MERGE_SPILL_DIRECTORY");
+    postRefGeneral.push_back("MERGE_SPILL_CRYSTALS");
+    postRefGeneral.push_back("MERGE_SPILL_WINDOW");
     postRefGeneral.push_back("INITIAL_MTZ");
 
     postRefinement["On/off optimisation switches"] = postRefOptimisers;
@@ -673,7 +686,10 @@ void FileParser::generateCategories()
     std::vector<std::string> generalOptions;
     generalOptions.push_back("MAX_THREADS");
     generalOptions.push_back("OUTPUT_DIRECTORY");
+    generalOptions.push_back("CRYSTAL_PACK_OUTPUT");
+    generalOptions.push_back("CRYSTAL_PACK_INPUT");
     generalOptions.push_back("VERBOSITY_LEVEL");
+    generalOptions.push_back("LOG_GUARANTEED_LEVEL");
     generalOptions.push_back("MAXIMUM_CYCLES");
     others["General options"] = generalOptions;
 
@@ -704,6 +720,7 @@ void FileParser::generateCategories()
 void FileParser::generateHelpList()
 {
     helpMap["VERBOSITY_LEVEL"] = "Sets the level of output to the terminal. Default normal.";
+    helpMap["LOG_GUARANTEED_LEVEL"] = "Messages up to this level (normal, detailed or debug) are never lost: a thread whose log buffer is full waits for it to be printed. Less important messages are dropped instead, and the number dropped is reported. Default debug.";
     helpMap["MAX_THREADS"] = "Sets maximum number of threads to use during threaded functionality. Generally set equal to the number of cores on the machine (unless you know each core can support more than one thread).";
     helpMap["MATRIX_LIST_VERSION"] = "Mostly for backwards compatibility. V2 is suitable for pickle-based data, V3 is auto-picked up and suitable for Cheetah output from the all-*.dat file.";
     helpMap["ORIENTATION_MATRIX_LIST"] = "The name of the file containing list of images (and/or their metadata and any determined crystal orientation matrices). If using HDF5 format, this list is optional (images can be loaded directly from HDF5). However it is available if you wish to load in only certain images from the HDF5 file, or reprocess indexed results. These are also created as a result of indexing, integration and so on. However if you wish to load in raw pixel streams (4-byte or 2-byte streams from .img files), this is necessary to know which files to load.\n\nA very basic version of the contents of the file, just to load the images (e.g. images.dat) would be:\n\nimage LCLS_2013_Mar16_r0003_094913_1368f\nimage LCLS_2013_Mar16_r0003_094916_13a9a\nimage LCLS_2013_Mar16_r0003_094918_13d9d\nimage LCLS_2013_Mar16_r0003_094921_1410c\nimage LCLS_2013_Mar16_r0003_094923_1443f\nimage LCLS_2013_Mar16_r0003_094925_14757\n\nThis should omit the file extension (.img) if loading from raw streams.";
@@ -737,6 +754,11 @@ void FileParser::generateHelpList()
     helpMap["MIN_REFINED_RESOLUTION"] = "Do not refine using reflections below x Å resolution (but these will be included in the merge). Default 0 (no minimum).";
     helpMap["OUTLIER_REJECTION"] = "Master switch for rejection of outliers based on standard deviations from mean. Default ON.";
     helpMap["OUTLIER_REJECTION_SIGMA"] = "Number of standard deviations away from the mean intensity of a merged reflection beyond which an observation is rejected during merging. Default 1.8.";
+    helpMap["MERGE_LOCAL_BUFFERS"] = "When merging, collect observations for each batch of crystals separately and combine them at the end, rather than adding them to shared reflections under a lock. Observations are combined in crystal order, so results do not depend on the number of threads. Default false.";
+    helpMap["MERGE_STREAMING"] = "When merging, keep running totals for each reflection instead of every observation, which greatly reduces the memory needed for large datasets. Observations are only gathered again for reflections which may have outliers to reject. No unmerged MTZ is written, and MERGE_MEDIAN turns this off. Default false.";
+    helpMap["MERGE_SPILL_DIRECTORY"] = "When merging, write the observations of each group of crystals to a file in this directory, sorted by reflection, and merge by reading the files back together a window of reflections at a time. The merge then no longer holds every observation in memory at once. This only bounds the observations of a single merge: the crystals' own reflections stay in memory (see LOW_MEMORY_MODE), and the files are written again for every merge, since post-refinement changes the observations between merges. Files are removed after merging. No unmerged MTZ is written. Default none (merge in memory).";
+    helpMap["MERGE_SPILL_CRYSTALS"] = "Number of crystals written to each file when MERGE_SPILL_DIRECTORY is set. Default 1000.";
+    helpMap["MERGE_SPILL_WINDOW"] = "Number of reflections read back and merged at a time when MERGE_SPILL_DIRECTORY is set. Default 65536.";
     helpMap["CORRELATION_REJECTION"] = "Rejection on a per image basis if individual reflections correlate poorly with the image. Good for unindexed multiple lattices or bad-pixel detectors. Default ON.";
     helpMap["POLARISATION_CORRECTION"] = "If switched on, polarisation factor is applied. Default OFF. Does this even still work?";
     helpMap["POLARISATION_FACTOR"] = "Number between 0 for fully horizontal polarisation, 1 for fully vertical polarisation.";
@@ -809,14 +831,18 @@ void FileParser::generateHelpList()
     helpMap["READ_REFINED_MTZS"] = "If reading from matrix version 3.0, READ_REFINED_MTZS set to ON can be used to force the refined images to be read in. Default OFF.";
     helpMap["IGNORE_MISSING_IMAGES"] = "If image data happens to be unavailable, but you have spot-finding results or other metadata, this will try to continue to run regardless. If it tries to load image data, this is horrendous. Default OFF.";
     helpMap["BINARY_PARTIALITY"] = "If a varying partiality between 0 and 1 is not working for you, maybe a BINARY_PARTIALITY would work better.";
+    helpMap["FLAT_OBSERVATIONS"] = "Copy each crystal's observations into flat arrays for the R split and correlation targets during post-refinement. Not used with POLARISATION_CORRECTION.";
     helpMap["DETECTOR_LIST"] = "Path to a file containing detector information. Should use one of the formats specified in GEOMETRY_FORMAT.";
     helpMap["GEOMETRY_FORMAT"] = "Read in with the detector information from cppxfel or CrystFEL format. Can also load in panel_list format for backwards compatibility.";
     helpMap["HDF5_SOURCE_FILES"] = "HDF5 files from which image data should be found. Supports glob strings (e.g. run*.h5 for SACLA HDF5 files from cheetah-dispatcher).";
     helpMap["USE_HDF5_WAVELENGTH"] = "Use the wavelengths stored within HDF5 files. If you do not trust these values, disable this in order to default to the value of INTEGRATION_WAVELENGTH.";
-    helpMap["HDF5_AS_FLOAT"] = "HDF5 file image data should be interpreted as float (rudimentary conversion to ints!)";
+    helpMap["HDF5_AS_FLOAT"] = "HDF5 file image data should be interpreted as float.";
+    helpMap["HDF5_PREFETCH_FRAMES"] = "For HDF5 files which stack images in one dataset (LCLS, European XFEL), read this many consecutive frames at a time on a background thread ahead of when they are needed, rounded up to whole chunks of the dataset. Helps on file systems which are slow for small reads. Only the two files most recently started are prefetched from at once. Default 0 (off).";
 
     helpMap["FREE_ELECTRON_LASER"] = "Which free electron laser did this data come from? This is used for interpreting HDF5 files. Only LCLS and SACLA currently supported.";
     helpMap["OUTPUT_DIRECTORY"] = "Path to a directory into which almost all processing files will be deposited, except for spot-finding results.";
+    helpMap["CRYSTAL_PACK_OUTPUT"] = "Name of a crystal pack file in the output directory. Crystals from integration and post-refinement are appended to this single file, with their refinement parameters, instead of being written as one MTZ file each. Convert with cppxfel.run -unpack <pack>. Default none (write MTZ files).";
+    helpMap["CRYSTAL_PACK_INPUT"] = "Crystal pack file from which crystals are loaded by name when present, instead of from their MTZ files. Make one from MTZ files with cppxfel.run -pack <pack> <files>. Default none.";
 
     helpMap["SPOT_FINDING_ALGORITHM"] = "Choose which algorithm is used for spot-finding. Blob-finding is highly recommended.";
     helpMap["IMAGE_MIN_SPOT_INTENSITY"] = "Do not attempt to perform spot-finding calculation on a pixel intensity below this value.";
@@ -828,6 +854,9 @@ void FileParser::generateHelpList()
 
     helpMap["SOLUTION_ATTEMPTS"] = "Maximum number of lattices which should be attempted to be indexed by the TakeTwo algorithm before stopping. Default 1.";
     helpMap["INDEXING_TIME_LIMIT"] = "Maximum number of seconds after which cppxfel will give up on indexing a lattice.";
+    helpMap["LOOKUP_CACHE_DIRECTORY"] = "Directory in which to keep the table of vector pair scores used in indexing. The table is read from here if it was made with the same UNIT_CELL, SPACE_GROUP, INDEXING_RLP_SIZE, MAXIMUM_ANGLE_DISTANCE and MAX_RECIPROCAL_DISTANCE, otherwise it is calculated and saved. Default none (always calculated).";
+    helpMap["STREAMING_PIPELINE"] = "During INDEX, stream images through loading, spot finding, indexing and writing out crystals in separate threads, dropping each image once its crystals have been written. Reading overlaps with processing and memory use does not grow with the number of images. Default false.";
+    helpMap["PIPELINE_QUEUE_SIZE"] = "Number of images which may wait between each stage of STREAMING_PIPELINE. Default 4.";
     helpMap["MAX_RECIPROCAL_DISTANCE"] = "Maximum distance between two potential reciprocal lattice points used for TakeTwo indexing.";
     helpMap["REJECT_UNDER_SPOT_COUNT"] = "Do not index or use this image for generating powder patterns if underneath this spot count. Default 0.";
     helpMap["REJECT_OVER_SPOT_COUNT"] = "Do not index or use this image for generating powder patterns if over this spot count. Default 4000.";
@@ -848,6 +877,7 @@ void FileParser::generateFunctionList()
         parserMap = ParserMap();
 
     parserMap["VERBOSITY_LEVEL"] = simpleInt;
+    parserMap["LOG_GUARANTEED_LEVEL"] = simpleInt;
 
     parserMap["MAX_THREADS"] = simpleInt;
 
@@ -889,6 +919,7 @@ void FileParser::generateFunctionList()
     parserMap["R_FACTOR_THRESHOLD"] = simpleFloat;
     parserMap["REINITIALISE_WAVELENGTH"] = simpleBool;
     parserMap["SMOOTH_FUNCTION"] = simpleBool;
+    parserMap["FLAT_OBSERVATIONS"] = simpleBool;
     parserMap["NORMALISE_PARTIALITIES"] = simpleBool;
     parserMap["REPLACE_REFERENCE"] = simpleBool;
     parserMap["FREE_MILLER_LIST"] = simpleString;
@@ -899,6 +930,7 @@ void FileParser::generateFunctionList()
     parserMap["CHEETAH_ID_ADDRESSES"] = simpleString;
     parserMap["HDF5_MASK_ADDRESS"] = simpleString;
     parserMap["HDF5_AS_FLOAT"] = simpleBool;
+    parserMap["HDF5_PREFETCH_FRAMES"] = simpleInt;
 
         parserMap["INITIAL_WAVELENGTH"] = simpleFloat;
         parserMap["INITIAL_BANDWIDTH"] = simpleFloat;
@@ -943,6 +975,8 @@ void FileParser::generateFunctionList()
 
     parserMap["ORIENTATION_MATRIX_LIST"] = simpleString;
     parserMap["OUTPUT_DIRECTORY"] = simpleString;
+    parserMap["CRYSTAL_PACK_OUTPUT"] = simpleString;
+    parserMap["CRYSTAL_PACK_INPUT"] = simpleString;
     parserMap["OUTPUT_INDIVIDUAL_CYCLES"] = simpleBool;
     parserMap["MATRIX_LIST_VERSION"] = simpleFloat;
         parserMap["INITIAL_MTZ"] = simpleString;
@@ -1023,10 +1057,13 @@ void FileParser::generateFunctionList()
         parserMap["SOLUTION_ATTEMPTS"] = simpleInt;
     parserMap["MAX_RECIPROCAL_DISTANCE"] = simpleFloat;
     parserMap["MAXIMUM_ANGLE_DISTANCE"] = simpleFloat;
+    parserMap["LOOKUP_CACHE_DIRECTORY"] = simpleString;
     parserMap["ALWAYS_FILTER_SPOTS"] = simpleBool;
     parserMap["MINIMUM_SOLUTION_NETWORK_COUNT"] = simpleInt;
     parserMap["NETWORK_TRIAL_LIMIT"] = simpleInt;
     parserMap["INDEXING_TIME_LIMIT"] = simpleInt;
+    parserMap["STREAMING_PIPELINE"] = simpleBool;
+    parserMap["PIPELINE_QUEUE_SIZE"] = simpleInt;
     parserMap["MAX_LATTICES_PER_IMAGE"] = simpleInt;
     parserMap["CHECKING_COMMON_SPOTS"] = simpleBool;
     parserMap["EXCLUDE_WEAKEST_SPOT_FRACTION"] = simpleFloat;
@@ -1035,6 +1072,11 @@ void FileParser::generateFunctionList()
     parserMap["POWDER_PATTERN_STEP"] = simpleFloat;
     parserMap["POWDER_PATTERN_STEP_ANGLE"] = simpleFloat;
     parserMap["LOW_MEMORY_MODE"] = simpleBool;
+    parserMap["MERGE_LOCAL_BUFFERS"] = simpleBool;
+    parserMap["MERGE_STREAMING"] = simpleBool;
+    parserMap["MERGE_SPILL_DIRECTORY"] = simpleString;
+    parserMap["MERGE_SPILL_CRYSTALS"] = simpleInt;
+    parserMap["MERGE_SPILL_WINDOW"] = simpleInt;
     parserMap["GEOMETRY_FORMAT"] = simpleInt;
         parserMap["GEOMETRY_IS_APPROXIMATE"] = simpleBool;
 
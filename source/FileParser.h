@@ -24,8 +24,11 @@
 #include <string>
 #include "parameters.h"
 #include <iostream>
+#include <mutex>
+#include <atomic>
 #include "LoggableObject.h"
 class MtzRefiner;
+template<typename Value> class CachedKey;
 typedef std::map<std::string, int> CodeMap;
 
 typedef std::map<std::string, std::vector<std::string> > CategoryMap;
@@ -34,6 +37,7 @@ typedef std::map<std::string, CategoryMap > CategoryTree;
 
 class FileParser: public LoggableObject
 {
+    template<typename Value> friend class CachedKey;
 protected:
     static ParserMap parserMap;
         static ParametersMap parameters;
@@ -70,6 +74,12 @@ protected:
         ParserFunction splitLine(std::string line, std::string &command, std::string &rest);
         bool checkSpaces(std::string line);
     static std::ostringstream log;
+    static std::atomic<int> parameterGeneration;
+    static std::mutex cachedKeyMutex;
+    static void parametersChanged()
+    {
+        parameterGeneration.fetch_add(1, std::memory_order_release);
+    }
 public:
 
     static int getMaxThreads();
@@ -79,6 +89,7 @@ public:
     {
         ParameterVariant container = newValue;
         parameters[key] = container;
+        parametersChanged();
     }
 
     template<typename Value>
@@ -121,4 +132,57 @@ public:
         virtual void parse(bool fromPython) {};
 };
 
+/* Typed handle on a single key for code which reads it once per crystal,
+ * image or reflection. The key is looked up in the parameter map on first
+ * use and the value kept, so that later reads skip the map lookup and the
+ * variant copy; it is only looked up again after the parameters have changed
+ * (setKey() or parsing). Declare one as a static local next to its use:
+ *
+ *     static CachedKey<double> sphereThicknessKey("SPHERE_THICKNESS", 0.01);
+ *     double sphereThickness = sphereThicknessKey.get();
+ *
+ * The value is handed back as a copy, and the generation is only published
+ * once the value has been stored, so a thread which sees the current
+ * generation also sees its value. Like getKey(), this still assumes a key
+ * is not set at the very moment other threads are reading it. */
+
+template<typename Value>
+class CachedKey
+{
+private:
+    std::string key;
+    Value defaultValue;
+    Value value;
+    std::atomic<int> generation;
+
+public:
+    CachedKey(std::string newKey, Value newDefault)
+    {
+        key = newKey;
+        defaultValue = newDefault;
+        value = newDefault;
+        generation.store(-1, std::memory_order_relaxed);
+    }
+
+    Value get()
+    {
+        int current = FileParser::parameterGeneration.load(std::memory_order_acquire);
+
+        if (generation.load(std::memory_order_acquire) != current)
+        {
+            std::lock_guard<std::mutex> lock(FileParser::cachedKeyMutex);
+
+            if (generation.load(std::memory_order_relaxed) != current)
+            {
+                value = FileParser::getKey(key, defaultValue);
+                generation.store(current, std::memory_order_release);
+            }
+
+            return value;
+        }
+
+        return value;
+    }
+};
+
 #endif /* FILEPARSER_H_ */
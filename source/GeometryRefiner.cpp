@@ -15,6 +15,7 @@
 #include "IndexManager.h"
 #include "misc.h"
 #include "UnitCellLattice.h"
+#include "ThreadPool.h"
 
 PseudoScoreType pseudoScoreTypeForGeometryType(GeometryScoreType type)
 {
@@ -169,6 +170,8 @@ GeometryRefiner::GeometryRefiner()
     lastInterAngleScore = 0;
     lastIntraAngleScore = 0;
     _changed = true;
+    queueScoreType = GeometryScoreTypeInterMiller;
+    queueStrategyType = 0;
 }
 
 
@@ -487,17 +490,13 @@ DetectorPtr GeometryRefiner::getNextDetector()
 
 void GeometryRefiner::refineDetectorStrategyWrapper(GeometryRefiner *me, GeometryScoreType type, int strategyType)
 {
-        int maxThreads = FileParser::getMaxThreads();
+        ThreadPoolPtr pool = ThreadPool::getPool();
 
-        boost::thread_group threads;
+        me->queueScoreType = type;
+        me->queueStrategyType = strategyType;
 
-        for (int i = 0; i < maxThreads; i++)
-        {
-                boost::thread *thr = new boost::thread(refineDetectorWrapper, me, i, type, strategyType);
-                threads.add_thread(thr);
-        }
-
-        threads.join_all();
+        // each task keeps taking detectors off the queue until it is empty
+        pool->parallelFor(refineDetectorWrapper, me, pool->threadCount());
 
         std::ostringstream logged;
         logged << "Finished a round." << std::endl;
@@ -507,8 +506,11 @@ void GeometryRefiner::refineDetectorStrategyWrapper(GeometryRefiner *me, Geometr
         me->firstCycle = false;
 }
 
-void GeometryRefiner::refineDetectorWrapper(GeometryRefiner *me, int offset, GeometryScoreType type, int strategyType)
+void GeometryRefiner::refineDetectorWrapper(void *object, int offset)
 {
+        GeometryRefiner *me = static_cast<GeometryRefiner *>(object);
+        GeometryScoreType type = me->queueScoreType;
+        int strategyType = me->queueStrategyType;
         int maxCycles = FileParser::getKey("MAXIMUM_CYCLES", 0);
 
         while (true)
@@ -23,7 +23,7 @@ private:
     bool firstCycle;
     bool refineDetectorStrategy(DetectorPtr detector, GeometryScoreType type, int strategyType);
     static void refineDetectorStrategyWrapper(GeometryRefiner *me, GeometryScoreType type, int strategyType);
-    static void refineDetectorWrapper(GeometryRefiner *me, int offset, GeometryScoreType type, int strategyType);
+    static void refineDetectorWrapper(void *object, int offset);
     void refineGeometryCycle();
 
         void intraPanelCycle();
@@ -38,6 +38,8 @@ private:
         bool refineBeamCentre(DetectorPtr detector = DetectorPtr());
         std::vector<DetectorPtr> refineQueue;
         std::mutex queueMutex;
+        GeometryScoreType queueScoreType;
+        int queueStrategyType;
 
     void printHeader(std::vector<DetectorPtr> detectors, GeometryScoreType type);
 
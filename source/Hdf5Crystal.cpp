@@ -421,7 +421,7 @@ void Hdf5Crystal::loadReflections(PartialityModel model, bool special)
     {
         Hdf5Miller *data = &millerData[count];
 
-        MillerPtr miller = MillerPtr(new Miller(this, data->h, data->k, data->l));
+        MillerPtr miller = newMiller(data->h, data->k, data->l);
         miller->setFree(data->free);
         miller->setRawIntensity(data->rawIntensity);
         miller->setCountingSigma(data->countingSigma);
@@ -13,6 +13,7 @@
 #include "Hdf5ManagerProcessing.h"
 #include <fstream>
 #include "Hdf5Crystal.h"
+#include "Hdf5Prefetcher.h"
 
 typedef struct
 {
@@ -96,7 +97,8 @@ void Hdf5Image::loadImage()
         return;
     }
 
-    bool asFloat = FileParser::getKey("HDF5_AS_FLOAT", false);
+    static CachedKey<bool> asFloatKey("HDF5_AS_FLOAT", false);
+    bool asFloat = asFloatKey.get();
     Hdf5ManagerCheetahPtr manager = getManager();
 
     if (!manager)
@@ -127,7 +129,17 @@ void Hdf5Image::loadImage()
                 return;
         }*/
 
-    useShortData = (manager->bytesPerTypeForImageAddress(address) == 2);
+    bool useShortData = (manager->bytesPerTypeForImageAddress(address) == 2);
+    pixelType = useShortData ? PixelTypeShort : PixelTypeInt;
+
+    if (!_isMask && loadPrefetchedFrame(manager, address, asFloat))
+    {
+        logged << "Loaded prefetched data for " << getFilename() << std::endl;
+        sendLog();
+
+        finishLoading();
+        return;
+    }
 
     char *buffer;
 
@@ -155,14 +167,9 @@ void Hdf5Image::loadImage()
 
         if (asFloat)
         {
-            useShortData = false;
-            data.reserve(size / sizeof(int));
-            for (int i = 0; i < size; i += sizeof(float))
-            {
-                float value = 0;
-                memcpy(&value, &buffer[i], sizeof(float));
-                data.push_back(value);
-            }
+            pixelType = PixelTypeFloat;
+            floatData.resize(size / sizeof(float));
+            memcpy(&floatData[0], &buffer[0], size);
         }
         else if (!useShortData)
         {
@@ -187,6 +194,63 @@ void Hdf5Image::loadImage()
     logged << "Loaded data for " << getFilename() << std::endl;
     sendLog();
 
+    finishLoading();
+}
+
+bool Hdf5Image::loadPrefetchedFrame(Hdf5ManagerCheetahPtr manager, std::string address, bool asFloat)
+{
+    Hdf5PrefetcherPtr prefetcher = manager->getPrefetcher();
+    int frame = manager->numberForAddress(address);
+
+    if (!prefetcher || frame < 0)
+    {
+        return false;
+    }
+
+    int dims[2];
+
+    if (!manager->getImageSize(address, dims))
+    {
+        return false;
+    }
+
+    size_t bytes = prefetcher->getFrameBytes();
+    void *destination = NULL;
+
+    // copied straight out of the prefetched block into the pixel array
+    if (asFloat)
+    {
+        pixelType = PixelTypeFloat;
+        floatData.resize(bytes / sizeof(float));
+        destination = &floatData[0];
+    }
+    else if (pixelType == PixelTypeShort)
+    {
+        shortData.resize(bytes / sizeof(short));
+        destination = &shortData[0];
+    }
+    else
+    {
+        data.resize(bytes / sizeof(int));
+        destination = &data[0];
+    }
+
+    if (!prefetcher->copyFrame(frame, destination))
+    {
+        vector<float>().swap(floatData);
+        vector<short>().swap(shortData);
+        vector<int>().swap(data);
+        return false;
+    }
+
+    xDim = dims[1];
+    yDim = dims[0];
+
+    return true;
+}
+
+void Hdf5Image::finishLoading()
+{
     bool dumpImages = FileParser::getKey("DUMP_IMAGES", false);
 
     if (dumpImages)
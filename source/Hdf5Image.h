@@ -19,6 +19,8 @@ class Hdf5Image : public Image
 private:
     void failureMessage();
     virtual void loadImage();
+    bool loadPrefetchedFrame(Hdf5ManagerCheetahPtr manager, std::string address, bool asFloat);
+    void finishLoading();
     std::string imageAddress;
     std::string findAddress();
     Hdf5ManagerCheetahPtr chManager;
@@ -52,7 +54,7 @@ public:
         setFilename("tag-mask.img");
         loadImage();
 
-        if (shortData.size() || data.size())
+        if (isLoaded())
         {
             setImageMask(shared_from_this());
         }
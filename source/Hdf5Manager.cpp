@@ -515,6 +515,97 @@ bool Hdf5Manager::dataForAddress(std::string dataAddress, void **buffer, int off
     }
 }
 
+bool Hdf5Manager::dataForFrames(std::string dataAddress, int start, int count, void *buffer)
+{
+    std::lock_guard<std::mutex> lg(readingHdf5);
+
+    try
+    {
+        hid_t dataset = H5Dopen1(handle, dataAddress.c_str());
+
+        if (dataset < 0)
+        {
+            return false;
+        }
+
+        hid_t type = H5Dget_type(dataset);
+        hid_t space = H5Dget_space(dataset);
+        int numDims = H5Sget_simple_extent_ndims(space);
+        bool success = (numDims == 3);
+
+        if (success)
+        {
+            hsize_t dims[3];
+            H5Sget_simple_extent_dims(space, dims, NULL);
+
+            /* consecutive frames of a stack of images in one read */
+            hsize_t unsigned_offset[3] = {(hsize_t)start, 0, 0};
+            hsize_t counts[3] = {(hsize_t)count, dims[1], dims[2]};
+
+            H5Sselect_hyperslab(space, H5S_SELECT_SET, unsigned_offset, NULL, counts, NULL);
+            hid_t memspace_id = H5Screate_simple(3, counts, NULL);
+
+            success = (H5Dread(dataset, type, memspace_id, space, H5P_DEFAULT, buffer) >= 0);
+
+            H5Sclose(memspace_id);
+        }
+
+        H5Sclose(space);
+        H5Tclose(type);
+        H5Dclose(dataset);
+
+        return success;
+    }
+    catch (std::exception e)
+    {
+        return false;
+    }
+}
+
+// number of frames in each chunk of a stack of images, 1 if the stack
+// is not chunked, or 0 if this is not a stack of images at all.
+int Hdf5Manager::chunkFramesForDataset(std::string dataAddress)
+{
+    std::lock_guard<std::mutex> lg(readingHdf5);
+
+    try
+    {
+        hid_t dataset = H5Dopen1(handle, dataAddress.c_str());
+
+        if (dataset < 0)
+        {
+            return 0;
+        }
+
+        hid_t space = H5Dget_space(dataset);
+        hid_t plist = H5Dget_create_plist(dataset);
+        int numDims = H5Sget_simple_extent_ndims(space);
+        int frames = 0;
+
+        if (numDims == 3)
+        {
+            frames = 1;
+
+            if (H5Pget_layout(plist) == H5D_CHUNKED)
+            {
+                hsize_t chunkDims[3];
+                H5Pget_chunk(plist, 3, chunkDims);
+                frames = (int)chunkDims[0];
+            }
+        }
+
+        H5Pclose(plist);
+        H5Sclose(space);
+        H5Dclose(dataset);
+
+        return frames;
+    }
+    catch (std::exception e)
+    {
+        return 0;
+    }
+}
+
 void Hdf5Manager::turnOffErrors()
 {
  //   return;
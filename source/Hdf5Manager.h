@@ -79,6 +79,8 @@ public:
     bool createDataset(std::string address, int nDimensions, hsize_t *dims, hid_t type);
     bool writeDataset(std::string address, void **buffer, hid_t type);
     bool dataForAddress(std::string address, void **buffer, int offset = -1);
+    bool dataForFrames(std::string dataAddress, int start, int count, void *buffer);
+    int chunkFramesForDataset(std::string dataAddress);
     void identifiersFromAddress(std::map<std::string, int> *map, std::vector<std::string> *list, std::string idAddress);
     virtual bool getImageSize(std::string dataAddress, int *dims);
 
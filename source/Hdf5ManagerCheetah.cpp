@@ -23,10 +23,13 @@
 #include "Hdf5ManagerCheetahSacla.h"
 #include "FileParser.h"
 #include "misc.h"
+#include "Hdf5Prefetcher.h"
 
 std::string Hdf5ManagerCheetah::maskAddress;
 std::vector<Hdf5ManagerCheetahPtr> Hdf5ManagerCheetah::cheetahManagers;
 std::mutex Hdf5ManagerCheetah::readingPaths;
+std::vector<Hdf5ManagerCheetah *> Hdf5ManagerCheetah::prefetchingManagers;
+std::mutex Hdf5ManagerCheetah::prefetchingMutex;
 
 void Hdf5ManagerCheetah::initialiseCheetahManagers()
 {
@@ -114,10 +117,115 @@ void Hdf5ManagerCheetah::closeHdf5Files()
 {
     for (int i = 0; i < cheetahManagers.size(); i++)
     {
+        cheetahManagers[i]->prefetcher = Hdf5PrefetcherPtr();
         cheetahManagers[i]->closeHdf5();
     }
 }
 
+Hdf5PrefetcherPtr Hdf5ManagerCheetah::getPrefetcher()
+{
+    Hdf5PrefetcherPtr started;
+
+    {
+        std::lock_guard<std::mutex> lg(prefetcherMutex);
+
+        if (checkedPrefetcher)
+        {
+            // the reader has stopped and freed its buffers
+            if (prefetcher && prefetcher->isFinished())
+            {
+                prefetcher = Hdf5PrefetcherPtr();
+            }
+
+            return prefetcher;
+        }
+
+        checkedPrefetcher = true;
+        prefetcher = createPrefetcher();
+        started = prefetcher;
+    }
+
+    if (started)
+    {
+        limitPrefetchingFiles();
+    }
+
+    return started;
+}
+
+Hdf5PrefetcherPtr Hdf5ManagerCheetah::createPrefetcher()
+{
+    int requestedFrames = FileParser::getKey("HDF5_PREFETCH_FRAMES", 0);
+
+    if (requestedFrames <= 0 || imageAddressCount() == 0)
+    {
+        return Hdf5PrefetcherPtr();
+    }
+
+    int chunkFrames = chunkFramesForImages();
+
+    if (chunkFrames <= 0)
+    {
+        return Hdf5PrefetcherPtr();
+    }
+
+    std::string firstAddress = imageAddress(0);
+    int dims[2];
+
+    if (!getImageSize(firstAddress, dims))
+    {
+        return Hdf5PrefetcherPtr();
+    }
+
+    size_t frameBytes = bytesPerTypeForImageAddress(firstAddress) * dims[0] * dims[1];
+
+    if (frameBytes == 0)
+    {
+        return Hdf5PrefetcherPtr();
+    }
+
+    return Hdf5PrefetcherPtr(new Hdf5Prefetcher(this, frameBytes, imageAddressCount(),
+                                                chunkFrames, requestedFrames));
+}
+
+// Called without prefetcherMutex held, so that only one manager's mutex
+// is ever taken at a time.
+void Hdf5ManagerCheetah::limitPrefetchingFiles()
+{
+    std::vector<Hdf5ManagerCheetah *> stopping;
+
+    {
+        std::lock_guard<std::mutex> lg(prefetchingMutex);
+        prefetchingManagers.push_back(this);
+
+        while (prefetchingManagers.size() > HDF5_PREFETCH_FILES)
+        {
+            stopping.push_back(prefetchingManagers[0]);
+            prefetchingManagers.erase(prefetchingManagers.begin());
+        }
+    }
+
+    for (int i = 0; i < stopping.size(); i++)
+    {
+        Hdf5PrefetcherPtr old;
+
+        {
+            std::lock_guard<std::mutex> lg(stopping[i]->prefetcherMutex);
+            old = stopping[i]->prefetcher;
+            stopping[i]->prefetcher = Hdf5PrefetcherPtr();
+        }
+
+        if (old)
+        {
+            logged << "Stopped prefetching from " << stopping[i]->getFilename() << "." << std::endl;
+            sendLog(LogLevelDetailed);
+        }
+
+        // the reader thread is joined once images still copying from it
+        // have let go
+    }
+}
+
 std::string Hdf5ManagerCheetah::addressForImage(std::string imageName)
 {
     // maybe imageName has .img extension, so let's get rid of it
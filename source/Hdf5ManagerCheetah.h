@@ -42,6 +42,18 @@ protected:
     std::map<std::string, int> imagePathMap;
     static std::mutex readingPaths;
 
+    Hdf5PrefetcherPtr prefetcher;
+    bool checkedPrefetcher;
+    std::mutex prefetcherMutex;
+
+    /* Files with a prefetcher, oldest first; only HDF5_PREFETCH_FILES are
+     * kept going, and older files go back to reading frames directly. */
+    static std::vector<Hdf5ManagerCheetah *> prefetchingManagers;
+    static std::mutex prefetchingMutex;
+
+    Hdf5PrefetcherPtr createPrefetcher();
+    void limitPrefetchingFiles();
+
     static std::string maskAddress;
 
 public:
@@ -49,6 +61,7 @@ public:
                        Hdf5AccessType accessType = Hdf5AccessTypeReadOnly) : Hdf5Manager(newName, accessType)
     {
         maskAddress = FileParser::getKey("HDF5_MASK_ADDRESS", std::string("/entry_1/instrument_1/detector_1/mask_shared"));
+        checkedPrefetcher = false;
     };
 
     static Hdf5ManagerCheetahPtr hdf5ManagerForImage(std::string imageName);
@@ -61,6 +74,11 @@ public:
     virtual int hdf5MallocBytesForImage(std::string address, void **buffer) { return 0; };
     virtual size_t bytesPerTypeForImageAddress(std::string address) { return 0; };
 
+    // only for files which stack many images in one dataset
+    virtual bool dataForImageRange(int start, int count, void *buffer) { return false; };
+    virtual int chunkFramesForImages() { return 0; };
+    Hdf5PrefetcherPtr getPrefetcher();
+
     static std::string getMaskAddress()
     {
         return maskAddress;
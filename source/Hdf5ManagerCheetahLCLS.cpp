@@ -94,3 +94,13 @@ size_t Hdf5ManagerCheetahLCLS::bytesPerTypeForImageAddress(std::string address)
 {
     return Hdf5Manager::bytesPerTypeForDatasetAddress(dataAddress);
 }
+
+bool Hdf5ManagerCheetahLCLS::dataForImageRange(int start, int count, void *buffer)
+{
+    return Hdf5Manager::dataForFrames(dataAddress, start, count, buffer);
+}
+
+int Hdf5ManagerCheetahLCLS::chunkFramesForImages()
+{
+    return Hdf5Manager::chunkFramesForDataset(dataAddress);
+}
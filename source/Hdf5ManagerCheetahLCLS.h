@@ -56,6 +56,8 @@ public:
     virtual int hdf5MallocBytesForImage(std::string address, void **buffer);
     virtual size_t bytesPerTypeForImageAddress(std::string address);
     virtual bool getImageSize(std::string address, int *dims);
+    virtual bool dataForImageRange(int start, int count, void *buffer);
+    virtual int chunkFramesForImages();
 };
 
 #endif /* defined(__cppxfel__Hdf5ManagerCheetahLCLS__) */
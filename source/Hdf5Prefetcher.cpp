@@ -0,0 +1,262 @@
+//
+//  Hdf5Prefetcher.cpp
+//   cppxfel - a collection of processing algorithms for XFEL diffraction data.
+
+//    Copyright (C) 2017  Helen Ginn
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "Hdf5Prefetcher.h"
+#include "Hdf5ManagerCheetah.h"
+#include <string.h>
+
+Hdf5Prefetcher::Hdf5Prefetcher(Hdf5ManagerCheetah *newManager, size_t newFrameBytes,
+                               int newFrameCount, int newChunkFrames, int requestedFrames)
+{
+    manager = newManager;
+    frameBytes = newFrameBytes;
+    frameCount = newFrameCount;
+    chunkFrames = (newChunkFrames < 1) ? 1 : newChunkFrames;
+
+    // whole chunks only, so that no chunk is decompressed twice
+    int chunks = (requestedFrames + chunkFrames - 1) / chunkFrames;
+    blockFrames = (chunks < 1 ? 1 : chunks) * chunkFrames;
+
+    blocks.resize(HDF5_PREFETCH_BLOCKS);
+
+    for (int i = 0; i < blocks.size(); i++)
+    {
+        blocks[i].start = -1;
+        blocks[i].count = 0;
+        blocks[i].remaining = 0;
+        blocks[i].ready = false;
+        blocks[i].failed = false;
+        blocks[i].bytes.resize(blockFrames * frameBytes);
+    }
+
+    nextStart = 0;
+    shuttingDown = false;
+    finished = false;
+
+    logged << "Prefetching " << blockFrames << " frames at a time from "
+    << manager->getFilename() << " (chunks of " << chunkFrames << ")." << std::endl;
+    sendLog(LogLevelDetailed);
+
+    reader = new boost::thread(readerLoop, this);
+}
+
+Hdf5Prefetcher::~Hdf5Prefetcher()
+{
+    {
+        std::lock_guard<std::mutex> lock(blockMutex);
+        shuttingDown = true;
+        blockFree.notify_all();
+    }
+
+    reader->join();
+    delete reader;
+}
+
+int Hdf5Prefetcher::blockContaining(int frame)
+{
+    for (int i = 0; i < blocks.size(); i++)
+    {
+        if (blocks[i].start >= 0 && frame >= blocks[i].start &&
+            frame < blocks[i].start + blocks[i].count)
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+bool Hdf5Prefetcher::isFinished()
+{
+    std::lock_guard<std::mutex> lock(blockMutex);
+    return finished;
+}
+
+int Hdf5Prefetcher::freeBlock()
+{
+    for (int i = 0; i < blocks.size(); i++)
+    {
+        if (blocks[i].start < 0)
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+int Hdf5Prefetcher::heldBlocks()
+{
+    int held = 0;
+
+    for (int i = 0; i < blocks.size(); i++)
+    {
+        held += (blocks[i].start >= 0);
+    }
+
+    return held;
+}
+
+void Hdf5Prefetcher::recycleOldestBlockBefore(int frame)
+{
+    int oldest = -1;
+
+    for (int i = 0; i < blocks.size(); i++)
+    {
+        if (blocks[i].start < 0 || !blocks[i].ready ||
+            blocks[i].start + blocks[i].count > frame)
+        {
+            continue;
+        }
+
+        if (oldest < 0 || blocks[i].start < blocks[oldest].start)
+        {
+            oldest = i;
+        }
+    }
+
+    if (oldest >= 0 && freeBlock() < 0)
+    {
+        blocks[oldest].start = -1;
+        blockFree.notify_all();
+    }
+}
+
+void Hdf5Prefetcher::readerLoop(Hdf5Prefetcher *me)
+{
+    std::unique_lock<std::mutex> lock(me->blockMutex);
+
+    while (true)
+    {
+        int index = -1;
+
+        while (!me->shuttingDown)
+        {
+            if (me->nextStart < me->frameCount)
+            {
+                index = me->freeBlock();
+
+                if (index >= 0)
+                {
+                    break;
+                }
+            }
+            else if (me->heldBlocks() == 0)
+            {
+                // every frame has been read and taken
+                std::vector<FrameBlock>().swap(me->blocks);
+                me->finished = true;
+                me->blockReady.notify_all();
+                return;
+            }
+
+            me->blockFree.wait(lock);
+        }
+
+        if (me->shuttingDown)
+        {
+            return;
+        }
+
+        FrameBlock &block = me->blocks[index];
+        block.start = me->nextStart;
+        block.count = std::min(me->blockFrames, me->frameCount - me->nextStart);
+        block.ready = false;
+        me->nextStart += block.count;
+
+        lock.unlock();
+        bool success = me->manager->dataForImageRange(block.start, block.count, &block.bytes[0]);
+        lock.lock();
+
+        block.ready = true;
+        block.failed = !success;
+        block.remaining = block.count;
+        block.taken.assign(block.count, false);
+        me->blockReady.notify_all();
+    }
+}
+
+bool Hdf5Prefetcher::copyFrame(int frame, void *destination)
+{
+    if (frame < 0 || frame >= frameCount)
+    {
+        return false;
+    }
+
+    std::unique_lock<std::mutex> lock(blockMutex);
+
+    while (true)
+    {
+        int index = blockContaining(frame);
+
+        if (index >= 0)
+        {
+            FrameBlock &block = blocks[index];
+
+            if (!block.ready)
+            {
+                blockReady.wait(lock);
+                continue;
+            }
+
+            bool success = !block.failed;
+
+            if (success)
+            {
+                memcpy(destination, &block.bytes[(frame - block.start) * frameBytes], frameBytes);
+            }
+
+            // asking for a frame again does not count towards freeing the block
+            if (!block.taken[frame - block.start])
+            {
+                block.taken[frame - block.start] = true;
+                block.remaining--;
+            }
+
+            if (block.remaining <= 0)
+            {
+                block.start = -1;
+                blockFree.notify_all();
+            }
+
+            return success;
+        }
+
+        if (frame < nextStart)
+        {
+            // already read and recycled; caller falls back to a direct read
+            return false;
+        }
+
+        // everything still held lies behind this frame. Frames which were
+        // skipped keep their blocks from being reused, so give the oldest
+        // one up if the reader has nowhere to go, and if the frame is
+        // beyond the next block move the reader up to it.
+        recycleOldestBlockBefore(frame);
+
+        if (frame >= nextStart + blockFrames)
+        {
+            nextStart = (frame / chunkFrames) * chunkFrames;
+            blockFree.notify_all();
+        }
+
+        blockReady.wait(lock);
+    }
+}
@@ -0,0 +1,102 @@
+//
+//  Hdf5Prefetcher.h
+//   cppxfel - a collection of processing algorithms for XFEL diffraction data.
+
+//    Copyright (C) 2017  Helen Ginn
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifndef __cppxfel__Hdf5Prefetcher__
+#define __cppxfel__Hdf5Prefetcher__
+
+#include <stdio.h>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <boost/thread/thread.hpp>
+#include "parameters.h"
+#include "LoggableObject.h"
+
+// number of blocks of frames held in memory per HDF5 file
+#define HDF5_PREFETCH_BLOCKS 3
+
+// number of HDF5 files which may be prefetched from at any one time
+#define HDF5_PREFETCH_FILES 2
+
+/* Reads consecutive frames of a stacked (LCLS/CXI style) image dataset
+ * ahead of time on a background thread. Frames are read a block at a time,
+ * with block boundaries on the dataset's chunk boundaries, into a small
+ * pool of buffers which are reused once every frame in a block has been
+ * taken. Images are expected to be requested roughly in file order: asking
+ * for a frame ahead of the reader moves the reader forward, recycling the
+ * oldest blocks behind that frame if none are free. copyFrame()
+ * returns false for frames which have already gone past, in which case
+ * the caller reads the frame directly instead. Once the whole dataset has
+ * been read and every block taken, the reader stops and the buffers are
+ * freed; isFinished() then returns true. Reads still go through the
+ * process-wide HDF5 lock (the library is not thread-safe), so the reader
+ * only overlaps with work other than HDF5 access. */
+
+class Hdf5Prefetcher : public LoggableObject
+{
+private:
+    typedef struct
+    {
+        int start;
+        int count;
+        int remaining;
+        bool ready;
+        bool failed;
+        std::vector<char> taken;
+        std::vector<char> bytes;
+    } FrameBlock;
+
+    Hdf5ManagerCheetah *manager;
+    size_t frameBytes;
+    int frameCount;
+    int blockFrames;
+    int chunkFrames;
+
+    std::vector<FrameBlock> blocks;
+    int nextStart;
+    bool shuttingDown;
+    bool finished;
+
+    std::mutex blockMutex;
+    std::condition_variable blockReady;
+    std::condition_variable blockFree;
+    boost::thread *reader;
+
+    int blockContaining(int frame);
+    int freeBlock();
+    int heldBlocks();
+    void recycleOldestBlockBefore(int frame);
+    static void readerLoop(Hdf5Prefetcher *me);
+
+public:
+    Hdf5Prefetcher(Hdf5ManagerCheetah *newManager, size_t newFrameBytes,
+                   int newFrameCount, int newChunkFrames, int requestedFrames);
+    ~Hdf5Prefetcher();
+
+    bool copyFrame(int frame, void *destination);
+    bool isFinished();
+
+    size_t getFrameBytes()
+    {
+        return frameBytes;
+    }
+};
+
+#endif /* defined(__cppxfel__Hdf5Prefetcher__) */
@@ -27,12 +27,19 @@
 #include "SpotFinderQuick.h"
 #include "SpotFinderCorrelation.h"
 #include "Detector.h"
+#include "SpotGrid.h"
+#include "ThreadPool.h"
+#include "ObjectPool.h"
+#include "OrientationIndex.h"
+#include <algorithm>
 
 
 std::vector<DetectorPtr> Image::perPixelDetectors;
 vector<signed char> Image::generalMask;
 ImagePtr Image::_imageMask;
 std::mutex Image::setupMutex;
+std::mutex Image::imageMaskMutex;
+Image *Image::resolvedImageMask = NULL;
 bool Image::interpolate = false;
 
 Image::Image(std::string filename, double wavelength,
@@ -73,6 +80,7 @@ Image::Image(std::string filename, double wavelength,
     indexingFailureCount = 0;
     data = vector<int>();
     shortData = vector<short>();
+    floatData = vector<float>();
     mmPerPixel = FileParser::getKey("MM_PER_PIXEL", MM_PER_PIXEL);
 
     shouldMaskValue = FileParser::hasKey("IMAGE_MASKED_VALUE");
@@ -81,7 +89,7 @@ Image::Image(std::string filename, double wavelength,
     maskedValue = 0;
     maskedUnderValue = 0;
         distanceOffset = 0;
-    useShortData = false;
+    pixelType = PixelTypeInt;
 
     if (shouldMaskValue)
         maskedValue = FileParser::getKey("IMAGE_MASKED_VALUE", 0);
@@ -100,6 +108,7 @@ Image::Image(std::string filename, double wavelength,
         }
 
     _hasSeeded = false;
+    spotVectorPool = ObjectPool::create();
 
     int tempShoebox[7][7] =
     {
@@ -177,12 +186,13 @@ void Image::applyMaskToImages(vector<ImagePtr> images, int startX,
 bool Image::isLoaded()
 {
 
-    return (data.size() > 0 || shortData.size() > 0);
+    return (data.size() > 0 || shortData.size() > 0 || floatData.size() > 0);
 }
 
 void Image::setImageData(vector<int> newData)
 {
     data.resize(newData.size());
+    pixelType = PixelTypeInt;
 
     memcpy(&data[0], &newData[0], newData.size() * sizeof(int));
 }
@@ -193,6 +203,7 @@ void Image::newImage()
     fake = true;
 
     data = std::vector<int>(totalPixels, 0);
+    pixelType = PixelTypeInt;
     overlapMask = vector<signed char>(totalPixels, 0);
 
     checkAndSetupLookupTable();
@@ -292,53 +303,42 @@ void Image::loadImage()
 
     bool asFloat = FileParser::getKey("HDF5_AS_FLOAT", false);
 
-    std::streampos size;
-    vector<char> memblock;
-
-    std::ifstream file(getFilename().c_str(), std::ios::in | std::ios::binary);
+    // opened at the end, to find the size before reading it in one go
+    std::ifstream file(getFilename().c_str(), std::ios::in | std::ios::binary | std::ios::ate);
     if (file.is_open())
     {
-        size = file.tellg();
-        memblock = vector<char>();
-
-        char c = file.get();
-
-        while (file.good())
-        {
-            memblock.push_back(c);
-            c = file.get();
-        }
+        size_t size = file.tellg();
+        file.seekg(0, std::ios::beg);
 
         int bitsPerPixel = FileParser::getKey("BITS_PER_PIXEL", 32);
-        useShortData = (bitsPerPixel == 16);
-                overlapMask = vector<signed char>(memblock.size(), 0);
-
-        if (!useShortData)
-            data.resize(memblock.size() / sizeof(int));
-        else
-            shortData.resize(memblock.size() / sizeof(short));
+        pixelType = (bitsPerPixel == 16) ? PixelTypeShort : PixelTypeInt;
+        pixelType = asFloat ? PixelTypeFloat : pixelType;
+                overlapMask = vector<signed char>(size, 0);
 
-        logged << "Image size: " << memblock.size() << " for image: "
+        logged << "Image size: " << size << " for image: "
         << getFilename() << std::endl;
         sendLog();
 
-        if (asFloat)
+        if (pixelType == PixelTypeFloat)
         {
-            data.reserve(size / sizeof(int));
+            floatData.resize(size / sizeof(float));
 
-            for (int i = 0; i < memblock.size(); i += sizeof(float))
-            {
-                float value = (float)memblock[i];
-                data.push_back(value);
-            }
+            if (floatData.size())
+                file.read((char *)&floatData[0], floatData.size() * sizeof(float));
         }
-        else if (!useShortData)
+        else if (pixelType == PixelTypeInt)
         {
-            memcpy(&data[0], &memblock[0], memblock.size());
+            data.resize(size / sizeof(int));
+
+            if (data.size())
+                file.read((char *)&data[0], data.size() * sizeof(int));
         }
-        else if (useShortData)
+        else if (pixelType == PixelTypeShort)
         {
-            memcpy(&shortData[0], &memblock[0], memblock.size());
+            shortData.resize(size / sizeof(short));
+
+            if (shortData.size())
+                file.read((char *)&shortData[0], shortData.size() * sizeof(short));
         }
     }
     else
@@ -364,6 +364,9 @@ void Image::dropImage()
     shortData.clear();
     vector<short>().swap(shortData);
 
+    floatData.clear();
+    vector<float>().swap(floatData);
+
     overlapMask.clear();
     vector<signed char>().swap(overlapMask);
 
@@ -390,7 +393,7 @@ void Image::addValueAt(int x, int y, int addedValue)
     data[position] = std::max(data[position], addedValue);
 }
 
-int Image::rawValueAt(int x, int y)
+double Image::rawValueAt(int x, int y)
 {
     loadImage();
 
@@ -407,18 +410,15 @@ int Image::rawValueAt(int x, int y)
 
     int position = y * xDim + x;
 
-    if (!useShortData)
+    switch (pixelType)
     {
-        if (position < 0 || position >= data.size())
-            return 0;
+        case PixelTypeShort:
+            return pixelValueAt(shortData, position);
+        case PixelTypeFloat:
+            return pixelValueAt(floatData, position);
+        default:
+            return pixelValueAt(data, position);
     }
-    else
-    {
-        if (position < 0 || position >= shortData.size())
-            return 0;
-    }
-
-    return (useShortData ? shortData[position] : data[position]);
 }
 
 double Image::interpolateAt(double x, double y, double *total)
@@ -581,7 +581,7 @@ void Image::focusOnAverageMax(double *x, double *y, int tolerance1, int toleranc
     *y = (double)newY + 0.5;
 }
 
-Mask Image::flagAtShoeboxIndex(ShoeboxPtr shoebox, int x, int y)
+Mask Image::flagAtShoeboxIndex(ShoeboxPtr &shoebox, int x, int y)
 {
     Mask flag = MaskNeither;
 
@@ -596,7 +596,7 @@ Mask Image::flagAtShoeboxIndex(ShoeboxPtr shoebox, int x, int y)
     return flag;
 }
 
-double Image::weightAtShoeboxIndex(ShoeboxPtr shoebox, int x, int y)
+double Image::weightAtShoeboxIndex(ShoeboxPtr &shoebox, int x, int y)
 {
     double value = (*shoebox)[x][y];
 
@@ -712,15 +712,190 @@ void Image::dumpImage()
     std::ofstream imgStream;
     imgStream.open(getFilename().c_str(), std::ios::binary);
 
-    long int size = useShortData ? shortData.size() : data.size();
-    size *= useShortData ? sizeof(short) : sizeof(int);
-    char *start = useShortData ? (char *)&shortData[0] : (char *)&data[0];
+    long int size = data.size() * sizeof(int);
+    char *start = (char *)&data[0];
+
+    if (pixelType == PixelTypeShort)
+    {
+        size = shortData.size() * sizeof(short);
+        start = (char *)&shortData[0];
+    }
+    else if (pixelType == PixelTypeFloat)
+    {
+        size = floatData.size() * sizeof(float);
+        start = (char *)&floatData[0];
+    }
 
     imgStream.write(start, size);
 
     imgStream.close();
 }
 
+// valueAt() only looks at the mask image the first time it meets a
+// pixel, so accepted() used to let through masked pixels which no image
+// had read yet. Applying the whole mask image to generalMask once up
+// front rejects every masked pixel, whichever order pixels are read in.
+// Called once per crystal, so the lock is always taken.
+void Image::resolveImageMask()
+{
+    ImagePtr mask = getImageMask();
+
+    if (!mask || &*mask == this)
+    {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(imageMaskMutex);
+
+    if (&*mask == resolvedImageMask || generalMask.size() == 0)
+    {
+        return;
+    }
+
+    for (int y = 0; y < yDim; y++)
+    {
+        for (int x = 0; x < xDim; x++)
+        {
+            int pos = y * xDim + x;
+
+            if (pos >= generalMask.size())
+            {
+                break;
+            }
+
+            if (generalMask[pos] < 0 || generalMask[pos] == 1)
+            {
+                generalMask[pos] = (mask->valueAt(x, y) > 0) ? 0 : 2;
+            }
+        }
+    }
+
+    resolvedImageMask = &*mask;
+}
+
+template <class Value>
+void Image::readPixelWindow(vector<Value> &pixels, PixelWindow *window)
+{
+    int slowSide = (int)window->xs.size();
+    int fastSide = (int)window->ys.size();
+    int total = xDim * yDim;
+    int maskSize = (int)generalMask.size();
+    int detectorSize = (int)perPixelDetectors.size();
+    bool loaded = isLoaded();
+
+    window->values.resize(slowSide * fastSide);
+    window->acceptable.resize(slowSide * fastSide);
+
+    for (int i = 0; i < slowSide; i++)
+    {
+        int x = window->xs[i];
+
+        for (int j = 0; j < fastSide; j++)
+        {
+            int y = window->ys[j];
+            int pos = y * xDim + x;
+            int index = i * fastSide + j;
+
+            // as rawValueAt()
+            double raw = 0;
+
+            if (loaded && x >= 0 && y >= 0 && x <= xDim && y <= yDim)
+            {
+                raw = pixelValueAt(pixels, pos);
+            }
+
+            // as accepted()
+            bool inside = (pos >= 0 && pos <= total);
+            bool masked = (inside && pos < maskSize && generalMask[pos] == 0);
+            bool acceptable = (inside && !masked);
+            double rawValue = raw;
+
+            if (acceptable && shouldMaskValue && rawValue == maskedValue)
+            {
+                acceptable = false;
+            }
+
+            if (acceptable && shouldMaskUnderValue && rawValue <= maskedUnderValue)
+            {
+                acceptable = false;
+            }
+
+            // as valueAt()
+            int value = 0;
+
+            if (inside && !masked && pos < detectorSize)
+            {
+                Detector *det = perPixelDetectors[pos].get();
+
+                if (det)
+                {
+                    value = rawValue / det->getGain();
+                }
+            }
+
+            window->values[index] = value;
+            window->acceptable[index] = acceptable;
+        }
+    }
+}
+
+void Image::fillPixelWindow(double x, double y, ShoeboxPtr &shoebox, bool planeFit, PixelWindow *window)
+{
+    int centreX = 0;
+    int centreY = 0;
+
+    shoebox->centre(&centreX, &centreY);
+
+    int slowSide = 0;
+    int fastSide = 0;
+
+    shoebox->sideLengths(&slowSide, &fastSide);
+
+    window->xs.resize(slowSide);
+    window->ys.resize(fastSide);
+
+    // same pixel coordinates as the per-pixel integration always used
+    for (int i = 0; i < slowSide; i++)
+    {
+        double panelPixelX = (i - centreX) + (planeFit ? (int)x : x);
+
+        if (!planeFit && shoebox->isEven())
+        {
+            panelPixelX += 0.5;
+        }
+
+        window->xs[i] = panelPixelX;
+    }
+
+    for (int j = 0; j < fastSide; j++)
+    {
+        double panelPixelY = (j - centreY) + (planeFit ? (int)y : y);
+
+        if (!planeFit && shoebox->isEven())
+        {
+            panelPixelY += 0.5;
+        }
+
+        window->ys[j] = panelPixelY;
+    }
+
+    loadImage();
+    resolveImageMask();
+
+    switch (pixelType)
+    {
+        case PixelTypeShort:
+            readPixelWindow(shortData, window);
+            break;
+        case PixelTypeFloat:
+            readPixelWindow(floatData, window);
+            break;
+        default:
+            readPixelWindow(data, window);
+            break;
+    }
+}
+
 double Image::integrateFitBackgroundPlane(int x, int y, ShoeboxPtr shoebox, float *error)
 {
     int centreX = 0;
@@ -733,19 +908,27 @@ double Image::integrateFitBackgroundPlane(int x, int y, ShoeboxPtr shoebox, floa
 
     shoebox->sideLengths(&slowSide, &fastSide);
 
+    PixelWindow window;
+    fillPixelWindow(x, y, shoebox, true, &window);
+
+    // called from several threads at once by integrateMillers()
+    bool debug = (Logger::getPriorityLevel() >= LogLevelDebug);
+    std::ostringstream debugLog;
+
     std::vector<double> xxs, xys, xs, yys, ys, xzs, yzs, zs, allXs, allYs, allZs;
 
     for (int i = 0; i < slowSide; i++)
     {
-        int panelPixelX = (i - centreX) + x;
+        int panelPixelX = window.xs[i];
 
         for (int j = 0; j < fastSide; j++)
         {
-            int panelPixelY = (j - centreY) + y;
+            int panelPixelY = window.ys[j];
+            int index = i * fastSide + j;
 
             Mask flag = flagAtShoeboxIndex(shoebox, i, j);
 
-            if (!accepted(panelPixelX, panelPixelY))
+            if (!window.acceptable[index])
             {
                 return std::nan(" ");
             }
@@ -755,7 +938,7 @@ double Image::integrateFitBackgroundPlane(int x, int y, ShoeboxPtr shoebox, floa
 
             double newX = panelPixelX;
             double newY = panelPixelY;
-            double newZ = valueAt(panelPixelX, panelPixelY);
+            double newZ = window.values[index];
 
             allXs.push_back(newX);
             allYs.push_back(newY);
@@ -782,8 +965,12 @@ double Image::integrateFitBackgroundPlane(int x, int y, ShoeboxPtr shoebox, floa
         }
     }
 
-    logged << "Rejected background pixels: " << rejected << std::endl;
-    sendLog(LogLevelDebug);
+    if (debug)
+    {
+        debugLog << "Rejected background pixels: " << rejected << std::endl;
+        Logger::mainLogger->addStream(&debugLog, LogLevelDebug);
+        debugLog.str("");
+    }
 
     for (int i = 0; i < allZs.size(); i++)
     {
@@ -848,15 +1035,18 @@ double Image::integrateFitBackgroundPlane(int x, int y, ShoeboxPtr shoebox, floa
     double foreground = 0;
     int num = 0;
 
-    logged << "Foreground pixels: ";
+    if (debug)
+    {
+        debugLog << "Foreground pixels: ";
+    }
 
     for (int i = 0; i < slowSide; i++)
     {
-        int panelPixelX = (i - centreX) + x;
+        int panelPixelX = window.xs[i];
 
         for (int j = 0; j < fastSide; j++)
         {
-            int panelPixelY = (j - centreY) + y;
+            int panelPixelY = window.ys[j];
 
             Mask flag = flagAtShoeboxIndex(shoebox, i, j);
 
@@ -866,15 +1056,17 @@ double Image::integrateFitBackgroundPlane(int x, int y, ShoeboxPtr shoebox, floa
             else if (flag == MaskForeground)
             {
                 double weight = weightAtShoeboxIndex(shoebox, i, j);
-                double total = valueAt(panelPixelX, panelPixelY);
-
-                logged << "F:" << total << ", ";
+                double total = window.values[i * fastSide + j];
 
                 foreground += total * weight;
                 num++;
 
                 double backTotal = (p * panelPixelX + q * panelPixelY + r);
-                logged << "B:" << backTotal << ", ";
+
+                if (debug)
+                {
+                    debugLog << "F:" << total << ", " << "B:" << backTotal << ", ";
+                }
 
                 backgroundInSignal += backTotal * weight;
             }
@@ -884,14 +1076,16 @@ double Image::integrateFitBackgroundPlane(int x, int y, ShoeboxPtr shoebox, floa
     }
 
 
-    logged << "Background: " << backgroundInSignal << std::endl;
-    logged << "Foreground: " << foreground << std::endl;
-
     double signalOnly = foreground - backgroundInSignal;
     *error = sqrt(foreground);
 
-    logged << std::endl;
-    sendLog(LogLevelDebug);
+    if (debug)
+    {
+        debugLog << "Background: " << backgroundInSignal << std::endl;
+        debugLog << "Foreground: " << foreground << std::endl;
+        debugLog << std::endl;
+        Logger::mainLogger->addStream(&debugLog, LogLevelDebug);
+    }
 
     return signalOnly;
 }
@@ -916,6 +1110,9 @@ double Image::integrateSimpleSummation(double x, double y, ShoeboxPtr shoebox, f
 
     int rejects = 0;
 
+    PixelWindow window;
+    fillPixelWindow(x, y, shoebox, false, &window);
+
     for (int i = 0; i < slowSide; i++)
     {
         double shoeX = i;
@@ -937,8 +1134,9 @@ double Image::integrateSimpleSummation(double x, double y, ShoeboxPtr shoebox, f
             }
 
             Mask flag = flagAtShoeboxIndex(shoebox, i, j);
+            int index = i * fastSide + j;
 
-            if (!accepted(panelPixelX, panelPixelY))
+            if (!window.acceptable[index])
             {
                 rejects++;
 
@@ -953,7 +1151,7 @@ double Image::integrateSimpleSummation(double x, double y, ShoeboxPtr shoebox, f
 
             if (!interpolate)
             {
-                value = valueAt(panelPixelX, panelPixelY);
+                value = window.values[index];
             }
             else
             {
@@ -1038,6 +1236,75 @@ double Image::intensityAt(double x, double y, ShoeboxPtr shoebox, float *error,
     return integral;
 }
 
+void Image::positionMillerWrapper(void *object, int i)
+{
+    IntegrationBatch *batch = static_cast<IntegrationBatch *>(object);
+    MillerPtr miller = (*batch->millers)[i];
+
+    double x = 0;
+    double y = 0;
+    miller->positionForIntegration(batch->quick, &x, &y);
+
+    batch->positions[i] = std::make_pair(x, y);
+}
+
+void Image::integrateMillerWrapper(void *object, int i)
+{
+    IntegrationBatch *batch = static_cast<IntegrationBatch *>(object);
+    int index = batch->order[i];
+    MillerPtr miller = (*batch->millers)[index];
+
+    miller->integrateAt(batch->positions[index].first, batch->positions[index].second);
+}
+
+/* Positions and integrates all of these Millers across the thread pool.
+ * Millers are integrated in order of detector row then column, so that
+ * each task reads shoeboxes lying close together in the image. */
+void Image::integrateMillers(std::vector<MillerPtr> &millers, bool quick)
+{
+    int count = (int)millers.size();
+
+    if (count == 0)
+    {
+        return;
+    }
+
+    loadImage();
+    checkAndSetupLookupTable();
+    resolveImageMask();
+
+    IntegrationBatch batch;
+    batch.millers = &millers;
+    batch.quick = quick;
+    batch.positions.resize(count);
+    batch.order.resize(count);
+
+    int grain = ThreadPool::grainForCount(count);
+    ThreadPool::getPool()->parallelFor(positionMillerWrapper, &batch, count, grain);
+
+    std::vector<std::pair<std::pair<int, int>, int> > sorted;
+    sorted.reserve(count);
+
+    for (int i = 0; i < count; i++)
+    {
+        double x = batch.positions[i].first;
+        double y = batch.positions[i].second;
+        int row = (y == y) ? std::max(-1., std::min(y, (double)yDim)) : -1;
+        int column = (x == x) ? std::max(-1., std::min(x, (double)xDim)) : -1;
+
+        sorted.push_back(std::make_pair(std::make_pair(row, column), i));
+    }
+
+    std::sort(sorted.begin(), sorted.end());
+
+    for (int i = 0; i < count; i++)
+    {
+        batch.order[i] = sorted[i].second;
+    }
+
+    ThreadPool::getPool()->parallelFor(integrateMillerWrapper, &batch, count, grain);
+}
+
 bool Image::accepted(int x, int y)
 {
     int pos = xDim * y + x;
@@ -1103,7 +1370,7 @@ vector<MtzPtr> Image::currentMtzs()
     for (int i = 0; i < mtzCount(); i++)
     {
         mtz(i)->removeStrongSpots(&spots, true);
-        mtz(i)->writeToFile("", true);
+        mtz(i)->writeCrystal("", true);
 
                 for (int j = 0; j < mtzs[i]->reflectionCount(); j++)
                 {
@@ -1329,64 +1596,48 @@ void Image::weedOutCloseSpots()
         return;
     }
 
-    std::vector<size_t> indicesToDelete;
     double tooCloseDistance = IndexingSolution::getMinDistance() * 0.8;
+    SpotGrid grid(spots, tooCloseDistance, true);
+    std::vector<int> nearby;
 
-    for (int i = 0; i < spotCount() - 1; i++)
+    // each spot is paired off with the first later spot (if any) which is
+    // too close to it, and both are rejected.
+    for (int i = 0; i < grid.spotCount() - 1; i++)
     {
-        bool keepGoingI = true;
-
-        SpotPtr firstSpot = spot(i);
-
-        for (int j = i + 1; j < spotCount(); j++)
+        if (grid.isRemoved(i))
         {
-            bool keepGoingJ = true;
-
-            for (int check = 0; check < indicesToDelete.size(); check++)
-            {
-                if (indicesToDelete[check] == i)
-                {
-                    keepGoingI = false;
-                }
+            continue;
+        }
 
-                if (indicesToDelete[check] == j)
-                {
-                    keepGoingJ = false;
-                }
-            }
+        vec firstVec = grid.position(i);
+        grid.spotsNear(firstVec, tooCloseDistance, &nearby);
 
-            if (!keepGoingI)
-            {
-                break;
-            }
+        for (int n = 0; n < nearby.size(); n++)
+        {
+            int j = nearby[n];
 
-            if (!keepGoingJ)
+            if (j <= i)
             {
                 continue;
             }
 
-            SpotPtr secondSpot = spot(j);
-
-            vec firstVec = firstSpot->estimatedVector();
-            vec secondVec = secondSpot->estimatedVector();
+            vec secondVec = grid.position(j);
             take_vector_away_from_vector(firstVec, &secondVec);
 
             double distance = length_of_vector(secondVec);
             if (distance < tooCloseDistance)
             {
-                indicesToDelete.push_back(i);
-                indicesToDelete.push_back(j);
+                grid.removeSpot(i);
+                grid.removeSpot(j);
+                break;
             }
         }
     }
 
-    logged << "Rejected " << indicesToDelete.size() << " spots for being too close." << std::endl;
+    logged << "Rejected " << grid.removedCount() << " spots for being too close." << std::endl;
     sendLog();
 
-    for (int i = (int)indicesToDelete.size() - 1; i >= 0; i--)
-    {
-        spots.erase(spots.begin() + i);
-    }
+    grid.remainingSpots(&spots);
 }
 
 void Image::processSpotList()
@@ -1536,17 +1787,24 @@ void Image::compileDistancesFromSpots(double maxReciprocalDistance, double tooCl
         processSpotList();
     }
 
-    bool rejectCloseSpots = FileParser::getKey("REJECT_CLOSE_SPOTS", false);
-    double minResolution = FileParser::getKey("INDEXING_MIN_RESOLUTION", 0.0);
-    double maxResolution = FileParser::getKey("MAX_INTEGRATED_RESOLUTION", 0.0);
+    static CachedKey<bool> rejectCloseSpotsKey("REJECT_CLOSE_SPOTS", false);
+    static CachedKey<double> minResolutionKey("INDEXING_MIN_RESOLUTION", 0.0);
+    static CachedKey<double> maxResolutionKey("MAX_INTEGRATED_RESOLUTION", 0.0);
+    static CachedKey<int> maxSpotsKey("REJECT_OVER_SPOT_COUNT", 4000);
+    static CachedKey<int> minSpotsKey("REJECT_UNDER_SPOT_COUNT", 0);
+    static CachedKey<double> maxReciprocalDistanceKey("MAX_RECIPROCAL_DISTANCE", 0.15);
+
+    bool rejectCloseSpots = rejectCloseSpotsKey.get();
+    double minResolution = minResolutionKey.get();
+    double maxResolution = maxResolutionKey.get();
 
     if (rejectCloseSpots && tooCloseDistance == 0)
     {
         tooCloseDistance = IndexingSolution::getMinDistance() * 0.7;
     }
 
-    int maxSpots = FileParser::getKey("REJECT_OVER_SPOT_COUNT", 4000);
-    int minSpots = FileParser::getKey("REJECT_UNDER_SPOT_COUNT", 0);
+    int maxSpots = maxSpotsKey.get();
+    int minSpots = minSpotsKey.get();
 
     if (maxSpots > 0)
     {
@@ -1577,7 +1835,7 @@ void Image::compileDistancesFromSpots(double maxReciprocalDistance, double tooCl
 
     if (maxReciprocalDistance == 0)
     {
-        maxReciprocalDistance = FileParser::getKey("MAX_RECIPROCAL_DISTANCE", 0.15);
+        maxReciprocalDistance = maxReciprocalDistanceKey.get();
     }
 
     spotVectors.clear();
@@ -1586,9 +1844,17 @@ void Image::compileDistancesFromSpots(double maxReciprocalDistance, double tooCl
     if (spots.size() == 0)
         return;
 
+    // only spots in neighbouring cells can be close enough; the grid is
+    // searched a little wider than needed so that rounding at the cell
+    // edges cannot lose a pair, and each pair still gets the full test.
+    double cellSize = (maxReciprocalDistance > 0) ? maxReciprocalDistance : 1;
+    SpotGrid grid(spots, cellSize, true);
+    double searchWidth = maxReciprocalDistance * 1.001;
+    std::vector<int> nearby;
+
     for (int i = 0; i < spots.size() - 1; i++)
     {
-        vec spotPos1 = spots[i]->estimatedVector();
+        vec spotPos1 = grid.position(i);
 
         if (minResolution != 0)
         {
@@ -1602,17 +1868,27 @@ void Image::compileDistancesFromSpots(double maxReciprocalDistance, double tooCl
                 continue;
         }
 
-        for (int j = i + 1; j < spots.size(); j++)
+        grid.spotsNear(spotPos1, searchWidth, &nearby);
+
+        for (int n = 0; n < nearby.size(); n++)
         {
-            vec spotPos2 = spots[j]->estimatedVector();
+            int j = nearby[n];
+
+            if (j <= i)
+            {
+                continue;
+            }
+
+            vec spotPos2 = grid.position(j);
 
             bool close = within_vicinity(spotPos1, spotPos2, maxReciprocalDistance);
 
             if (close)
             {
-                SpotVectorPtr newVec = SpotVectorPtr(new SpotVector(spots[i], spots[j]));
+                vec diff = copy_vector(spotPos2);
+                take_vector_away_from_vector(spotPos1, &diff);
 
-                double distance = newVec->distance();
+                double distance = length_of_vector(diff);
 
                 if (distance == 0)
                     continue;
@@ -1620,6 +1896,9 @@ void Image::compileDistancesFromSpots(double maxReciprocalDistance, double tooCl
                 if (distance > maxReciprocalDistance)
                     continue;
 
+                SpotVectorPtr newVec = boost::allocate_shared<SpotVector>(PoolAllocator<SpotVector>(spotVectorPool),
+                                                                          spots[i], spots[j], spotPos1, spotPos2);
+
                 spotVectors.push_back(newVec);
             }
         }
@@ -1738,8 +2017,36 @@ bool Image::checkIndexingSolutionDuplicates(MatrixPtr newSolution, bool excludeL
             return true;
     }
 
+    // bad solutions are turned into matrices once, when first checked
+    // against; a solution's matrix also depends on the ambiguity it was
+    // tried with, so any tried again since then are checked the long way.
+    if (!badSolutionIndex)
+    {
+        badSolutionIndex = OrientationIndexPtr(new OrientationIndex());
+    }
+
+    for (int i = (int)badSolutionMods.size(); i < badSolutions.size(); i++)
+    {
+        badSolutionMods.push_back(badSolutions[i]->getModMatrix());
+        badSolutionIndex->addSolution(badSolutions[i]->createSolution());
+    }
+
+    std::vector<int> similarBad;
+    badSolutionIndex->similarSolutions(newSolution, &similarBad);
+
+    for (int i = 0; i < similarBad.size(); i++)
+    {
+        int bad = similarBad[i];
+
+        if (badSolutions[bad]->getModMatrix() == badSolutionMods[bad])
+            return true;
+    }
+
     for (int i = 0; i < badSolutions.size(); i++)
     {
+        if (badSolutions[i]->getModMatrix() == badSolutionMods[i])
+            continue;
+
         MatrixPtr badSol = badSolutions[i]->createSolution();
 
         bool similar = IndexingSolution::matrixSimilarToMatrix(newSolution, badSol, true);
@@ -1898,7 +2205,7 @@ IndexingSolutionStatus Image::tryIndexingSolution(IndexingSolutionPtr solutionPt
     compileDistancesFromSpots();
     IndexingSolution::calculateSimilarStandardVectorsForImageVectors(spotVectors);
 
-        myMtz->writeToFile("", true);
+        myMtz->writeCrystal("", true);
 
     return IndexingSolutionTrialSuccess;
 }
@@ -2091,6 +2398,98 @@ IndexingSolutionStatus Image::testSeedSolution(IndexingSolutionPtr newSolution,
     return success;
 }
 
+// most pairs of spot vectors handed to the thread pool at once
+#define SEED_BLOCK_PAIRS 1024
+
+void Image::seedBlockWrapper(void *object, int i)
+{
+    SeedBlock *block = static_cast<SeedBlock *>(object);
+
+    block->seeds[i] = IndexingSolution::startingSolutionsForVectors(block->firsts[i], block->seconds[i]);
+}
+
+std::vector<IndexingSolutionPtr> Image::takeSeeds(SeedBlock *block, int index)
+{
+    std::vector<IndexingSolutionPtr> seeds;
+    seeds.swap(block->seeds[index]);
+    block->next = index + 1;
+
+    // only for the pairs which are actually tried
+    if (seeds.size())
+    {
+        logged << "Seed matches " << seeds.size() << " combinations." << std::endl;
+        sendLog(LogLevelDetailed);
+    }
+
+    return seeds;
+}
+
+/* Seeds only depend on the two vectors, so a block stays good for as long
+ * as the pairs it was made for are the ones being asked for; once spot
+ * vectors have been removed or the search has gone back to the start,
+ * the next block is made from wherever the search now is. A success
+ * throws the rest of a block away, so blocks start at one pair per thread
+ * and double each time one is used up without that happening. */
+std::vector<IndexingSolutionPtr> Image::seedsForPair(SeedBlock *block, int i, int j, int maxSearch)
+{
+    int next = block->next;
+
+    if (next < block->seeds.size() && block->firsts[next] == spotVectors[i] &&
+        block->seconds[next] == spotVectors[j])
+    {
+        return takeSeeds(block, next);
+    }
+
+    if (block->pairs == 0 || next < block->seeds.size())
+    {
+        int threads = ThreadPool::getPool()->threadCount();
+        block->pairs = std::max(1, std::min(threads, SEED_BLOCK_PAIRS));
+    }
+    else
+    {
+        block->pairs = std::min(block->pairs * 2, SEED_BLOCK_PAIRS);
+    }
+
+    block->firsts.clear();
+    block->seconds.clear();
+
+    for (int m = i; m < spotVectors.size() && m < maxSearch; m++)
+    {
+        for (int n = (m == i ? j : 0); n < m; n++)
+        {
+            block->firsts.push_back(spotVectors[m]);
+            block->seconds.push_back(spotVectors[n]);
+
+            if (block->firsts.size() >= block->pairs)
+            {
+                break;
+            }
+        }
+
+        if (block->firsts.size() >= block->pairs)
+        {
+            break;
+        }
+    }
+
+    // these fill in cached values on first use, so not from several threads
+    for (int k = 0; k < block->firsts.size(); k++)
+    {
+        block->firsts[k]->distance();
+        block->firsts[k]->getMinDistanceTolerance();
+        block->seconds[k]->distance();
+        block->seconds[k]->getMinDistanceTolerance();
+    }
+
+    int count = (int)block->firsts.size();
+    block->seeds.clear();
+    block->seeds.resize(count);
+
+    ThreadPool::getPool()->parallelFor(seedBlockWrapper, block, count, ThreadPool::grainForCount(count));
+
+    return takeSeeds(block, 0);
+}
+
 void Image::findIndexingSolutions()
 {
     if (!loadedSpots)
@@ -2157,18 +2556,17 @@ void Image::findIndexingSolutions()
     time(&startcputime);
 
     bool lastWasSuccessful = true;
+    SeedBlock seedBlock;
+    seedBlock.next = 0;
+    seedBlock.pairs = 0;
 
     while (lastWasSuccessful)
     {
         for (int i = 1; i < spotVectors.size() && i < maxSearch && continuing; i++)
         {
-            SpotVectorPtr spotVector1 = spotVectors[i];
-
             for (int j = 0; j < i && j < spotVectors.size() && continuing; j++)
             {
-                SpotVectorPtr spotVector2 = spotVectors[j];
-
-                std::vector<IndexingSolutionPtr> moreSolutions = IndexingSolution::startingSolutionsForVectors(spotVector1, spotVector2);
+                std::vector<IndexingSolutionPtr> moreSolutions = seedsForPair(&seedBlock, i, j, maxSearch);
 
                 for (int k = 0; k < moreSolutions.size(); k++)
                 {
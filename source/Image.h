@@ -25,6 +25,13 @@ typedef enum
 
 class ImageCluster;
 
+typedef enum
+{
+    PixelTypeInt,
+    PixelTypeShort,
+    PixelTypeFloat,
+} PixelType;
+
 typedef enum
 {
     IndexingSolutionTrialSuccess,
@@ -71,17 +78,67 @@ private:
 
     std::vector<IndexingSolutionPtr> goodSolutions;
     std::vector<IndexingSolutionPtr> badSolutions;
+    OrientationIndexPtr badSolutionIndex;
+    std::vector<MatrixPtr> badSolutionMods;
     std::vector<SpotVectorPtr> spotVectors;
+    ObjectPoolPtr spotVectorPool;
     bool _hasSeeded;
 
         vector<vector<int> > masks;
         vector<vector<int> > spotCovers;
 
-        Mask flagAtShoeboxIndex(ShoeboxPtr shoebox, int x, int y);
+    /* Pixels under one shoebox, read in a single pass: the image column
+     * of each shoebox row (xs) and the image row of each shoebox column
+     * (ys), then what valueAt() and accepted() would give for each pixel,
+     * stored at [i * ys.size() + j]. */
+    typedef struct
+    {
+        std::vector<int> xs;
+        std::vector<int> ys;
+        std::vector<int> values;
+        std::vector<char> acceptable;
+    } PixelWindow;
+
+    /* Shared by the tasks of integrateMillers(): positions are filled in
+     * by the first pass, order holds the Millers sorted by position. */
+    typedef struct
+    {
+        std::vector<MillerPtr> *millers;
+        std::vector<std::pair<double, double> > positions;
+        std::vector<int> order;
+        bool quick;
+    } IntegrationBatch;
+
+    static std::mutex imageMaskMutex;
+    static Image *resolvedImageMask;
+    void resolveImageMask();
+    void fillPixelWindow(double x, double y, ShoeboxPtr &shoebox, bool planeFit, PixelWindow *window);
+    template <class Value>
+    void readPixelWindow(vector<Value> &pixels, PixelWindow *window);
+    static void positionMillerWrapper(void *object, int i);
+    static void integrateMillerWrapper(void *object, int i);
+
+    /* Seeds for a run of spot vector pairs, in the order that
+     * findIndexingSolutions() visits them, worked out ahead of time
+     * across the thread pool. */
+    typedef struct
+    {
+        std::vector<SpotVectorPtr> firsts;
+        std::vector<SpotVectorPtr> seconds;
+        std::vector<std::vector<IndexingSolutionPtr> > seeds;
+        int next;
+        int pairs;
+    } SeedBlock;
+
+    std::vector<IndexingSolutionPtr> seedsForPair(SeedBlock *block, int i, int j, int maxSearch);
+    std::vector<IndexingSolutionPtr> takeSeeds(SeedBlock *block, int index);
+    static void seedBlockWrapper(void *object, int i);
+
+        Mask flagAtShoeboxIndex(ShoeboxPtr &shoebox, int x, int y);
     double integrateFitBackgroundPlane(int x, int y, ShoeboxPtr shoebox, float *error);
     double integrateSimpleSummation(double x, double y, ShoeboxPtr shoebox, float *error);
         double integrateWithShoebox(double x, double y, ShoeboxPtr shoebox, float *error);
-        double weightAtShoeboxIndex(ShoeboxPtr shoebox, int x, int y);
+        double weightAtShoeboxIndex(ShoeboxPtr &shoebox, int x, int y);
     IndexingSolutionStatus testSeedSolution(IndexingSolutionPtr newSolution, std::vector<SpotVectorPtr> &prunedVectors, int *successes);
     IndexingSolutionPtr biggestFailedSolution;
     std::vector<SpotVectorPtr> biggestFailedSolutionVectors;
@@ -109,11 +166,20 @@ protected:
     static vector<signed char> generalMask;
     static vector<DetectorPtr> perPixelDetectors;
 
-    // this really ought to be a template
+    // only the vector matching pixelType holds the image
     vector<short> shortData;
     vector<int> data;
-    bool useShortData;
-    // end of should be a template
+    vector<float> floatData;
+    PixelType pixelType;
+
+    template <class Value>
+    double pixelValueAt(vector<Value> &pixels, int position)
+    {
+        if (position < 0 || position >= pixels.size())
+            return 0;
+
+        return pixels[position];
+    }
     void writePNG(PNGFilePtr file, bool includeDiffraction = true);
     double spotVectorWeight;
 
@@ -131,6 +197,12 @@ public:
         void focusOnSpot(int *x, int *y, int tolerance1, int tolerance2);
         void focusOnAverageMax(double *x, double *y, int tolerance1, int tolerance2 = 1, bool even = false);
     void dropImage();
+
+    void preloadImage()
+    {
+        loadImage();
+    }
+
     void newImage();
         virtual ~Image();
         void setUpCrystal(MatrixPtr matrix);
@@ -186,10 +258,11 @@ public:
 
         int valueAt(int x, int y);
     double interpolateAt(double x, double y, double *total);
-    int rawValueAt(int x, int y);
+    double rawValueAt(int x, int y);
     void addValueAt(int x, int y, int addedValue);
         bool accepted(int x, int y);
         double intensityAt(double x, double y, ShoeboxPtr shoebox, float *error, int tolerance = 0);
+    void integrateMillers(std::vector<MillerPtr> &millers, bool quick = false);
 
         void refineIndexing(MtzManager *reference);
         void refineOrientations();
@@ -398,6 +471,21 @@ public:
 
         return &data[0];
     }
+
+    float *getFloatDataPtr()
+    {
+        if (!floatData.size())
+        {
+            return NULL;
+        }
+
+        return &floatData[0];
+    }
+
+    PixelType getPixelType()
+    {
+        return pixelType;
+    }
 };
 
 #endif /* IMAGE_H_ */
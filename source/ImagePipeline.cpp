@@ -0,0 +1,218 @@
+//
+//  ImagePipeline.cpp
+//   cppxfel - a collection of processing algorithms for XFEL diffraction data.
+
+//    Copyright (C) 2017  Helen Ginn
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "ImagePipeline.h"
+#include "Image.h"
+#include "Logger.h"
+
+ImageQueue::ImageQueue(int newCapacity, int producerCount)
+{
+    capacity = (newCapacity < 1) ? 1 : newCapacity;
+    producers = producerCount;
+}
+
+void ImageQueue::push(ImagePtr image)
+{
+    std::unique_lock<std::mutex> lock(queueMutex);
+
+    while ((int)images.size() >= capacity)
+    {
+        notFull.wait(lock);
+    }
+
+    images.push_back(image);
+    notEmpty.notify_one();
+}
+
+ImagePtr ImageQueue::pop()
+{
+    std::unique_lock<std::mutex> lock(queueMutex);
+
+    while (images.size() == 0 && producers > 0)
+    {
+        notEmpty.wait(lock);
+    }
+
+    if (images.size() == 0)
+    {
+        return ImagePtr();
+    }
+
+    ImagePtr image = images.front();
+    images.pop_front();
+    notFull.notify_one();
+
+    return image;
+}
+
+void ImageQueue::producerFinished()
+{
+    std::lock_guard<std::mutex> lock(queueMutex);
+
+    producers--;
+
+    if (producers <= 0)
+    {
+        notEmpty.notify_all();
+    }
+}
+
+// MAX_THREADS is shared out between the stages, which also hand work to
+// the thread pool. Spot finding already splits each image across the pool,
+// so one thread feeds it; loading and writing mostly wait on the disk and
+// get one each. Indexing is the slowest stage and gets the rest.
+ImagePipeline::ImagePipeline(std::vector<ImagePtr> newImages, int queueSize, int maxThreads) :
+spotThreads(1),
+indexThreads(maxThreads - 3 < 1 ? 1 : maxThreads - 3),
+writeThreads(1),
+loaded(queueSize, 1),
+spotted(queueSize, spotThreads),
+indexed(queueSize, indexThreads)
+{
+    images = newImages;
+    nextImage = -1;
+}
+
+ImagePtr ImagePipeline::getNextImage()
+{
+    std::lock_guard<std::mutex> lock(imageMutex);
+
+    nextImage++;
+
+    if (nextImage >= images.size())
+    {
+        return ImagePtr();
+    }
+
+    return images[nextImage];
+}
+
+void ImagePipeline::loadStage(ImagePipeline *me)
+{
+    while (true)
+    {
+        ImagePtr image = me->getNextImage();
+
+        if (!image)
+        {
+            break;
+        }
+
+        image->preloadImage();
+        me->loaded.push(image);
+    }
+
+    me->loaded.producerFinished();
+}
+
+void ImagePipeline::spotStage(ImagePipeline *me)
+{
+    while (true)
+    {
+        ImagePtr image = me->loaded.pop();
+
+        if (!image)
+        {
+            break;
+        }
+
+        image->processSpotList();
+        me->spotted.push(image);
+    }
+
+    me->spotted.producerFinished();
+}
+
+void ImagePipeline::indexStage(ImagePipeline *me)
+{
+    std::ostringstream logged;
+
+    while (true)
+    {
+        ImagePtr image = me->spotted.pop();
+
+        if (!image)
+        {
+            break;
+        }
+
+        logged << "Indexing image " << image->getFilename() << std::endl;
+        Logger::mainLogger->addStream(&logged); logged.str("");
+
+        image->findIndexingSolutions();
+        me->indexed.push(image);
+    }
+
+    me->indexed.producerFinished();
+}
+
+void ImagePipeline::writeStage(ImagePipeline *me)
+{
+    std::ostringstream logged;
+
+    while (true)
+    {
+        ImagePtr image = me->indexed.pop();
+
+        if (!image)
+        {
+            break;
+        }
+
+        logged << "Writing crystals for image " << image->getFilename() << std::endl;
+        Logger::mainLogger->addStream(&logged); logged.str("");
+
+        // as IndexManager does: crystals were already refined while
+        // indexing, so they only need writing out.
+        image->currentMtzs();
+        image->dropImage();
+    }
+}
+
+void ImagePipeline::run()
+{
+    logged << "Streaming " << images.size() << " images with " << indexThreads
+    << " indexing and " << writeThreads << " writing threads." << std::endl;
+    sendLog();
+
+    boost::thread_group threads;
+
+    threads.add_thread(new boost::thread(loadStage, this));
+
+    for (int i = 0; i < spotThreads; i++)
+    {
+        threads.add_thread(new boost::thread(spotStage, this));
+    }
+
+    for (int i = 0; i < indexThreads; i++)
+    {
+        threads.add_thread(new boost::thread(indexStage, this));
+    }
+
+    for (int i = 0; i < writeThreads; i++)
+    {
+        threads.add_thread(new boost::thread(writeStage, this));
+    }
+
+    threads.join_all();
+
+    logged << "Finished streaming images." << std::endl;
+    sendLog();
+}
@@ -0,0 +1,91 @@
+//
+//  ImagePipeline.h
+//   cppxfel - a collection of processing algorithms for XFEL diffraction data.
+
+//    Copyright (C) 2017  Helen Ginn
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifndef __cppxfel__ImagePipeline__
+#define __cppxfel__ImagePipeline__
+
+#include <stdio.h>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <boost/thread/thread.hpp>
+#include "parameters.h"
+#include "LoggableObject.h"
+
+/* Bounded first-in first-out queue of images passed between two stages of
+ * the pipeline. push() waits while the queue is full and pop() waits while
+ * it is empty; once every producer has called producerFinished() and the
+ * queue has drained, pop() returns an empty pointer. */
+
+class ImageQueue
+{
+private:
+    std::deque<ImagePtr> images;
+    int capacity;
+    int producers;
+
+    std::mutex queueMutex;
+    std::condition_variable notFull;
+    std::condition_variable notEmpty;
+
+public:
+    ImageQueue(int newCapacity, int producerCount);
+
+    void push(ImagePtr image);
+    ImagePtr pop();
+    void producerFinished();
+};
+
+/* Streams images through loading, spot finding, indexing (which also
+ * refines and integrates each crystal) and writing out the crystals.
+ * Each stage has its own threads and hands images to the next stage through
+ * an ImageQueue, so reading from disk overlaps with the other stages and
+ * only a bounded number of images hold their pixels at any one time.
+ * Images are dropped as soon as their crystals have been written. */
+
+class ImagePipeline : public LoggableObject
+{
+private:
+    std::vector<ImagePtr> images;
+    int nextImage;
+    std::mutex imageMutex;
+
+    int spotThreads;
+    int indexThreads;
+    int writeThreads;
+
+    ImageQueue loaded;
+    ImageQueue spotted;
+    ImageQueue indexed;
+
+    ImagePtr getNextImage();
+
+    static void loadStage(ImagePipeline *me);
+    static void spotStage(ImagePipeline *me);
+    static void indexStage(ImagePipeline *me);
+    static void writeStage(ImagePipeline *me);
+
+public:
+    ImagePipeline(std::vector<ImagePtr> newImages, int queueSize, int maxThreads);
+
+    void run();
+};
+
+#endif /* defined(__cppxfel__ImagePipeline__) */
@@ -90,34 +90,29 @@ void IndexingSolution::calculateSimilarStandardVectorsForImageVectors(std::vecto
 {
     for (int i = 0; i < vectors.size(); i++)
     {
-        vectors[i]->addSimilarLengthStandardVectors(lattice->getStandardVectors(), distanceTolerance);
+        vectors[i]->addSimilarLengthStandardVectors(lattice);
     }
 }
 
 bool IndexingSolution::matrixSimilarToMatrix(MatrixPtr mat1, MatrixPtr mat2, bool force)
 {
-    double minTrace = FLT_MAX;
-
-    std::ostringstream logged;
+    return rotationSimilarToMatrix(*mat1->getRotation(), mat2);
+}
 
+// Called for every candidate vector against every matrix in a solution,
+// so the working matrices stay on the stack.
+bool IndexingSolution::rotationSimilarToMatrix(Matrix &rotation, MatrixPtr mat2)
+{
+    double minTrace = FLT_MAX;
 
     for (int k = 0; k < symOperatorCount(); k++)
     {
-        MatrixPtr symOp = symOperator(k);
-
         for (int l = 0; l < newReflection->ambiguityCount(); l++)
         {
-            MatrixPtr mat3 = mat2->copy();
-            MatrixPtr ambiguity = newReflection->matrixForAmbiguity(l);
-            mat3->getRotation()->preMultiply(*symOp);
-            mat3->getRotation()->preMultiply(*ambiguity);
-
-            MatrixPtr subtractedMat = mat1->getRotation()->copy();
-            subtractedMat->subtract(mat3->getRotation());
-            MatrixPtr transposedMat = subtractedMat->copy()->transpose();
-            transposedMat->multiply(*subtractedMat);
+            Matrix rotated;
+            relatedRotation(mat2, k, l, &rotated);
 
-            double trace = transposedMat->trace();
+            double trace = rotationDifference(rotation, rotated);
 
             if (trace < minTrace)
             {
@@ -128,9 +123,40 @@ bool IndexingSolution::matrixSimilarToMatrix(MatrixPtr mat1, MatrixPtr mat2, boo
         }
     }
 
-    double badMinTrace = sqrt(4 * (1 - cos(solutionAngleSpread)));
+    return (minTrace < similarRotationDifference());
+}
+
+// The copy of a solution's rotation under symmetry operator k and
+// indexing ambiguity l.
+void IndexingSolution::relatedRotation(MatrixPtr mat, int k, int l, Matrix *rotated)
+{
+    *rotated = *mat->getRotation();
+    MatrixPtr symOp = symOperator(k);
+    MatrixPtr ambiguity = newReflection->matrixForAmbiguity(l);
+    rotated->preMultiply(*symOp);
+    rotated->preMultiply(*ambiguity);
+}
+
+double IndexingSolution::rotationDifference(Matrix &rotation, Matrix &rotated)
+{
+    Matrix subtracted = rotation;
+
+    for (int i = 0; i < 15; i++)
+    {
+        subtracted.components[i] -= rotated.components[i];
+    }
+
+    Matrix transposed;
+    subtracted.transpose(&transposed);
+    transposed.multiply(subtracted);
 
-    return (minTrace < badMinTrace);
+    return transposed.trace();
+}
+
+// Rotations closer than this (by rotationDifference) count as the same.
+double IndexingSolution::similarRotationDifference()
+{
+    return sqrt(4 * (1 - cos(solutionAngleSpread)));
 }
 
 bool IndexingSolution::vectorPairLooksLikePair(SpotVectorPtr firstObserved, SpotVectorPtr secondObserved, SpotVectorPtr standard1, SpotVectorPtr standard2)
@@ -150,15 +176,22 @@ bool IndexingSolution::vectorMatchesVector(SpotVectorPtr firstVector, SpotVector
     MatchPair matchPairs;
     double realAngle = firstVector->angleWithVector(secondVector);
 
-    for (int i = 0; i < uniqueSymVectorCount(); i++) // FIXME: standardVectorCount
+    // only vectors of about the right length can be trusted enough
+    std::vector<int> firstCandidates, secondCandidates;
+    uniqueSymVectorsNearDistance(firstVector->distance(), firstVector->trustSearchWidth(), &firstCandidates);
+    standardVectorsNearDistance(secondVector->distance(), secondVector->trustSearchWidth(), &secondCandidates);
+
+    for (int c = 0; c < firstCandidates.size(); c++) // FIXME: standardVectorCount
     {
+        int i = firstCandidates[c];
         double firstVectorTrust = firstVector->trustComparedToStandardVector(uniqueSymVector(i));
         double firstTolerance = firstVector->getMinDistanceTolerance();
 
         if (firstVectorTrust > firstTolerance)
         {
-            for (int j = 0; j < standardVectorCount(); j++)
+            for (int d = 0; d < secondCandidates.size(); d++)
             {
+                int j = secondCandidates[d];
                 double secondVectorTrust = secondVector->trustComparedToStandardVector(standardVector(j));
                 double secondTolerance = secondVector->getMinDistanceTolerance();
 
@@ -288,6 +321,18 @@ MatrixPtr IndexingSolution::createSolution(SpotVectorPtr firstObserved, SpotVect
         firstStandard = spotVectors[firstObserved];
     }
 
+    MatrixPtr rotateSpotDiffMatrix = rotationForVectors(firstObserved, secondObserved, firstStandard);
+
+    // Create the goods.
+    MatrixPtr fullMat = MatrixPtr(new Matrix());
+    fullMat->setComplexMatrix(lattice->getUnitCellOnly()->copy(), rotateSpotDiffMatrix);
+
+    // Send back the goods.
+    return fullMat;
+}
+
+MatrixPtr IndexingSolution::rotationForVectors(SpotVectorPtr firstObserved, SpotVectorPtr secondObserved, SpotVectorPtr firstStandard)
+{
     SpotVectorPtr secondStandard = spotVectors[secondObserved];
 
     // Get our important variables.
@@ -313,12 +358,7 @@ MatrixPtr IndexingSolution::createSolution(SpotVectorPtr firstObserved, SpotVect
     // We want to apply the first matrix and then the second matrix, so we multiply these.
     rotateSpotDiffMatrix->multiply(*secondTwizzleMatrix);
 
-    // Create the goods.
-    MatrixPtr fullMat = MatrixPtr(new Matrix());
-    fullMat->setComplexMatrix(lattice->getUnitCellOnly()->copy(), rotateSpotDiffMatrix);
-
-    // Send back the goods.
-    return fullMat;
+    return rotateSpotDiffMatrix;
 }
 
 bool IndexingSolution::spotVectorHasAnAppropriateDistance(SpotVectorPtr observedVector)
@@ -418,7 +458,8 @@ bool IndexingSolution::vectorSolutionsAreCompatible(SpotVectorPtr observedVector
     {
         SpotVectorPtr myVector = it->first;
 
-        MatrixPtr newSolution = createSolution(observedVector, myVector, standardVector);
+        // only the rotation is compared, so the full matrix isn't needed
+        MatrixPtr newRotation = rotationForVectors(observedVector, myVector, standardVector);
 
         for (SpotVectorMatrixMap2D::iterator jt = matrices.begin(); jt != matrices.end() && count < 5; jt++)
         {
@@ -426,7 +467,7 @@ bool IndexingSolution::vectorSolutionsAreCompatible(SpotVectorPtr observedVector
             {
                 MatrixPtr mat = kt->second;
 
-                if (!IndexingSolution::matrixSimilarToMatrix(newSolution, mat))
+                if (!IndexingSolution::rotationSimilarToMatrix(*newRotation, mat))
                 {
                     return false;
                 }
@@ -516,7 +557,7 @@ int IndexingSolution::extendFromSpotVectors(std::vector<SpotVectorPtr> *possible
             continue;
 
         // Find a standard vector which works with all the other vectors
-        std::vector<SpotVectorPtr> standardSelection = possibleVector->standardVectorsOfSameDistance();
+        std::vector<SpotVectorPtr> &standardSelection = possibleVector->standardVectorsOfSameDistance();
 
         for (int j = 0; j < standardSelection.size(); j++)
         {
@@ -677,18 +718,11 @@ std::vector<IndexingSolutionPtr> IndexingSolution::startingSolutionsForVectors(S
     std::vector<SpotVectorPtr> firstMatches, secondMatches;
 
     vectorMatchesVector(firstVector, secondVector, &firstMatches, &secondMatches);
-    std::ostringstream logged;
 
     if (!firstMatches.size())
     {
         return solutions;
     }
-    else
-    {
-        std::ostringstream logged;
-        logged << "Seed matches " << firstMatches.size() << " combinations." << std::endl;
-        Logger::mainLogger->addStream(&logged, LogLevelDetailed);
-    }
 
     for (int i = 0; i < firstMatches.size(); i++)
     {
@@ -35,6 +35,8 @@ private:
     bool vectorAgreesWithExistingVectors(SpotVectorPtr observedVector, SpotVectorPtr standardVector);
     static bool vectorMatchesVector(SpotVectorPtr firstVector, SpotVectorPtr secondVector, std::vector<SpotVectorPtr> *firstMatch, std::vector<SpotVectorPtr> *secondMatch);
     MatrixPtr createSolution(SpotVectorPtr firstVector, SpotVectorPtr secondVector, SpotVectorPtr firstStandard = SpotVectorPtr());
+    MatrixPtr rotationForVectors(SpotVectorPtr firstObserved, SpotVectorPtr secondObserved, SpotVectorPtr firstStandard);
+    static bool rotationSimilarToMatrix(Matrix &rotation, MatrixPtr mat2);
     bool vectorPairLooksLikePair(SpotVectorPtr firstObserved, SpotVectorPtr secondObserved, SpotVectorPtr standard1, SpotVectorPtr standard2);
     void addVectorToList(SpotVectorPtr observedVector, SpotVectorPtr standardVector);
     void addMatrix(SpotVectorPtr observedVector1, SpotVectorPtr observedVector2, MatrixPtr solution);
@@ -71,6 +73,9 @@ public:
     int extendFromSpotVectors(std::vector<SpotVectorPtr> *possibleVectors, int limit = 0);
     MatrixPtr createSolution();
     static bool matrixSimilarToMatrix(MatrixPtr mat1, MatrixPtr mat2, bool force = false);
+    static void relatedRotation(MatrixPtr mat, int k, int l, Matrix *rotated);
+    static double rotationDifference(Matrix &rotation, Matrix &rotated);
+    static double similarRotationDifference();
     static void setupStandardVectors();
     std::string getNetworkPDB();
     std::string printNetwork();
@@ -117,6 +122,16 @@ public:
         return lattice->standardVector(i);
     }
 
+    static void standardVectorsNearDistance(double distance, double halfWidth, std::vector<int> *indices)
+    {
+        lattice->standardVectorsNearDistance(distance, halfWidth, indices);
+    }
+
+    static void uniqueSymVectorsNearDistance(double distance, double halfWidth, std::vector<int> *indices)
+    {
+        lattice->uniqueSymVectorsNearDistance(distance, halfWidth, indices);
+    }
+
     static int symOperatorCount()
     {
         return lattice->symOperatorCount();
@@ -132,6 +147,11 @@ public:
         return lattice->symOperator(i);
     }
 
+    static int ambiguityCount()
+    {
+        return newReflection->ambiguityCount();
+    }
+
     int spotVectorCount()
     {
         return (int)spotVectors.size();
@@ -83,6 +83,8 @@ int InputFileParser::processOptions(std::vector<std::string> lines)
             function(&parameters, command, rest);
     }
 
+    parametersChanged();
+
     return continueFrom;
 }
 
@@ -92,6 +94,7 @@ void InputFileParser::parse(bool fromPython)
  //   boost::thread thr = boost::thread(Logger::awaitPrintingWrapper, Logger::mainLogger);
 
     parameters = ParametersMap();
+    parametersChanged();
 
     if (!FileReader::exists(filename))
     {
@@ -7,54 +7,157 @@
 //
 
 #include "Logger.h"
+#include <string.h>
+#include <algorithm>
+#include <chrono>
 
 LoggerPtr Logger::mainLogger;
 bool Logger::ready;
 bool Logger::shouldExit = false;
 
-Logger::Logger()
+LogBuffer::LogBuffer()
 {
-    ready = false;
-    printedLogLevel = LogLevelNormal;
+    bytes.resize(LOG_BUFFER_BYTES);
+    head = 0;
+    used = 0;
+    retired = false;
+    dropped = 0;
 }
 
-Logger::~Logger()
+void LogBuffer::copyIn(const char *source, size_t length)
 {
+    size_t tail = (head + used) % bytes.size();
+    size_t first = std::min(length, bytes.size() - tail);
 
+    memcpy(&bytes[tail], source, first);
+    memcpy(&bytes[0], source + first, length - first);
+    used += length;
 }
 
-bool Logger::isReady()
+void LogBuffer::copyOut(char *destination, size_t length)
 {
-    return mainLogger->ready;
+    size_t first = std::min(length, bytes.size() - head);
+
+    memcpy(destination, &bytes[head], first);
+    memcpy(destination + first, &bytes[0], length - first);
+    head = (head + length) % bytes.size();
+    used -= length;
 }
 
-void Logger::addString(std::string theString, LogLevel level)
+// caller holds bufferMutex; false if there is no room at the moment
+bool LogBuffer::push(const std::string &message, LogLevel level)
 {
-    std::ostringstream stream;
-    stream << theString << std::endl;
-    addStream(&stream, level);
+    size_t needed = sizeof(LogRecord) + message.length();
+
+    if (used + needed > bytes.size())
+    {
+        return false;
+    }
+
+    LogRecord record;
+    record.length = (int)message.length();
+    record.level = level;
+
+    copyIn((const char *)&record, sizeof(LogRecord));
+    copyIn(message.c_str(), message.length());
+
+    return true;
 }
 
-bool Logger::tryLock(std::mutex &lock, int maxTries)
+// caller holds bufferMutex
+void LogBuffer::drainInto(std::string *output, LogLevel printedLevel)
 {
-    int tryCount = 0;
-    bool locked = false;
+    std::vector<char> message;
 
-    while (!locked)
+    while (used > 0)
     {
-        try
+        LogRecord record;
+        copyOut((char *)&record, sizeof(LogRecord));
+        message.resize(record.length);
+
+        if (record.length)
         {
-            locked = lock.try_lock();
+            copyOut(&message[0], record.length);
         }
-        catch (std::system_error err)
+
+        if (record.level <= printedLevel)
         {
-            locked = false;
+            output->append(message.begin(), message.end());
         }
+    }
+
+    head = 0;
+    drained.notify_all();
+}
 
-        tryCount ++;
+Logger::Logger() : threadBuffer(retireBuffer)
+{
+    ready = false;
+    draining = false;
+    printedLogLevel = LogLevelNormal;
+    guaranteedLogLevel = LogLevelDebug;
+}
+
+Logger::~Logger()
+{
+
+}
+
+void Logger::addString(std::string theString, LogLevel level)
+{
+    std::ostringstream stream;
+    stream << theString << std::endl;
+    addStream(&stream, level);
+}
+
+LogBuffer *Logger::bufferForThread()
+{
+    LogBuffer *buffer = threadBuffer.get();
+
+    if (buffer)
+    {
+        return buffer;
     }
 
-    return locked;
+    LogBufferPtr newBuffer = LogBufferPtr(new LogBuffer());
+
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        buffers.push_back(newBuffer);
+    }
+
+    threadBuffer.reset(&*newBuffer);
+
+    return &*newBuffer;
+}
+
+// called as each thread finishes; the printing thread lets go of the
+// buffer once it has been emptied.
+void Logger::retireBuffer(LogBuffer *buffer)
+{
+    std::lock_guard<std::mutex> lock(buffer->bufferMutex);
+    buffer->retired = true;
+}
+
+void Logger::wakePrinter()
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    ready = true;
+    printBlock.notify_one();
+}
+
+bool Logger::printerIsDraining()
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    return draining;
+}
+
+void Logger::setShouldExit()
+{
+    std::lock_guard<std::mutex> lock(mainLogger->mtx);
+    shouldExit = true;
+    ready = true;
+    mainLogger->printBlock.notify_one();
 }
 
 void Logger::addStream(std::ostringstream *stream, LogLevel level, bool shouldExitAfter)
@@ -62,80 +165,154 @@ void Logger::addStream(std::ostringstream *stream, LogLevel level, bool shouldEx
     if (level > printedLogLevel)
         return;
 
-    bool success = tryLock(mtx);
+    LogBuffer *buffer = bufferForThread();
+    std::string message = stream->str();
+    bool guaranteed = (level <= guaranteedLogLevel);
 
-    if (!success)
-        return;
+    std::unique_lock<std::mutex> lock(buffer->bufferMutex);
 
-    boost::thread::id thread_id = boost::this_thread::get_id();
+    if (!LogBuffer::fits(message))
+    {
+        // too long for any buffer: wait for the thread's earlier messages
+        // to go out, so that they keep their order, then print it here.
+        while (!buffer->isEmpty())
+        {
+            lock.unlock();
+            bool printing = printerIsDraining();
+            printing ? wakePrinter() : printBuffers();
+            lock.lock();
+
+            if (!buffer->isEmpty() && printing)
+            {
+                buffer->drained.wait(lock);
+            }
+        }
 
-    StreamPtr ptr = StreamPtr(new std::ostringstream());
-    *ptr << stream->str();
+        lock.unlock();
 
-    if (stringsToOutput.count(thread_id) == 0)
-    {
-        stringsToOutput[thread_id] = vector<LogAndLevel>();
-        stringsToOutput[thread_id].reserve(100);
+        std::lock_guard<std::mutex> writeLock(writing);
+        std::cout << message << std::flush;
     }
+    else
+    {
+        while (!buffer->push(message, level))
+        {
+            if (!guaranteed)
+            {
+                buffer->dropped++;
+                break;
+            }
 
-    LogAndLevel logAndLevel = std::make_pair(ptr, level);
+            lock.unlock();
+            bool printing = printerIsDraining();
+            printing ? wakePrinter() : printBuffers();
+            lock.lock();
 
-    stringsToOutput[thread_id].push_back(logAndLevel);
+            if (!buffer->isEmpty() && printing)
+            {
+                buffer->drained.wait(lock);
+            }
+        }
+    }
 
-    ready = true;
+    if (lock.owns_lock())
+    {
+        lock.unlock();
+    }
 
     if (shouldExitAfter)
-        shouldExit = shouldExitAfter;
-
-    printBlock.notify_all();
-
-    mtx.unlock();
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        shouldExit = true;
+        ready = true;
+        printBlock.notify_one();
+    }
 }
 
-void Logger::awaitPrinting()
+void Logger::printBuffers()
 {
-    std::unique_lock<std::mutex> lck(mtx);
+    std::vector<LogBufferPtr> current;
 
-    while (true)
     {
-        printBlock.wait(lck, isReady);
+        std::lock_guard<std::mutex> lock(mtx);
+        current = buffers;
+    }
 
-        std::unique_lock<std::mutex> writeLock(writing, std::defer_lock);
+    std::string output;
+    int dropped = 0;
+    std::vector<LogBuffer *> finished;
 
-        while (!writeLock.try_lock()) {}
+    std::lock_guard<std::mutex> writeLock(writing);
 
-        int count = 0;
-        int num = 0;
+    for (int i = 0; i < current.size(); i++)
+    {
+        std::lock_guard<std::mutex> lock(current[i]->bufferMutex);
 
-        for (StringMap::iterator it = stringsToOutput.begin();
-             it != stringsToOutput.end(); ++it)
+        current[i]->drainInto(&output, printedLogLevel);
+        dropped += current[i]->dropped;
+        current[i]->dropped = 0;
+
+        if (current[i]->retired)
         {
-            for (int i = 0; i < stringsToOutput[it->first].size(); i++)
-            {
-                if (stringsToOutput[it->first][i].second > printedLogLevel)
-                    continue;
+            finished.push_back(&*current[i]);
+        }
+    }
+
+    if (output.length())
+    {
+        std::cout << output << std::flush;
+    }
 
-                std::cout << stringsToOutput[it->first][i].first->str() << std::flush;
-                count++;
+    if (dropped > 0)
+    {
+        std::cout << "(" << dropped << " log messages were dropped)" << std::endl;
+    }
+
+    if (finished.size())
+    {
+        std::lock_guard<std::mutex> lock(mtx);
 
-                stringsToOutput[it->first][i].first->str("");
-                stringsToOutput[it->first][i].first->clear();
+        for (int i = (int)buffers.size() - 1; i >= 0; i--)
+        {
+            if (std::find(finished.begin(), finished.end(), &*buffers[i]) != finished.end())
+            {
+                buffers.erase(buffers.begin() + i);
             }
+        }
+    }
+}
 
-            num++;
+void Logger::awaitPrinting()
+{
+    {
+        std::lock_guard<std::mutex> lck(mtx);
+        draining = true;
+    }
+
+    while (true)
+    {
+        bool exitAfter = false;
+
+        {
+            std::unique_lock<std::mutex> lck(mtx);
 
-            stringsToOutput[it->first].clear();
-            vector<LogAndLevel>().swap(stringsToOutput[it->first]);
+            if (!ready)
+            {
+                printBlock.wait_for(lck, std::chrono::milliseconds(LOG_DRAIN_MILLISECONDS));
+            }
+
+            ready = false;
+            exitAfter = shouldExit;
         }
 
-        ready = false;
+        // this drain started after the exit request was seen, so the
+        // message which asked for it has gone out.
+        printBuffers();
 
-        if (shouldExit)
+        if (exitAfter)
         {
             exit(1);
         }
-
-        writing.unlock();
     }
 }
 
@@ -144,6 +321,11 @@ void Logger::changePriorityLevel(LogLevel newLevel)
     printedLogLevel = newLevel;
 }
 
+void Logger::changeGuaranteedLevel(LogLevel newLevel)
+{
+    guaranteedLogLevel = newLevel;
+}
+
 void Logger::awaitPrintingWrapper(LoggerPtr logger)
 {
     logger->awaitPrinting();
@@ -10,6 +10,7 @@
 #define __cppxfel__Logger__
 
 #include <boost/thread/thread.hpp>
+#include <boost/thread/tss.hpp>
 #include <sstream>
 #include <iostream>
 #include <stdio.h>
@@ -19,24 +20,80 @@
 #include <mutex>
 #include <condition_variable>
 
-typedef std::pair<StreamPtr, LogLevel> LogAndLevel;
+// bytes of messages each thread may have waiting to be printed
+#define LOG_BUFFER_BYTES 65536
+// longest the printing thread sleeps before looking for messages
+#define LOG_DRAIN_MILLISECONDS 20
 
-typedef std::map<boost::thread::id, vector<LogAndLevel> > StringMap;
+/* Ring buffer of the messages sent by one thread and not yet printed.
+ * Each message is stored as a LogRecord followed by its characters. Only
+ * its own thread adds to a buffer and only the printing thread takes from
+ * it, so bufferMutex is rarely contended. */
 
+typedef struct
+{
+    int length;
+    int level;
+} LogRecord;
+
+class LogBuffer
+{
+private:
+    std::vector<char> bytes;
+    size_t head;
+    size_t used;
+
+    void copyIn(const char *source, size_t length);
+    void copyOut(char *destination, size_t length);
+
+public:
+    LogBuffer();
+
+    std::mutex bufferMutex;
+    std::condition_variable drained;
+    bool retired;
+    int dropped;
+
+    bool push(const std::string &message, LogLevel level);
+    void drainInto(std::string *output, LogLevel printedLevel);
+
+    bool isEmpty()
+    {
+        return (used == 0);
+    }
+
+    static bool fits(const std::string &message)
+    {
+        return (message.length() + sizeof(LogRecord) <= LOG_BUFFER_BYTES);
+    }
+};
+
+typedef boost::shared_ptr<LogBuffer> LogBufferPtr;
 
 class Logger
 {
 private:
-    StringMap stringsToOutput;
+    std::vector<LogBufferPtr> buffers;
+    boost::thread_specific_ptr<LogBuffer> threadBuffer;
     std::mutex mtx;
     std::mutex writing;
     std::condition_variable printBlock;
+
+    /* ready, draining and shouldExit are only touched with mtx held, so
+     * that the printer sees an exit request together with every message
+     * which was queued before it. */
     static bool ready;
+    bool draining;
     LogLevel printedLogLevel;
-    bool tryLock(std::mutex &lock, int maxTries = 50);
-    static bool isReady();
+    LogLevel guaranteedLogLevel;
     static bool shouldExit;
 
+    LogBuffer *bufferForThread();
+    static void retireBuffer(LogBuffer *buffer);
+    void wakePrinter();
+    bool printerIsDraining();
+    void printBuffers();
+
 public:
     Logger();
     ~Logger();
@@ -45,14 +102,12 @@ public:
 
     void addString(std::string string, LogLevel level = LogLevelNormal);
     void changePriorityLevel(LogLevel newLevel);
+    void changeGuaranteedLevel(LogLevel newLevel);
     void awaitPrinting();
     static void awaitPrintingWrapper(LoggerPtr logger);
     void addStream(std::ostringstream *stream, LogLevel level = LogLevelNormal, bool shouldExit = false);
 
-    static void setShouldExit()
-    {
-        shouldExit = true;
-    }
+    static void setShouldExit();
 
     static LogLevel getPriorityLevel()
     {
@@ -633,7 +633,14 @@ double Matrix::trace()
 MatrixPtr Matrix::transpose()
 {
     MatrixPtr transpose = MatrixPtr(new Matrix());
+    this->transpose(&*transpose);
 
+    return transpose;
+}
+
+// fills in a matrix which starts as the identity, e.g. one on the stack
+void Matrix::transpose(Matrix *transpose)
+{
     (*transpose)[0] = components[0];
     (*transpose)[1] = components[4];
     (*transpose)[2] = components[8];
@@ -649,8 +656,6 @@ MatrixPtr Matrix::transpose()
     (*transpose)[13] = components[7];
     (*transpose)[14] = components[11];
     (*transpose)[15] = components[15];
-
-    return transpose;
 }
 
 bool Matrix::writeToHdf5(std::string address)
@@ -62,6 +62,7 @@ public:
     MatrixPtr inverse3DMatrix();
     static MatrixPtr matFromCCP4(CSym::ccp4_symop *symop);
     MatrixPtr transpose();
+    void transpose(Matrix *transposed);
         static void symmetryOperatorsForSpaceGroup(std::vector<MatrixPtr> *matrices, CSym::CCP4SPG *spaceGroup, std::vector<double> cell);
 
     void rotate(double alpha, double beta, double gamma);
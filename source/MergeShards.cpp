@@ -0,0 +1,235 @@
+//
+//  MergeShards.cpp
+//   cppxfel - a collection of processing algorithms for XFEL diffraction data.
+
+//    Copyright (C) 2017  Helen Ginn
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "MergeShards.h"
+#include "MtzManager.h"
+#include "misc.h"
+#include <unistd.h>
+#include <algorithm>
+#include <queue>
+
+int MergeShards::shardSets = 0;
+std::mutex MergeShards::shardSetMutex;
+
+static bool shardRecordComparison(const BufferedMiller &a, const BufferedMiller &b)
+{
+    return a.reflNum < b.reflNum;
+}
+
+MergeShards::MergeShards(std::string newDirectory, int shardCount)
+{
+    directory = newDirectory;
+
+    std::lock_guard<std::mutex> lock(shardSetMutex);
+
+    // merges in one run (e.g. half datasets) must not share names
+    prefix = directory + "/shard_" + i_to_str(getpid()) + "_" + i_to_str(shardSets) + "_";
+    shardSets++;
+
+    filenames.resize(shardCount);
+    recordCounts.resize(shardCount, 0);
+}
+
+MergeShards::~MergeShards()
+{
+    for (int i = 0; i < filenames.size(); i++)
+    {
+        if (filenames[i].length())
+        {
+            remove(filenames[i].c_str());
+        }
+    }
+}
+
+bool MergeShards::writeShard(int shardNum, std::vector<BufferedMiller> &records)
+{
+    // stable, so that each reflection keeps its observations in crystal order
+    std::stable_sort(records.begin(), records.end(), shardRecordComparison);
+
+    std::string filename = prefix + i_to_str(shardNum) + ".dat";
+    FILE *file = fopen(filename.c_str(), "wb");
+
+    if (!file)
+    {
+        logged << "Could not open merge shard " << filename << " for writing." << std::endl;
+        sendLog();
+        return false;
+    }
+
+    size_t written = 0;
+
+    if (records.size())
+    {
+        written = fwrite(&records[0], sizeof(BufferedMiller), records.size(), file);
+    }
+
+    // a full disk may only show up once the buffer is flushed
+    bool closed = (fclose(file) == 0);
+
+    filenames[shardNum] = filename;
+    recordCounts[shardNum] = written;
+
+    if (written != records.size() || !closed)
+    {
+        logged << "Could not write merge shard " << filename << "." << std::endl;
+        sendLog();
+        return false;
+    }
+
+    return true;
+}
+
+bool MergeShards::refill(ShardReader *reader)
+{
+    if (reader->remaining == 0)
+    {
+        return false;
+    }
+
+    size_t count = std::min(reader->remaining, (size_t)SHARD_READ_RECORDS);
+    reader->records.resize(count);
+    size_t read = fread(&reader->records[0], sizeof(BufferedMiller), count, reader->file);
+
+    reader->records.resize(read);
+    reader->truncated = reader->truncated || (read < count);
+    reader->remaining = (read < count) ? 0 : reader->remaining - read;
+    reader->position = 0;
+
+    return (read > 0);
+}
+
+bool MergeShards::join(MtzPtr mergedMtz, int windowSize, ShardWindowFunction function, void *object)
+{
+    std::vector<ShardReader> readers(filenames.size());
+
+    // (reflection position, shard) so that ties are taken in crystal order
+    typedef std::pair<int, int> HeapEntry;
+    std::priority_queue<HeapEntry, std::vector<HeapEntry>, std::greater<HeapEntry> > heap;
+    bool success = true;
+
+    for (int i = 0; i < readers.size(); i++)
+    {
+        readers[i].file = NULL;
+        readers[i].position = 0;
+        readers[i].remaining = recordCounts[i];
+        readers[i].truncated = false;
+
+        if (!recordCounts[i])
+        {
+            continue;
+        }
+
+        readers[i].file = fopen(filenames[i].c_str(), "rb");
+
+        if (!readers[i].file)
+        {
+            logged << "Could not open merge shard " << filenames[i] << " for reading." << std::endl;
+            sendLog();
+            success = false;
+            continue;
+        }
+
+        if (refill(&readers[i]))
+        {
+            heap.push(HeapEntry(readers[i].records[0].reflNum, i));
+        }
+    }
+
+    // nothing has been added to the merged reflections yet
+    if (!success)
+    {
+        for (int i = 0; i < readers.size(); i++)
+        {
+            if (readers[i].file)
+            {
+                fclose(readers[i].file);
+            }
+        }
+
+        return false;
+    }
+
+    int reflCount = mergedMtz->reflectionCount();
+    windowSize = (windowSize < 1) ? 1 : windowSize;
+
+    for (int start = 0; start < reflCount; start += windowSize)
+    {
+        int end = std::min(start + windowSize, reflCount);
+
+        while (heap.size() && heap.top().first < end)
+        {
+            int shard = heap.top().second;
+            heap.pop();
+
+            ShardReader &reader = readers[shard];
+            int reflNum = reader.records[reader.position].reflNum;
+            ReflectionPtr refl = mergedMtz->reflection(reflNum);
+
+            // everything this shard has for the reflection
+            while (true)
+            {
+                refl->addLiteMiller(reader.records[reader.position].liteMiller);
+                reader.position++;
+
+                if (reader.position >= reader.records.size() && !refill(&reader))
+                {
+                    break;
+                }
+
+                if (reader.records[reader.position].reflNum != reflNum)
+                {
+                    heap.push(HeapEntry(reader.records[reader.position].reflNum, shard));
+                    break;
+                }
+            }
+        }
+
+        (*function)(object, start, end);
+    }
+
+    for (int i = 0; i < readers.size(); i++)
+    {
+        if (readers[i].truncated)
+        {
+            logged << "Merge shard " << filenames[i] << " ended early." << std::endl;
+            sendLog();
+            success = false;
+        }
+
+        if (readers[i].file)
+        {
+            fclose(readers[i].file);
+        }
+    }
+
+    return success;
+}
+
+size_t MergeShards::observationCount()
+{
+    size_t total = 0;
+
+    for (int i = 0; i < recordCounts.size(); i++)
+    {
+        total += recordCounts[i];
+    }
+
+    return total;
+}
@@ -0,0 +1,82 @@
+//
+//  MergeShards.h
+//   cppxfel - a collection of processing algorithms for XFEL diffraction data.
+
+//    Copyright (C) 2017  Helen Ginn
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifndef __cppxfel__MergeShards__
+#define __cppxfel__MergeShards__
+
+#include <stdio.h>
+#include <vector>
+#include <mutex>
+#include "parameters.h"
+#include "LoggableObject.h"
+#include "Reflection.h"
+
+// observations read at a time from each shard during the join
+#define SHARD_READ_RECORDS 4096
+
+typedef void (*ShardWindowFunction)(void *, int, int);
+
+/* Keeps the observations of a merge on disk rather than in memory. Each
+ * shard holds the observations of one group of crystals, sorted by the
+ * position of the merged reflection (and in crystal order within each
+ * reflection), and is written once by writeShard(). join() then reads all
+ * shards together as a k-way merge: observations are added to the merged
+ * reflections a window at a time, in reflection order, and a callback is
+ * made for each window so that those reflections can be merged and cleared
+ * before the next window is read. Memory is bounded by the read buffers and
+ * the observations of one window.
+ *
+ * Shards belong to a single merge (MERGE_SPILL_DIRECTORY) and are removed
+ * with it: observations carry their crystal's scale and partiality at the
+ * time, both of which change between post-refinement cycles, and they are
+ * written from crystals already in memory. */
+
+class MergeShards : public LoggableObject
+{
+private:
+    std::string directory;
+    std::string prefix;
+    std::vector<std::string> filenames;
+    std::vector<size_t> recordCounts;
+
+    static int shardSets;
+    static std::mutex shardSetMutex;
+
+    typedef struct
+    {
+        FILE *file;
+        std::vector<BufferedMiller> records;
+        size_t position;
+        size_t remaining;
+        bool truncated;
+    } ShardReader;
+
+    static bool refill(ShardReader *reader);
+
+public:
+    MergeShards(std::string newDirectory, int shardCount);
+    ~MergeShards();
+
+    bool writeShard(int shardNum, std::vector<BufferedMiller> &records);
+    bool join(MtzPtr mergedMtz, int windowSize, ShardWindowFunction function, void *object);
+    size_t observationCount();
+};
+
+#endif /* defined(__cppxfel__MergeShards__) */
@@ -16,6 +16,8 @@
 #include "Shoebox.h"
 #include <memory>
 #include "FileParser.h"
+#include "ObjectPool.h"
+#include "SpotGrid.h"
 #include "Beam.h"
 #include "Image.h"
 #include "Spot.h"
@@ -85,9 +87,12 @@ double Miller::superGaussian(double bandwidth, double mean,
 
 void Miller::recalculatePredictedWavelength()
 {
-    double rlpSize = FileParser::getKey("INITIAL_RLP_SIZE", 0.0001);
-    double bandwidth = FileParser::getKey("INITIAL_BANDWIDTH", 0.0013);
-    double exponent = FileParser::getKey("INITIAL_EXPONENT", 1.5);
+    static CachedKey<double> rlpSizeKey("INITIAL_RLP_SIZE", 0.0001);
+    static CachedKey<double> bandwidthKey("INITIAL_BANDWIDTH", 0.0013);
+    static CachedKey<double> exponentKey("INITIAL_EXPONENT", 1.5);
+    double rlpSize = rlpSizeKey.get();
+    double bandwidth = bandwidthKey.get();
+    double exponent = exponentKey.get();
     double mosaicity = 0;
     double wavelength = getImage()->getWavelength();
 
@@ -130,13 +135,16 @@ Miller::Miller(MtzManager *parent, int _h, int _k, int _l, bool calcFree)
     recipShiftX = 0;
     recipShiftY = 0;
 
-    partialCutoff = FileParser::getKey("PARTIALITY_CUTOFF",
-                                       PARTIAL_CUTOFF);
+    static CachedKey<double> partialCutoffKey("PARTIALITY_CUTOFF", PARTIAL_CUTOFF);
+    static CachedKey<int> rlpModelKey("RLP_MODEL", 0);
+    static CachedKey<std::vector<int> > specialKey("MILLER_INDEX", std::vector<int>());
 
-    int rlpInt = FileParser::getKey("RLP_MODEL", 0);
+    partialCutoff = partialCutoffKey.get();
+
+    int rlpInt = rlpModelKey.get();
     rlpModel = (RlpModel)rlpInt;
 
-    std::vector<int> special = FileParser::getKey("MILLER_INDEX", std::vector<int>());
+    std::vector<int> special = specialKey.get();
 
     _isSpecial = false;
 
@@ -707,7 +715,8 @@ void Miller::centrePeak()
 
 MillerPtr Miller::copy(void)
 {
-    MillerPtr newMiller = MillerPtr(new Miller(mtzParent));
+    MillerPtr newMiller = mtzParent ? mtzParent->newMiller(0, 0, 0) :
+                          MillerPtr(new Miller(mtzParent));
 
     newMiller->h = h;
     newMiller->k = k;
@@ -915,40 +924,60 @@ void Miller::makeShoebox()
 {
         if (!shoebox)
         {
-                shoebox = ShoeboxPtr(new Shoebox(shared_from_this()));
-
-                int foregroundLength = FileParser::getKey("SHOEBOX_FOREGROUND_PADDING",
-                                                                                                  SHOEBOX_FOREGROUND_PADDING);
-                int neitherLength = FileParser::getKey("SHOEBOX_NEITHER_PADDING",
-                                                                                           SHOEBOX_NEITHER_PADDING);
-                int backgroundLength = FileParser::getKey("SHOEBOX_BACKGROUND_PADDING",
-                                                                                                  SHOEBOX_BACKGROUND_PADDING);
-                bool shoeboxEven = FileParser::getKey("SHOEBOX_MAKE_EVEN", false);
+                if (mtzParent)
+                {
+                        shoebox = boost::allocate_shared<Shoebox>(PoolAllocator<Shoebox>(mtzParent->getPool()),
+                                                                  shared_from_this());
+                }
+                else
+                {
+                        shoebox = ShoeboxPtr(new Shoebox(shared_from_this()));
+                }
+
+                static CachedKey<int> foregroundKey("SHOEBOX_FOREGROUND_PADDING",
+                                                    SHOEBOX_FOREGROUND_PADDING);
+                static CachedKey<int> neitherKey("SHOEBOX_NEITHER_PADDING",
+                                                 SHOEBOX_NEITHER_PADDING);
+                static CachedKey<int> backgroundKey("SHOEBOX_BACKGROUND_PADDING",
+                                                    SHOEBOX_BACKGROUND_PADDING);
+                static CachedKey<bool> shoeboxEvenKey("SHOEBOX_MAKE_EVEN", false);
+
+                int foregroundLength = foregroundKey.get();
+                int neitherLength = neitherKey.get();
+                int backgroundLength = backgroundKey.get();
+                bool shoeboxEven = shoeboxEvenKey.get();
 
                 shoebox->simpleShoebox(foregroundLength, neitherLength, backgroundLength, shoeboxEven);
         }
 }
 
-void Miller::integrateIntensity(bool quick)
+void Miller::positionForIntegration(bool quick, double *x, double *y)
 {
     if (!getImage())
         throw 1;
 
         makeShoebox();
 
-    double x = correctedX;
-    double y = correctedY;
+    *x = correctedX;
+    *y = correctedY;
 
-        positionOnDetector(&x, &y, !quick);
-
-        if (x < 0 || y < 0)
-        {
-                rawIntensity = std::nan(" ");
-        }
+        positionOnDetector(x, y, !quick);
+}
 
+void Miller::integrateAt(double x, double y)
+{
     rawIntensity = getImage()->intensityAt(x, y, shoebox, &countingSigma, 0);
 }
 
+void Miller::integrateIntensity(bool quick)
+{
+    double x = 0;
+    double y = 0;
+
+    positionForIntegration(quick, &x, &y);
+    integrateAt(x, y);
+}
+
 void Miller::incrementOverlapMask(double hRot, double kRot)
 {
     int x = correctedX;
@@ -961,33 +990,22 @@ void Miller::incrementOverlapMask(double hRot, double kRot)
 }
 
 
-bool Miller::isOverlappedWithSpots(std::vector<SpotPtr> *spots, bool actuallyDelete)
+bool Miller::isOverlappedWithSpots(SpotGrid *spots, bool actuallyDelete)
 {
-    double x = correctedX;
-    double y = correctedY;
-    int count = 0;
     double tolerance = 2.5;
+    std::vector<int> nearby;
 
-    for (int i = 0; i < spots->size(); i++)
-    {
-        double x2 = (*spots)[i]->getRawXY().first;
-        double y2 = (*spots)[i]->getRawXY().second;
+    spots->spotsNear(new_vector(correctedX, correctedY, 0), tolerance, &nearby);
 
-        double xDiff = fabs(x2 - x);
-        double yDiff = fabs(y2 - y);
-
-        if (xDiff < tolerance && yDiff < tolerance)
+    if (actuallyDelete)
+    {
+        for (int i = 0; i < nearby.size(); i++)
         {
-            if (actuallyDelete)
-            {
-                spots->erase(spots->begin() + i);
-                i--;
-            }
-            count++;
+            spots->removeSpot(nearby[i]);
         }
     }
 
-    return (count > 0);
+    return (nearby.size() > 0);
 }
 
 bool Miller::isOverlapped()
@@ -120,7 +120,7 @@ public:
         static double scaleForScaleAndBFactor(double scaleFactor, double bFactor, double resol, double exponent_exponent = 1);
     void limitingEwaldWavelengths(vec hkl, double mosaicity, double spotSize, double wavelength, double *limitLow, double *limitHigh, vec *inwards = NULL, vec *outwards = NULL);
 
-    bool isOverlappedWithSpots(std::vector<SpotPtr> *spots, bool actuallyDelete = true);
+    bool isOverlappedWithSpots(SpotGrid *spots, bool actuallyDelete = true);
     void setPartialityModel(PartialityModel model);
         void setData(double _intensity, double _sigma, double _partiality,
                         double _wavelength);
@@ -129,6 +129,8 @@ public:
         void setRejected(RejectReason reason, bool rejection);
         bool isRejected(RejectReason reason);
         void integrateIntensity(bool quick = false);
+        void positionForIntegration(bool quick, double *x, double *y);
+        void integrateAt(double x, double y);
 
         bool accepted(void);
         bool isFree()
@@ -402,6 +404,21 @@ public:
         correctingPolarisation = on;
     }
 
+    static bool isCorrectingPolarisation()
+    {
+        return correctingPolarisation;
+    }
+
+    static PartialityModel getPartialityModel()
+    {
+        return model;
+    }
+
+    static bool hasIndividualWavelengths()
+    {
+        return individualWavelength;
+    }
+
     void setPhase(double newPhase)
     {
         phase = newPhase;
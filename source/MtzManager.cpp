@@ -29,6 +29,9 @@
 #include "definitions.h"
 #include "FileParser.h"
 #include "CSV.h"
+#include "CrystalPack.h"
+#include "ObjectPool.h"
+#include "SpotGrid.h"
 
 using namespace CMtz;
 
@@ -37,6 +40,8 @@ using namespace CSym;
 vector<double> MtzManager::superGaussianTable;
 bool MtzManager::setupSuperGaussian = false;
 std::mutex MtzManager::tableMutex;
+std::map<std::string, MtzManager::AbsenceMaskPtr> MtzManager::absenceMasks;
+std::mutex MtzManager::absenceMutex;
 double MtzManager::superGaussianScale = 0;
 
 MtzManager *MtzManager::referenceManager = NULL;
@@ -104,6 +109,68 @@ bool MtzManager::reflection_comparison(ReflectionPtr i, ReflectionPtr j)
 void MtzManager::sortReflections()
 {
     std::sort(reflections.begin(), reflections.end(), reflection_comparison);
+    clearReflectionIndex();
+}
+
+void MtzManager::clearReflectionIndex()
+{
+    indexKeys.clear();
+    indexPositions.clear();
+}
+
+/* Fibonacci hashing of the reflection id into a table at least twice
+ * the size of the reflection list, with linear probing. */
+
+void MtzManager::indexReflections()
+{
+    int bits = 4;
+
+    while ((1 << bits) < reflectionCount() * 2)
+    {
+        bits++;
+    }
+
+    int size = (1 << bits);
+    indexShift = 32 - bits;
+    indexKeys.assign(size, 0);
+    indexPositions.assign(size, -1);
+
+    for (int i = 0; i < reflectionCount(); i++)
+    {
+        unsigned int refl_id = (unsigned int)reflection(i)->getReflId();
+        unsigned int slot = (refl_id * 2654435761u) >> indexShift;
+
+        while (indexPositions[slot] != -1 && indexKeys[slot] != refl_id)
+        {
+            slot = (slot + 1) & (size - 1);
+        }
+
+        // keep the first of any duplicates, as the binary search would
+        if (indexPositions[slot] == -1)
+        {
+            indexKeys[slot] = refl_id;
+            indexPositions[slot] = i;
+        }
+    }
+}
+
+int MtzManager::indexedPosition(long unsigned int refl_id)
+{
+    unsigned int key = (unsigned int)refl_id;
+    unsigned int mask = (unsigned int)indexPositions.size() - 1;
+    unsigned int slot = (key * 2654435761u) >> indexShift;
+
+    while (indexPositions[slot] != -1)
+    {
+        if (indexKeys[slot] == key)
+        {
+            return indexPositions[slot];
+        }
+
+        slot = (slot + 1) & mask;
+    }
+
+    return -1;
 }
 
 void MtzManager::loadParametersMap()
@@ -194,6 +261,7 @@ MtzManager::MtzManager()
 
     lastReference = NULL;
     reflections.resize(0);
+    indexShift = 0;
     bandwidth = INITIAL_BANDWIDTH;
     hRot = 0;
     kRot = 0;
@@ -227,17 +295,31 @@ MtzManager::MtzManager()
     loadParametersMap();
 
     matrix = MatrixPtr();
+    pool = ObjectPool::create();
+}
+
+MillerPtr MtzManager::newMiller(int h, int k, int l, bool calcFree)
+{
+    return boost::allocate_shared<Miller>(PoolAllocator<Miller>(pool), this, h, k, l, calcFree);
+}
+
+ReflectionPtr MtzManager::newReflection()
+{
+    return boost::allocate_shared<Reflection>(PoolAllocator<Reflection>(pool));
 }
 
 void MtzManager::clearReflections()
 {
     reflections.clear();
     vector<ReflectionPtr>().swap(reflections);
+    clearReflectionIndex();
+    pool = ObjectPool::create();
 }
 
 void MtzManager::removeReflection(int i)
 {
     reflections.erase(reflections.begin() + i);
+    clearReflectionIndex();
 }
 
 void MtzManager::addReflection(ReflectionPtr reflection)
@@ -246,6 +328,7 @@ void MtzManager::addReflection(ReflectionPtr reflection)
     ReflectionPtr refl = findReflectionWithId(reflection, &lowestId);
 
     reflections.insert(reflections.begin() + lowestId, reflection);
+    clearReflectionIndex();
 }
 
 void MtzManager::addMiller(MillerPtr miller)
@@ -266,7 +349,7 @@ void MtzManager::addMiller(MillerPtr miller)
     }
     else
     {
-        ReflectionPtr newReflection = ReflectionPtr(new Reflection());
+        ReflectionPtr newReflection = this->newReflection();
         newReflection->setUnitCell(getUnitCell());
         newReflection->setSpaceGroup(getSpaceGroupNum());
         newReflection->addMiller(miller);
@@ -335,6 +418,8 @@ void MtzManager::dropReflections()
 
     reflections.clear();
     std::vector<ReflectionPtr>().swap(reflections);
+    clearReflectionIndex();
+    pool = ObjectPool::create();
 
     dropped = true;
 }
@@ -382,6 +467,36 @@ void MtzManager::getWavelengthFromHDF5()
     }
 }
 
+void MtzManager::applyLoadedUnitCell(std::vector<float> &cell)
+{
+        bool fixUnitCell = FileParser::getKey("FIX_UNIT_CELL", true);
+
+        if (!fixUnitCell)
+        {
+                setUnitCell(cell);
+        }
+        else
+        {
+                vector<double> givenUnitCell = FileParser::getKey("UNIT_CELL", vector<double>());
+
+                if (givenUnitCell.size() == 6)
+                {
+                        if (!matrix)
+                        {
+                                matrix = MatrixPtr(new Matrix());
+                        }
+
+                        setUnitCell(givenUnitCell);
+                        lockUnitCellDimensions();
+                        getMatrix()->changeOrientationMatrixDimensions(givenUnitCell);
+                }
+                else
+                {
+                        setUnitCell(cell);
+                }
+        }
+}
+
 void MtzManager::loadReflections()
 {
     if (reflectionCount())
@@ -397,6 +512,11 @@ void MtzManager::loadReflections()
         return;
     }
 
+    if (!dropped && CrystalPack::loadPackedCrystal(this))
+    {
+        return;
+    }
+
     if (!FileReader::exists(getFilename()))
     {
         logged << "Cannot find MTZ file for " << getFilename() << std::endl;
@@ -519,32 +639,7 @@ void MtzManager::loadReflections()
         cell.resize(6);
     ccp4_lrcell(xtals[0], &cell[0]);
 
-        bool fixUnitCell = FileParser::getKey("FIX_UNIT_CELL", true);
-
-        if (!fixUnitCell)
-        {
-                setUnitCell(cell);
-        }
-        else
-        {
-                vector<double> givenUnitCell = FileParser::getKey("UNIT_CELL", vector<double>());
-
-                if (givenUnitCell.size() == 6)
-                {
-                        if (!matrix)
-                        {
-                                matrix = MatrixPtr(new Matrix());
-                        }
-
-                        setUnitCell(givenUnitCell);
-                        lockUnitCellDimensions();
-                        getMatrix()->changeOrientationMatrixDimensions(givenUnitCell);
-                }
-                else
-                {
-                        setUnitCell(cell);
-                }
-        }
+    applyLoadedUnitCell(cell);
 
         std::vector<double> unitCell = getUnitCell();
 
@@ -610,7 +705,7 @@ void MtzManager::loadReflections()
         if (col_partials == NULL && intensity != intensity)
             continue;
 
-        MillerPtr miller = MillerPtr(new Miller(this, h, k, l));
+        MillerPtr miller = newMiller(h, k, l);
         miller->setData(intensity, sigma, partiality, wavelength);
         miller->setCountingSigma(countingSigma);
 
@@ -659,11 +754,86 @@ void MtzManager::loadReflections()
 
 }
 
+/* Counterpart of loadReflections for a crystal read from a crystal pack.
+ * The pack also keeps the crystal's refinement parameters, which are used
+ * unless they have already been given (e.g. by a params line). */
+void MtzManager::loadPackedReflections(const CrystalPackRecord *record, const float *rows)
+{
+    int spgnum = FileParser::getKey("SPACE_GROUP", record->spaceGroup);
+    bool throwaway = FileParser::getKey("THROWAWAY_UNACCEPTED", false);
+    bool recalculateWavelengths = FileParser::getKey("RECALCULATE_WAVELENGTHS", false);
+
+    setSpaceGroupNum(spgnum);
+
+    if (getSpaceGroup() == NULL)
+    {
+        setRejected(true);
+        return;
+    }
+
+    std::vector<float> cell(record->unitCell, record->unitCell + 6);
+    applyLoadedUnitCell(cell);
+
+    if (!setInitialValues)
+    {
+        mosaicity = record->mosaicity;
+        spotSize = record->spotSize;
+        wavelength = record->wavelength;
+        bFactor = record->bFactor;
+        scale = record->scale;
+        setInitialValues = true;
+    }
+
+    for (int i = 0; i < record->rowCount; i++)
+    {
+        const float *row = &rows[i * MTZ_ROW_COLUMNS];
+        float partiality = row[5];
+
+        if (partiality < 0.05 && throwaway)
+        {
+            continue;
+        }
+
+        MillerPtr miller = newMiller((int)row[0], (int)row[1], (int)row[2]);
+        miller->setData(row[3], row[4], partiality, row[6]);
+        miller->setCountingSigma(row[9]);
+        miller->setPhase(0);
+        miller->setCorrectedX(row[7]);
+        miller->setCorrectedY(row[8]);
+        miller->setRejected((int)row[10]);
+        miller->matrix = this->matrix;
+        miller->setScale(scale);
+        addMiller(miller);
+    }
+
+    std::ostringstream log;
+
+    log << "Loaded " << record->rowCount << " reflections (" << accepted()
+    << " accepted) for " << getFilename() << " from crystal pack" << std::endl;
+
+    bool lowMem = FileParser::getKey("LOW_MEMORY_MODE", false);
+
+    Logger::mainLogger->addStream(&log, (lowMem ? LogLevelDetailed : LogLevelNormal));
+
+    setSigmaToUnity();
+
+    if (recalculateWavelengths && matrix)
+        this->recalculateWavelengths();
+
+    getWavelengthFromHDF5();
+
+        fullyLoaded = true;
+}
+
 void MtzManager::setReference(MtzManager *reference)
 {
     if (reference != NULL)
         Logger::mainLogger->addString("Setting reference to " + reference->getFilename());
     MtzManager::referenceManager = reference;
+
+    // every crystal looks up its reflections in the reference
+    if (reference != NULL)
+        reference->indexReflections();
 }
 
 
@@ -675,6 +845,13 @@ ReflectionPtr MtzManager::findReflectionWithId(ReflectionPtr exampleRefl, size_t
         return ReflectionPtr();
     }
 
+    if (lowestId == NULL && indexPositions.size())
+    {
+        int position = indexedPosition(exampleRefl->getReflId());
+
+        return (position >= 0) ? reflections[position] : ReflectionPtr();
+    }
+
     std::vector<ReflectionPtr>::iterator low;
     low = std::lower_bound(reflections.begin(), reflections.end(), exampleRefl, Reflection::reflLessThan);
     if (lowestId) *lowestId = (low - reflections.begin());
@@ -697,6 +874,14 @@ int MtzManager::findReflectionWithId(long unsigned int refl_id, ReflectionPtr *r
         return -1;
     }
 
+    if (!insertionPoint && indexPositions.size())
+    {
+        int position = indexedPosition(refl_id);
+        *reflection = (position >= 0) ? reflections[position] : ReflectionPtr();
+
+        return -1;
+    }
+
     int lower = 0;
     int higher = reflectionCount() - 1;
     int new_bound = (higher + lower) / 2;
@@ -1072,10 +1257,9 @@ void MtzManager::applyPolarisation(void)
 void MtzManager::writeToFile(std::string newFilename, bool announce, bool plusAmbiguity,
                                                          bool withScale)
 {
-    int columns = 11;
+    int columns = MTZ_ROW_COLUMNS;
 
     float cell[6], wavelength;
-    float *fdata = new float[columns];
         std::vector<double> unitCell = getUnitCell();
 
     /* variables for symmetry */
@@ -1087,7 +1271,7 @@ void MtzManager::writeToFile(std::string newFilename, bool announce, bool plusAm
     MTZ *mtzout;
     MTZXTAL *xtal;
     MTZSET *set;
-    MTZCOL *colout[11];
+    MTZCOL *colout[MTZ_ROW_COLUMNS];
 
     /*  Removed: General CCP4 initializations e.g. HKLOUT on command line */
 
@@ -1133,6 +1317,28 @@ void MtzManager::writeToFile(std::string newFilename, bool announce, bool plusAm
     colout[9] = MtzAddColumn(mtzout, set, "CSIGI", "R");
     colout[10] = MtzAddColumn(mtzout, set, "REJECT", "R");
 
+    std::vector<float> rows;
+    int num = reflectionRows(&rows, plusAmbiguity, withScale);
+
+    for (int i = 0; i < num; i++)
+    {
+        ccp4_lwrefl(mtzout, &rows[i * columns], colout, columns, i + 1);
+    }
+
+    MtzPut(mtzout, " ");
+    MtzFree(mtzout);
+
+    LogLevel shouldAnnounce = announce ? LogLevelNormal : LogLevelDebug;
+
+    std::ostringstream logged;
+    logged << "Written " << num << " refls to file " << newFilename << std::endl;
+    Logger::mainLogger->addStream(&logged, shouldAnnounce);
+}
+
+/* Rows as written to MTZ files: H, K, L, I, SIGI, PART, WAVE, SHIFTX,
+ * SHIFTY, CSIGI and REJECT for every Miller with an intensity. */
+int MtzManager::reflectionRows(std::vector<float> *rows, bool plusAmbiguity, bool withScale)
+{
     int num = 0;
 
     if (plusAmbiguity)
@@ -1146,17 +1352,18 @@ void MtzManager::writeToFile(std::string newFilename, bool announce, bool plusAm
         {
             MillerPtr miller = reflection(i)->miller(j);
 
-            double intensity = reflections[i]->miller(j)->getRawestIntensity();
+            double intensity = miller->getRawestIntensity();
 
-                        if (withScale)
-                        {
-                                intensity = reflections[i]->miller(j)->intensity();
-                        }
-            double sigma = reflections[i]->miller(j)->getRawSigma();
-            double partiality = reflections[i]->miller(j)->getPartiality();
-            double bFactor = reflections[i]->miller(j)->getBFactorScale();
-            double countingSigma = reflections[i]->miller(j)->getRawCountingSigma();
-            double rejectFlags = reflections[i]->miller(j)->getRejectionFlags();
+            if (withScale)
+            {
+                intensity = miller->intensity();
+            }
+
+            double sigma = miller->getRawSigma();
+            double partiality = miller->getPartiality();
+            double bFactor = miller->getBFactorScale();
+            double countingSigma = miller->getRawCountingSigma();
+            double rejectFlags = miller->getRejectionFlags();
 
             if (intensity != intensity)
             {
@@ -1165,23 +1372,17 @@ void MtzManager::writeToFile(std::string newFilename, bool announce, bool plusAm
 
             num++;
 
-            int h = reflections[i]->miller(j)->getH();
-            int k = reflections[i]->miller(j)->getK();
-            int l = reflections[i]->miller(j)->getL();
-
-                        fdata[0] = h;
-            fdata[1] = k;
-            fdata[2] = l;
-            fdata[3] = intensity / bFactor;
-            fdata[4] = sigma;
-            fdata[5] = partiality;
-            fdata[6] = reflections[i]->miller(j)->getWavelength();
-            fdata[7] = reflections[i]->miller(j)->getCorrectedX();
-            fdata[8] = reflections[i]->miller(j)->getCorrectedY();
-            fdata[9] = countingSigma;
-            fdata[10] = rejectFlags;
-
-            ccp4_lwrefl(mtzout, fdata, colout, columns, num);
+            rows->push_back(miller->getH());
+            rows->push_back(miller->getK());
+            rows->push_back(miller->getL());
+            rows->push_back(intensity / bFactor);
+            rows->push_back(sigma);
+            rows->push_back(partiality);
+            rows->push_back(miller->getWavelength());
+            rows->push_back(miller->getCorrectedX());
+            rows->push_back(miller->getCorrectedY());
+            rows->push_back(countingSigma);
+            rows->push_back(rejectFlags);
         }
     }
 
@@ -1190,17 +1391,25 @@ void MtzManager::writeToFile(std::string newFilename, bool announce, bool plusAm
         resetFlip();
     }
 
+    return num;
+}
 
-    MtzPut(mtzout, " ");
-    MtzFree(mtzout);
+void MtzManager::writeCrystal(std::string newFilename, bool announce)
+{
+    CrystalPackPtr pack = CrystalPack::getOutputPack();
 
-    LogLevel shouldAnnounce = announce ? LogLevelNormal : LogLevelDebug;
+    if (!pack)
+    {
+        writeToFile(newFilename, announce);
+        return;
+    }
 
-    std::ostringstream logged;
-    logged << "Written " << num << " refls to file " << newFilename << std::endl;
-    Logger::mainLogger->addStream(&logged, shouldAnnounce);
+    if (newFilename == "")
+    {
+        newFilename = getFilename();
+    }
 
-    delete [] fdata;
+    pack->addCrystal(this, newFilename, announce);
 }
 
 
@@ -1261,15 +1470,24 @@ int MtzManager::rejectOverlaps()
     return count;
 }
 
+// pixels; larger than twice the tolerance in Miller::isOverlappedWithSpots
+#define STRONG_SPOT_GRID_CELL 8.
+
 int MtzManager::removeStrongSpots(std::vector<SpotPtr> *spots, bool actuallyDelete)
 {
     int count = 0;
+    SpotGrid grid(*spots, STRONG_SPOT_GRID_CELL);
 
     for (int i = 0; i < reflectionCount(); i++)
     {
         ReflectionPtr ref = reflection(i);
 
-        count += ref->checkSpotOverlaps(spots, actuallyDelete);
+        count += ref->checkSpotOverlaps(&grid, actuallyDelete);
+    }
+
+    if (actuallyDelete && grid.removedCount() > 0)
+    {
+        grid.remainingSpots(spots);
     }
 
     return count;
@@ -1324,6 +1542,8 @@ void MtzManager::setActiveAmbiguity(int newAmbiguity)
     {
         reflection(i)->setActiveAmbiguity(newAmbiguity);
     }
+
+    clearReflectionIndex();
 }
 
 double MtzManager::maxResolution()
@@ -1458,6 +1678,120 @@ void MtzManager::millersToDetector()
 
 // MARK: IOMRefiner
 
+// Masks are grown with some room to spare, as refined unit cells (and so
+// the largest Miller indices) vary a little from crystal to crystal.
+#define ABSENCE_MASK_SLACK 4
+
+// Beyond this many indices the mask is not worth its memory.
+#define ABSENCE_MASK_MAX_SIZE 128000000
+
+MtzManager::AbsenceMaskPtr MtzManager::absenceMask(CCP4SPG *spg, int (&maxMillers)[3])
+{
+    std::lock_guard<std::mutex> lock(absenceMutex);
+
+    std::string symbol = spg->symbol_xHM;
+    AbsenceMaskPtr mask;
+
+    if (absenceMasks.count(symbol))
+    {
+        mask = absenceMasks[symbol];
+
+        if (mask->extent[0] >= maxMillers[0] && mask->extent[1] >= maxMillers[1] &&
+            mask->extent[2] >= maxMillers[2])
+        {
+            return mask;
+        }
+    }
+
+    int extent[3];
+    double size = 1;
+
+    for (int i = 0; i < 3; i++)
+    {
+        extent[i] = maxMillers[i] + ABSENCE_MASK_SLACK;
+
+        if (mask && mask->extent[i] > extent[i])
+        {
+            extent[i] = mask->extent[i];
+        }
+
+        size *= extent[i] * 2;
+    }
+
+    if (size > ABSENCE_MASK_MAX_SIZE)
+    {
+        return AbsenceMaskPtr();
+    }
+
+    mask = AbsenceMaskPtr(new AbsenceMask());
+    memcpy(mask->extent, extent, sizeof(extent));
+    mask->absent.resize((size_t)size);
+
+    int position = 0;
+
+    for (int h = -extent[0]; h < extent[0]; h++)
+    {
+        for (int k = -extent[1]; k < extent[1]; k++)
+        {
+            for (int l = -extent[2]; l < extent[2]; l++)
+            {
+                mask->absent[position] = ccp4spg_is_sysabs(spg, h, k, l);
+                position++;
+            }
+        }
+    }
+
+    absenceMasks[symbol] = mask;
+
+    return mask;
+}
+
+// Values of l for which offset + l * step lies inside a sphere about the
+// origin; false if the line misses the sphere.
+static bool sphereChord(vec offset, vec step, double radius, double *lower, double *upper)
+{
+    double a = length_of_vector_squared(step);
+    double b = dot_product_for_vectors(offset, step);
+    double c = length_of_vector_squared(offset) - radius * radius;
+    double discriminant = b * b - a * c;
+
+    if (a <= 0 || discriminant < 0)
+    {
+        return false;
+    }
+
+    double root = sqrt(discriminant);
+    *lower = (-b - root) / a;
+    *upper = (-b + root) / a;
+
+    return true;
+}
+
+// Adds the ranges of l (with a margin of one either side) for which
+// offset + l * step lies between the inner and outer sphere.
+static void addShellRanges(vec offset, vec step, double inner, double outer,
+                           std::vector<std::pair<int, int> > *ranges)
+{
+    double outerLower, outerUpper, innerLower, innerUpper;
+
+    if (!sphereChord(offset, step, outer, &outerLower, &outerUpper))
+    {
+        return;
+    }
+
+    int lower = floor(outerLower) - 1;
+    int upper = ceil(outerUpper) + 1;
+
+    if (!sphereChord(offset, step, inner, &innerLower, &innerUpper))
+    {
+        ranges->push_back(std::make_pair(lower, upper));
+        return;
+    }
+
+    ranges->push_back(std::make_pair(lower, (int)ceil(innerLower) + 1));
+    ranges->push_back(std::make_pair((int)floor(innerUpper) - 1, upper));
+}
+
 void MtzManager::calculateNearbyMillers()
 {
         double wavelength = getWavelength();
@@ -1465,7 +1799,8 @@ void MtzManager::calculateNearbyMillers()
         double minBandwidth = wavelength * (1 - testBandwidth * 2);
         double maxBandwidth = wavelength * (1 + testBandwidth * 2);
 
-        double sphereThickness = FileParser::getKey("SPHERE_THICKNESS", 0.01);
+        static CachedKey<double> sphereThicknessKey("SPHERE_THICKNESS", 0.01);
+        double sphereThickness = sphereThicknessKey.get();
 
         double minSphere = 1 / wavelength * (1 - sphereThickness);
         double maxSphere = 1 / wavelength * (1 + sphereThickness);
@@ -1496,57 +1831,131 @@ void MtzManager::calculateNearbyMillers()
                 sendLogAndExit();
         }
 
+        AbsenceMaskPtr absences = absenceMask(spg, maxMillers);
+        int rowLength = absences ? absences->extent[2] * 2 : 0;
+
+        // Rather than test every (h, k, l) in the box, each row of constant
+        // (h, k) is only walked over the values of l which come near enough
+        // to the Ewald sphere (within the sphere thickness or the range of
+        // wavelengths) to stand a chance; each is then tested in full below.
+        vec aStar = new_vector(1, 0, 0);
+        vec bStar = new_vector(0, 1, 0);
+        vec cStar = new_vector(0, 0, 1);
+        rotatedMatrix->multiplyVector(&aStar);
+        rotatedMatrix->multiplyVector(&bStar);
+        rotatedMatrix->multiplyVector(&cStar);
+
+        std::vector<std::pair<int, int> > ranges;
+
         for (int h = -maxMillers[0]; h < maxMillers[0]; h++)
         {
                 for (int k = -maxMillers[1]; k < maxMillers[1]; k++)
                 {
-                        for (int l = -maxMillers[2]; l < maxMillers[2]; l++)
-                        {
-                                if (ccp4spg_is_sysabs(getSpaceGroup(), h, k, l))
-                                        continue;
+                        vec row = new_vector(h * aStar.h + k * bStar.h,
+                                             h * aStar.k + k * bStar.k,
+                                             h * aStar.l + k * bStar.l);
 
-                                vec hkl = new_vector(h, k, l);
-                                rotatedMatrix->multiplyVector(&hkl);
+                        ranges.clear();
 
-                                if (hkl.l > 0.01)
-                                        continue;
+                        vec fromCentre = row;
+                        fromCentre.l += 1 / wavelength;
+                        addShellRanges(fromCentre, cStar, minSphere, maxSphere, &ranges);
 
-                                vec beam = new_vector(0, 0, -1 / wavelength);
-                                vec beamToMiller = vector_between_vectors(beam, hkl);
+                        if (minBandwidth > 0)
+                        {
+                                // points whose own wavelength is within range lie
+                                // inside the Ewald sphere for the shortest wavelength
+                                // but not inside that for the longest.
+                                vec fromShortest = row;
+                                fromShortest.l += 1 / minBandwidth;
+                                vec fromLongest = row;
+                                fromLongest.l += 1 / maxBandwidth;
 
-                                double sphereRadiusSquared = length_of_vector_squared(beamToMiller);
+                                double lower, upper, innerLower, innerUpper;
 
-                                if (sphereRadiusSquared < minSphereSquared ||
-                                        sphereRadiusSquared > maxSphereSquared)
+                                if (sphereChord(fromShortest, cStar, 1 / minBandwidth, &lower, &upper))
                                 {
-                                        double ewaldSphere = getEwaldSphereNoMatrix(hkl);
-
-                                        if (ewaldSphere < minBandwidth || ewaldSphere > maxBandwidth)
+                                        if (sphereChord(fromLongest, cStar, 1 / maxBandwidth, &innerLower, &innerUpper))
                                         {
-                                                continue;
+                                                ranges.push_back(std::make_pair((int)floor(lower) - 1, (int)ceil(innerLower) + 1));
+                                                ranges.push_back(std::make_pair((int)floor(innerUpper) - 1, (int)ceil(upper) + 1));
+                                        }
+                                        else
+                                        {
+                                                ranges.push_back(std::make_pair((int)floor(lower) - 1, (int)ceil(upper) + 1));
                                         }
                                 }
+                        }
+                        else
+                        {
+                                ranges.push_back(std::make_pair(-maxMillers[2], maxMillers[2]));
+                        }
 
-                                double res = length_of_vector_squared(hkl);
+                        std::sort(ranges.begin(), ranges.end());
 
-                                if (res > maxDistSquared)
-                                {
-                                        overRes++;
-                                        continue;
-                                }
+                        int nextL = -maxMillers[2];
+                        int rowStart = 0;
 
-                                if (minResolutionAll > 0 && res < minResolutionSquared)
+                        if (absences)
+                        {
+                                rowStart = ((h + absences->extent[0]) * absences->extent[1] * 2 +
+                                            k + absences->extent[1]) * rowLength + absences->extent[2];
+                        }
+
+                        for (int r = 0; r < ranges.size(); r++)
+                        {
+                                for (int l = std::max(ranges[r].first, nextL);
+                                     l <= ranges[r].second && l < maxMillers[2]; l++)
                                 {
-                                        underRes++;
-                                        continue;
-                                }
+                                        nextL = l + 1;
 
-                                if (h == 0 && k == 0 && l == 0)
-                                        continue;
+                                        if (absences ? (bool)absences->absent[rowStart + l] :
+                                            ccp4spg_is_sysabs(spg, h, k, l))
+                                                continue;
+
+                                        vec hkl = new_vector(h, k, l);
+                                        rotatedMatrix->multiplyVector(&hkl);
+
+                                        if (hkl.l > 0.01)
+                                                continue;
 
-                                MillerPtr newMiller = MillerPtr(new Miller(NULL, h, k, l));
-                                newMiller->setMatrix(rotatedMatrix);
-                                nearbyMillers.push_back(newMiller);
+                                        vec beam = new_vector(0, 0, -1 / wavelength);
+                                        vec beamToMiller = vector_between_vectors(beam, hkl);
+
+                                        double sphereRadiusSquared = length_of_vector_squared(beamToMiller);
+
+                                        if (sphereRadiusSquared < minSphereSquared ||
+                                                sphereRadiusSquared > maxSphereSquared)
+                                        {
+                                                double ewaldSphere = getEwaldSphereNoMatrix(hkl);
+
+                                                if (ewaldSphere < minBandwidth || ewaldSphere > maxBandwidth)
+                                                {
+                                                        continue;
+                                                }
+                                        }
+
+                                        double res = length_of_vector_squared(hkl);
+
+                                        if (res > maxDistSquared)
+                                        {
+                                                overRes++;
+                                                continue;
+                                        }
+
+                                        if (minResolutionAll > 0 && res < minResolutionSquared)
+                                        {
+                                                underRes++;
+                                                continue;
+                                        }
+
+                                        if (h == 0 && k == 0 && l == 0)
+                                                continue;
+
+                                        MillerPtr miller = boost::allocate_shared<Miller>(PoolAllocator<Miller>(pool), (MtzManager *)NULL, h, k, l, true);
+                                        miller->setMatrix(rotatedMatrix);
+                                        nearbyMillers.push_back(miller);
+                                }
                         }
                 }
         }
@@ -1656,15 +2065,41 @@ void MtzManager::integrateChosenMillers(bool quick)
 
         Miller::rotateMatrixHKL(hRot, kRot, lRot, matrix, &rotatedMatrix);
 
+        std::vector<MillerPtr> millers;
+
         for (int i = 0; i < reflectionCount(); i++)
         {
                 for (int j = 0; j < reflection(i)->millerCount(); j++)
                 {
                         MillerPtr miller = reflection(i)->miller(j);
                         miller->setMatrix(rotatedMatrix);
-                        miller->integrateIntensity(quick);
-                        miller->recalculateWavelength();
-                        miller->setMatrix(matrix);
+                        millers.push_back(miller);
+                }
+        }
+
+        if (millers.size())
+        {
+                ImagePtr millerImage = millers[0]->getImage();
+
+                if (!millerImage)
+                {
+                        throw 1;
+                }
+
+                millerImage->integrateMillers(millers, quick);
+        }
+
+        for (int i = 0; i < millers.size(); i++)
+        {
+                millers[i]->recalculateWavelength();
+                millers[i]->setMatrix(matrix);
+        }
+
+        for (int i = 0; i < reflectionCount(); i++)
+        {
+                for (int j = 0; j < reflection(i)->millerCount(); j++)
+                {
+                        MillerPtr miller = reflection(i)->miller(j);
 
                         if (!miller->accepted())
                         {
@@ -1859,6 +2294,7 @@ void MtzManager::dropMillers()
 {
         nearbyMillers.clear();
         vector<MillerPtr>().swap(nearbyMillers);
+        pool = ObjectPool::create();
 }
 
 
@@ -1965,11 +2401,22 @@ void MtzManager::getWavelengthHistogram(vector<double> *wavelengths,
 
 void MtzManager::refineOrientationMatrix(bool force)
 {
-        bool fixUnitCell = FileParser::getKey("FIX_UNIT_CELL", true);
+        static CachedKey<bool> fixUnitCellKey("FIX_UNIT_CELL", true);
+        static CachedKey<vector<double> > unitCellKey("UNIT_CELL", vector<double>());
+        static CachedKey<int> bigSizeKey("METROLOGY_SEARCH_SIZE_BIG", 3);
+        static CachedKey<bool> refineOffsetKey("REFINE_EACH_DETECTOR_DISTANCE", false);
+        static CachedKey<bool> refineUnitCellAKey("OPTIMISING_UNIT_CELL_A", false);
+        static CachedKey<bool> refineUnitCellBKey("OPTIMISING_UNIT_CELL_B", false);
+        static CachedKey<bool> refineUnitCellCKey("OPTIMISING_UNIT_CELL_C", false);
+        static CachedKey<double> stepSizeUnitCellAKey("STEP_SIZE_UNIT_CELL_A", 0.2);
+        static CachedKey<double> stepSizeUnitCellBKey("STEP_SIZE_UNIT_CELL_B", 0.2);
+        static CachedKey<double> stepSizeUnitCellCKey("STEP_SIZE_UNIT_CELL_C", 0.2);
+
+        bool fixUnitCell = fixUnitCellKey.get();
 
         if (fixUnitCell)
         {
-                vector<double> unitCell = FileParser::getKey("UNIT_CELL", vector<double>());
+                vector<double> unitCell = unitCellKey.get();
                 setUnitCell(unitCell);
         }
 
@@ -1980,16 +2427,16 @@ void MtzManager::refineOrientationMatrix(bool force)
         lastTotal = getTotalReflections();
 
         int oldSearchSize = searchSize;
-        int bigSize = FileParser::getKey("METROLOGY_SEARCH_SIZE_BIG", 3);
-        bool refineOffset = FileParser::getKey("REFINE_EACH_DETECTOR_DISTANCE", false);
+        int bigSize = bigSizeKey.get();
+        bool refineOffset = refineOffsetKey.get();
 
-        bool refineUnitCellA = FileParser::getKey("OPTIMISING_UNIT_CELL_A", false);
-        bool refineUnitCellB = FileParser::getKey("OPTIMISING_UNIT_CELL_B", false);
-        bool refineUnitCellC = FileParser::getKey("OPTIMISING_UNIT_CELL_C", false);
+        bool refineUnitCellA = refineUnitCellAKey.get();
+        bool refineUnitCellB = refineUnitCellBKey.get();
+        bool refineUnitCellC = refineUnitCellCKey.get();
 
-        double stepSizeUnitCellA = FileParser::getKey("STEP_SIZE_UNIT_CELL_A", 0.2);
-        double stepSizeUnitCellB = FileParser::getKey("STEP_SIZE_UNIT_CELL_B", 0.2);
-        double stepSizeUnitCellC = FileParser::getKey("STEP_SIZE_UNIT_CELL_C", 0.2);
+        double stepSizeUnitCellA = stepSizeUnitCellAKey.get();
+        double stepSizeUnitCellB = stepSizeUnitCellBKey.get();
+        double stepSizeUnitCellC = stepSizeUnitCellCKey.get();
 
         bool refineCell = refineUnitCellA || refineUnitCellB || refineUnitCellC;
 
@@ -33,6 +33,10 @@ typedef enum
 } TrustLevel;
 
 class Miller;
+struct CrystalPackRecord;
+
+// columns in each row written by writeToFile and reflectionRows
+#define MTZ_ROW_COLUMNS 11
 
 class MtzManager : public LoggableObject, public hasFilename, public hasSymmetry, public boost::enable_shared_from_this<MtzManager>
 {
@@ -51,6 +55,19 @@ protected:
 
         vector<MillerPtr> nearbyMillers;
 
+        /* Systematic absences for every (h, k, l) with |h| < extent[0] etc.,
+         * worked out once per space group and shared between crystals. */
+        typedef struct
+        {
+            int extent[3];
+            std::vector<bool> absent;
+        } AbsenceMask;
+        typedef boost::shared_ptr<AbsenceMask> AbsenceMaskPtr;
+
+        static std::map<std::string, AbsenceMaskPtr> absenceMasks;
+        static std::mutex absenceMutex;
+        static AbsenceMaskPtr absenceMask(CCP4SPG *spg, int (&maxMillers)[3]);
+
         void calculateNearbyMillers();
         void checkNearbyMillers();
 
@@ -72,6 +89,7 @@ protected:
         ImageWeakPtr image;
     bool dropped;
     void getWavelengthFromHDF5();
+    void applyLoadedUnitCell(std::vector<float> &cell);
 
     BeamPtr beam;
 
@@ -81,6 +99,13 @@ protected:
 
         vector<ReflectionPtr> reflections;
         vector<ReflectionPtr> refReflections;
+
+    // open-addressed table from reflection id to position in reflections,
+    // only kept for the reference and merge; cleared when reflections change.
+    vector<unsigned int> indexKeys;
+    vector<int> indexPositions;
+    int indexShift;
+    void clearReflectionIndex();
         vector<ReflectionPtr> matchReflections;
     MtzManager *previousReference;
     int previousAmbiguity;
@@ -144,6 +169,7 @@ protected:
         static MtzManager *referenceManager;
         static MtzPtr differenceManager;
         MtzManager *lastReference;
+    ObservationStorePtr observations;
 
         int _xPos;
         int _yPos;
@@ -165,6 +191,11 @@ public:
     static vector<double> superGaussianTable;
     static bool setupSuperGaussian;
     static std::mutex tableMutex;
+
+    /* Replaced whenever the crystal lets go of its reflections or Millers,
+     * so that the old pool (and its slabs) is freed as soon as the last of
+     * its objects has gone. */
+    ObjectPoolPtr pool;
     double bFactor;
     double externalScale;
     int removeStrongSpots(std::vector<SpotPtr> *spots, bool actuallyDelete = true);
@@ -175,6 +206,8 @@ public:
         void loadParametersMap();
 
     void addMiller(MillerPtr miller);
+    MillerPtr newMiller(int h, int k, int l, bool calcFree = true);
+    ReflectionPtr newReflection();
     void clearReflections();
         void addReflection(ReflectionPtr reflection);
         void removeReflection(int i);
@@ -188,11 +221,14 @@ public:
     void setDefaultMatrix();
         void setMatrix(MatrixPtr newMat);
         void sortReflections();
+    void indexReflections();
+    int indexedPosition(long unsigned int refl_id);
         void applyUnrefinedPartiality();
     void incrementActiveAmbiguity();
     double maxResolution();
 
         virtual void loadReflections();
+    void loadPackedReflections(const CrystalPackRecord *record, const float *rows);
     void dropReflections();
         static void setReference(MtzManager *reference);
     ReflectionPtr findReflectionWithId(ReflectionPtr exampleRefl, size_t *lowestId = NULL);
@@ -216,6 +252,8 @@ public:
 
         virtual void writeToFile(std::string newFilename, bool announce = false, bool plusAmbiguity = false,
                                                          bool withScale = false);
+    void writeCrystal(std::string newFilename = "", bool announce = false);
+    int reflectionRows(std::vector<float> *rows, bool plusAmbiguity = false, bool withScale = false);
     void writeToHdf5();
 
         double correlationWithManager(MtzManager *otherManager, bool printHits = false,
@@ -262,6 +300,9 @@ public:
     void refinePartialities();
 
     void refreshCurrentPartialities();
+    void refreshObservations();
+    MatrixPtr refreshedMatrix(double hRot, double kRot, double exponent);
+    double observationScore();
     // delete
         void refreshPartialities(double hRot, double kRot, double mosaicity,
                              double spotSize, double wavelength,
@@ -429,6 +470,11 @@ public:
                 return matrix;
         }
 
+        ObjectPoolPtr getPool()
+        {
+                return pool;
+        }
+
         static MtzManager*& getReferenceManager()
         {
         return referenceManager;
@@ -16,6 +16,7 @@
 #include "RefinementStepSearch.h"
 #include "Reflection.h"
 #include "Miller.h"
+#include "ObservationStore.h"
 
 void MtzManager::applyUnrefinedPartiality()
 {
@@ -120,6 +121,18 @@ double MtzManager::refinePartialitiesOrientation(int ambiguity, bool reset)
                 wavelength = bestWavelength();
         }
 
+        bool flatObservations = FileParser::getKey("FLAT_OBSERVATIONS", false);
+
+        // taken after the first refresh, as bestWavelength() reads the Millers
+        if (flatObservations && referenceManager != NULL
+                && !Miller::isCorrectingPolarisation()
+                && (scoreType == ScoreTypeCorrelation
+                        || scoreType == ScoreTypeMinimizeRSplit))
+        {
+                observations = ObservationStorePtr(new ObservationStore());
+                observations->snapshot(this, referenceManager);
+        }
+
         /*
     {
         beam = GaussianBeamPtr(new GaussianBeam(wavelength, bandwidth, exponent));
@@ -143,6 +156,12 @@ double MtzManager::refinePartialitiesOrientation(int ambiguity, bool reset)
 
     refinementMap->refine();
 
+        if (observations)
+        {
+                observations->writeBack(this);
+                observations = ObservationStorePtr();
+        }
+
     double correl = correlation();
 
         if (reset)
@@ -186,7 +205,7 @@ void MtzManager::refinePartialities()
         << "\t" << accepted() << std::endl;
     sendLog();
 
-    writeToFile(std::string("ref-") + getFilename());
+    writeCrystal(std::string("ref-") + getFilename());
 }
 
 void MtzManager::refreshCurrentPartialities()
@@ -224,22 +243,31 @@ void MtzManager::replaceBeamWithSpectrum()
     }
 }
 
-void MtzManager::refreshPartialities(double hRot, double kRot, double mosaicity,
-                double spotSize, double wavelength, double bandwidth, double exponent)
+MatrixPtr MtzManager::refreshedMatrix(double hRot, double kRot, double exponent)
 {
     this->makeSuperGaussianLookupTable(exponent);
 
     if (!matrix)
-        return;
+        return MatrixPtr();
 
-
-        lockUnitCellDimensions();
+    lockUnitCellDimensions();
 
     this->matrix->changeOrientationMatrixDimensions(getUnitCell());
 
     MatrixPtr newMatrix = MatrixPtr();
     Miller::rotateMatrixHKL(hRot, kRot, 0, matrix, &newMatrix);
 
+    return newMatrix;
+}
+
+void MtzManager::refreshPartialities(double hRot, double kRot, double mosaicity,
+                double spotSize, double wavelength, double bandwidth, double exponent)
+{
+    MatrixPtr newMatrix = refreshedMatrix(hRot, kRot, exponent);
+
+    if (!newMatrix)
+        return;
+
         for (int i = 0; i < reflections.size(); i++)
         {
                 for (int j = 0; j < reflections[i]->millerCount(); j++)
@@ -802,10 +830,75 @@ double MtzManager::refineParameterScore(void *object)
 {
         MtzManager *me = static_cast<MtzManager *>(object);
 
+        if (me->observations)
+        {
+                me->refreshObservations();
+                return me->observationScore();
+        }
+
         me->refreshCurrentPartialities();
         return exclusionScoreWrapper(me);
 }
 
+void MtzManager::refreshObservations()
+{
+        if (externalScale != -1)
+        {
+                scale = externalScale;
+                observations->setScale(externalScale);
+        }
+
+        if (bFactor != 0)
+        {
+                observations->setBFactor(bFactor);
+        }
+
+        // Millers fall back on the image wavelength, which the store does not keep
+        if (wavelength == 0 || Miller::hasIndividualWavelengths())
+        {
+                refreshPartialities(this->hRot,
+                                this->kRot,
+                                this->mosaicity,
+                                this->spotSize,
+                                this->wavelength,
+                                this->bandwidth,
+                                this->exponent);
+
+                observations->readPartialities(this);
+                return;
+        }
+
+        MatrixPtr newMatrix = refreshedMatrix(hRot, kRot, exponent);
+
+        if (!newMatrix)
+                return;
+
+        observations->calculatePartialities(newMatrix, mosaicity, spotSize,
+                        wavelength, bandwidth, exponent);
+}
+
+/* Same targets as exclusionScoreWrapper, evaluated on the flat
+ * observation arrays taken in refinePartialitiesOrientation. */
+
+double MtzManager::observationScore()
+{
+        if (scoreType == ScoreTypeCorrelation)
+        {
+                return 1 - observations->correlation(0, 0);
+        }
+
+        double grad = observations->scaleToReference();
+
+        if (grad == grad)
+        {
+                scale *= grad;
+        }
+
+        lastRSplit = observations->rSplit(0, 0);
+
+        return lastRSplit;
+}
+
 void MtzManager::excludeFromLogCorrelation()
 {
         bool correlationRejection = FileParser::getKey("CORRELATION_REJECTION", true);
@@ -18,6 +18,9 @@
 #include "ccp4_general.h"
 #include "ccp4_parser.h"
 #include "StatisticsManager.h"
+#include "ThreadPool.h"
+#include "MergeShards.h"
+#include <algorithm>
 
 // MARK: Miscellaneous
 
@@ -346,7 +349,8 @@ MtzRejectionReason MtzMerger::isMtzAccepted(MtzPtr mtz)
     }
 
     double scale = mtz->getScale();
-    double rejectBelow = FileParser::getKey("REJECT_BELOW_SCALE", 0.0);
+    static CachedKey<double> rejectBelowKey("REJECT_BELOW_SCALE", 0.0);
+    double rejectBelow = rejectBelowKey.get();
 
     if (scale < rejectBelow)
     {
@@ -511,10 +515,10 @@ void MtzMerger::makeEmptyReflectionShells(MtzPtr whichMtz)
 
                 if (ccp4spg_is_in_asu(spg, h, k, l) && !ccp4spg_is_sysabs(spg, h, k, l))
                 {
-                    MillerPtr miller = MillerPtr(new Miller(&*whichMtz, h, k, l, false));
+                    MillerPtr miller = whichMtz->newMiller(h, k, l, false);
                     miller->setRawIntensity(std::nan(" "));
 
-                    ReflectionPtr newReflection = ReflectionPtr(new Reflection());
+                    ReflectionPtr newReflection = whichMtz->newReflection();
                     newReflection->setUnitCell(unitCell);
                     newReflection->setSpaceGroup(spg->spg_num);
                     newReflection->addMiller(miller);
@@ -531,15 +535,24 @@ void MtzMerger::makeEmptyReflectionShells(MtzPtr whichMtz)
 
 }
 
-void MtzMerger::addMtzMillers(MtzPtr mtz)
+void MtzMerger::addMtzMillers(MtzPtr mtz, BatchBuffer *buffer)
 {
     for (int j = 0; j < mtz->reflectionCount(); j++)
     {
         ReflectionPtr refl = mtz->reflection(j);
         ReflectionPtr partnerRefl;
         int reflId = (int)refl->getReflId();
+        int reflNum = mergedMtz->indexedPosition(reflId);
 
-        mergedMtz->findReflectionWithId(reflId, &partnerRefl);
+        if (rejectionPass && (reflNum < 0 || !needsRejection[reflNum]))
+        {
+            continue;
+        }
+
+        if (reflNum >= 0)
+        {
+            partnerRefl = mergedMtz->reflection(reflNum);
+        }
 
         if (partnerRefl)
         {
@@ -553,7 +566,11 @@ void MtzMerger::addMtzMillers(MtzPtr mtz)
 
                 if (miller->isRejected())
                 {
-                    incrementRejectedReflections();
+                    if (!rejectionPass)
+                    {
+                        incrementRejectedReflections();
+                    }
+
                     accept = false;
                 }
 
@@ -579,52 +596,109 @@ void MtzMerger::addMtzMillers(MtzPtr mtz)
 
                         sendLog();
                     }
-                    partnerRefl->addLiteMiller(miller);
+
+                    if (buffer)
+                    {
+                        BufferedMiller buffered;
+                        buffered.reflNum = reflNum;
+                        buffered.liteMiller = Reflection::liteMillerFor(miller);
+                        (*buffer)[reflNum / gatherSize].push_back(buffered);
+                    }
+                    else if (streaming && !rejectionPass)
+                    {
+                        partnerRefl->accumulateMiller(miller);
+                    }
+                    else
+                    {
+                        partnerRefl->addLiteMiller(miller);
+                    }
                 }
             }
         }
     }
 }
 
-void MtzMerger::groupMillerThread(int offset)
+void MtzMerger::groupMillersForMtz(int mtzNum, BatchBuffer *buffer)
 {
-    int maxThreads = FileParser::getMaxThreads();
+    MtzPtr mtz = allMtzs[mtzNum];
 
-    for (int i = offset; i < allMtzs.size(); i += maxThreads)
+    if (lowMemoryMode)
     {
-        MtzPtr mtz = allMtzs[i];
+        mtz->loadReflections();
+    }
 
-        if (lowMemoryMode)
-        {
-            mtz->loadReflections();
-        }
+    // rejections have already been counted on the first pass
+    if (rejectionPass ? !mtzAccepted[mtzNum] : mtzIsPruned(mtz))
+    {
+        return;
+    }
 
-        if (mtzIsPruned(mtz))
-        {
-            continue;
-        }
+    mtzAccepted[mtzNum] = true;
 
-        mtz->flipToActiveAmbiguity();
+    mtz->flipToActiveAmbiguity();
 
-        if (needToScale)
-        {
-            scaleIndividual(mtz);
-        }
+    // scales are kept from the first pass unless the reflections were dropped
+    if (needToScale && (!rejectionPass || lowMemoryMode))
+    {
+        scaleIndividual(mtz);
+    }
+
+    addMtzMillers(mtz, buffer);
+
+    if (lowMemoryMode)
+    {
+        mtz->dropReflections();
+    }
+
+    mtz->resetFlip();
+}
+
+void MtzMerger::groupMillersWrapper(void *object, int mtzNum)
+{
+    static_cast<MtzMerger *>(object)->groupMillersForMtz(mtzNum);
+}
+
+void MtzMerger::groupMillersForBatch(int batchNum)
+{
+    BatchBuffer &buffer = batchBuffers[batchNum];
+    int end = std::min((batchNum + 1) * batchSize, (int)allMtzs.size());
+
+    for (int i = batchNum * batchSize; i < end; i++)
+    {
+        groupMillersForMtz(i, &buffer);
+    }
+}
 
-        addMtzMillers(mtz);
+void MtzMerger::groupMillersForBatchWrapper(void *object, int batchNum)
+{
+    static_cast<MtzMerger *>(object)->groupMillersForBatch(batchNum);
+}
 
-        if (lowMemoryMode)
+void MtzMerger::gatherMillersForRange(int rangeNum)
+{
+    for (int i = 0; i < batchBuffers.size(); i++)
+    {
+        std::vector<BufferedMiller> &buffered = batchBuffers[i][rangeNum];
+
+        for (int j = 0; j < buffered.size(); j++)
         {
-            mtz->dropReflections();
-        }
+            ReflectionPtr refl = mergedMtz->reflection(buffered[j].reflNum);
 
-        mtz->resetFlip();
+            if (streaming && !rejectionPass)
+            {
+                refl->accumulateLiteMiller(buffered[j].liteMiller);
+            }
+            else
+            {
+                refl->addLiteMiller(buffered[j].liteMiller);
+            }
+        }
     }
 }
 
-void MtzMerger::groupMillerThreadWrapper(MtzMerger *object, int offset)
+void MtzMerger::gatherMillersForRangeWrapper(void *object, int rangeNum)
 {
-    object->groupMillerThread(offset);
+    static_cast<MtzMerger *>(object)->gatherMillersForRange(rangeNum);
 }
 
 void MtzMerger::groupMillers()
@@ -634,96 +708,222 @@ void MtzMerger::groupMillers()
     mergedMtz->setDefaultMatrix();
 
     makeEmptyReflectionShells(mergedMtz);
+    mergedMtz->indexReflections();
     rejectNums = std::map<MtzRejectionReason, int>();
+    mtzAccepted.assign(allMtzs.size(), false);
 
-    boost::thread_group threads;
-    int maxThreads = FileParser::getMaxThreads();
+    collectObservations();
+}
+
+void MtzMerger::writeShard(int shardNum)
+{
+    BatchBuffer buffer(1);
+    int end = std::min((shardNum + 1) * shardCrystals, (int)allMtzs.size());
 
-    for (int i = 0; i < maxThreads; i++)
+    for (int i = shardNum * shardCrystals; i < end; i++)
     {
-        boost::thread *thr = new boost::thread(groupMillerThreadWrapper, this, i);
-        threads.add_thread(thr);
+        groupMillersForMtz(i, &buffer);
     }
 
-    threads.join_all();
+    shardFailed[shardNum] = !shards->writeShard(shardNum, buffer[0]);
 }
 
-// MARK: Merging millers.
-
-void MtzMerger::mergeMillersThread(int offset)
+void MtzMerger::writeShardWrapper(void *object, int shardNum)
 {
-    int maxThreads = FileParser::getMaxThreads();
-
-    bool mergeMedian = FileParser::getKey("MERGE_MEDIAN", false);
+    static_cast<MtzMerger *>(object)->writeShard(shardNum);
+}
 
-    for (int i = offset; i < mergedMtz->reflectionCount(); i += maxThreads)
+void MtzMerger::collectObservations()
+{
+    if (shardDirectory.length())
     {
-        double intensity = 0;
-        double sigma = 0;
-        double countingSigma = 0;
-        int rejected = 0;
+        // one range covering every reflection, sorted when written out
+        gatherSize = std::max(mergedMtz->reflectionCount(), 1);
+        int shardCount = ((int)allMtzs.size() + shardCrystals - 1) / shardCrystals;
+        shards = MergeShardsPtr(new MergeShards(shardDirectory, shardCount));
 
-        ReflectionPtr refl = mergedMtz->reflection(i);
+        shardFailed.assign(shardCount, false);
+        ThreadPool::getPool()->parallelFor(writeShardWrapper, this, shardCount, 1);
 
-        if (refl->liteMillerCount() == 0)
+        for (int i = 0; i < shardFailed.size(); i++)
         {
-            continue;
+            if (shardFailed[i])
+            {
+                logged << "Could not write every merge shard to " << shardDirectory
+                << ", so the merge would be missing observations. Stopping." << std::endl;
+                sendLogAndExit();
+            }
         }
 
-        int *rejPtr = preventRejections ? NULL : &rejected;
+        return;
+    }
 
-        if (!mergeMedian)
-        {
-            refl->liteMerge(&intensity, &countingSigma, &sigma, rejPtr, friedel);
-        }
-        else
-        {
-            refl->medianMerge(&intensity, &countingSigma, rejPtr, friedel);
-        }
+    if (!localBuffers)
+    {
+        ThreadPool::getPool()->parallelFor(groupMillersWrapper, this, (int)allMtzs.size());
+        return;
+    }
 
-        float intFloat = (float)intensity;
+    int reflCount = mergedMtz->reflectionCount();
+    gatherSize = ThreadPool::grainForCount(reflCount);
+    int ranges = (reflCount + gatherSize - 1) / gatherSize;
 
-        if (!std::isfinite(intFloat))
-        {
-            continue;
-        }
+    // several batches per thread, to even out the load
+    int batches = ThreadPool::getPool()->threadCount() * 4;
+    batchSize = ((int)allMtzs.size() + batches - 1) / batches;
+    batches = ((int)allMtzs.size() + batchSize - 1) / batchSize;
+    batchBuffers.resize(batches, BatchBuffer(ranges));
+
+    ThreadPool::getPool()->parallelFor(groupMillersForBatchWrapper, this, batches);
+    ThreadPool::getPool()->parallelFor(gatherMillersForRangeWrapper, this, ranges);
 
-        // this could be better coded
-        for (int r = 0; r < rejected; r++)
+    std::vector<BatchBuffer>().swap(batchBuffers);
+}
+
+// MARK: Merging millers.
+
+void MtzMerger::mergeMillersForReflection(int reflNum)
+{
+    double intensity = 0;
+    double sigma = 0;
+    double countingSigma = 0;
+    int rejected = 0;
+
+    ReflectionPtr refl = mergedMtz->reflection(reflNum);
+
+    if (rejectionPass && !needsRejection[reflNum])
+    {
+        return;
+    }
+
+    if (refl->liteMillerCount() == 0 && refl->accumulatedCount() == 0)
+    {
+        return;
+    }
+
+    int *rejPtr = preventRejections ? NULL : &rejected;
+
+    if (streaming && !rejectionPass)
+    {
+        if (!refl->streamMerge(&intensity, &countingSigma, &sigma, rejPtr, friedel))
         {
-            incrementRejectedReflections();
+            needsRejection[reflNum] = true;
+            return;
         }
+    }
+    else if (!mergeMedian)
+    {
+        refl->liteMerge(&intensity, &countingSigma, &sigma, rejPtr, friedel);
+    }
+    else
+    {
+        refl->medianMerge(&intensity, &countingSigma, rejPtr, friedel);
+    }
 
-        // this should exist. we made it earlier.
-        MillerPtr miller = refl->miller(0);
+    float intFloat = (float)intensity;
 
-        miller->setRawIntensity(intensity);
-        miller->setCountingSigma(countingSigma);
-        miller->setSigma(sigma);
-        miller->setPartiality(1);
+    if (!std::isfinite(intFloat))
+    {
+        return;
+    }
 
-        refl->clearLiteMillers();
+    // this could be better coded
+    for (int r = 0; r < rejected; r++)
+    {
+        incrementRejectedReflections();
     }
+
+    // this should exist. we made it earlier.
+    MillerPtr miller = refl->miller(0);
+
+    miller->setRawIntensity(intensity);
+    miller->setCountingSigma(countingSigma);
+    miller->setSigma(sigma);
+    miller->setPartiality(1);
+
+    refl->clearLiteMillers();
+    refl->clearAccumulators();
+}
+
+void MtzMerger::mergeMillersWrapper(void *object, int reflNum)
+{
+    static_cast<MtzMerger *>(object)->mergeMillersForReflection(reflNum);
 }
 
-void MtzMerger::mergeMillersThreadWrapper(MtzMerger *object, int offset)
+void MtzMerger::mergeWindowReflectionWrapper(void *object, int offset)
 {
-    object->mergeMillersThread(offset);
+    MtzMerger *me = static_cast<MtzMerger *>(object);
+    me->mergeMillersForReflection(me->windowStart + offset);
+}
+
+void MtzMerger::mergeWindow(int start, int end)
+{
+    windowStart = start;
+    int grain = ThreadPool::grainForCount(end - start);
 
+    ThreadPool::getPool()->parallelFor(mergeWindowReflectionWrapper, this, end - start, grain);
+}
+
+void MtzMerger::mergeWindowWrapper(void *object, int start, int end)
+{
+    static_cast<MtzMerger *>(object)->mergeWindow(start, end);
 }
 
 void MtzMerger::mergeMillers()
 {
-    boost::thread_group threads;
-    int maxThreads = FileParser::getMaxThreads();
+    mergeMedian = FileParser::getKey("MERGE_MEDIAN", false);
+
+    int count = mergedMtz->reflectionCount();
+    int grain = ThreadPool::grainForCount(count);
 
-    for (int i = 0; i < maxThreads; i++)
+    if (shards)
     {
-        boost::thread *thr = new boost::thread(mergeMillersThreadWrapper, this, i);
-        threads.add_thread(thr);
+        int windowSize = FileParser::getKey("MERGE_SPILL_WINDOW", 65536);
+        bool joined = shards->join(mergedMtz, windowSize, mergeWindowWrapper, this);
+        shards = MergeShardsPtr();
+
+        if (!joined)
+        {
+            logged << "Could not read back every merge shard from " << shardDirectory
+            << ", so the merge would be missing observations. Stopping." << std::endl;
+            sendLogAndExit();
+        }
+
+        return;
     }
 
-    threads.join_all();
+    if (streaming)
+    {
+        needsRejection.assign(count, false);
+    }
+
+    ThreadPool::getPool()->parallelFor(mergeMillersWrapper, this, count, grain);
+
+    if (!streaming)
+    {
+        return;
+    }
+
+    int rejectionCount = 0;
+
+    for (int i = 0; i < needsRejection.size(); i++)
+    {
+        rejectionCount += needsRejection[i];
+    }
+
+    if (rejectionCount > 0)
+    {
+        logged << "Gathering observations again for " << rejectionCount
+        << " reflections with possible outliers." << std::endl;
+        sendLog(LogLevelDetailed);
+
+        rejectionPass = true;
+        collectObservations();
+        ThreadPool::getPool()->parallelFor(mergeMillersWrapper, this, count, grain);
+        rejectionPass = false;
+    }
+
+    std::vector<char>().swap(needsRejection);
 }
 
 // MARK: remove reflections.
@@ -809,6 +1009,12 @@ int MtzMerger::totalObservations()
     for (int i = 0; i < mergedMtz->reflectionCount(); i++)
     {
         total += mergedMtz->reflection(i)->liteMillerCount();
+        total += mergedMtz->reflection(i)->accumulatedCount();
+    }
+
+    if (shards)
+    {
+        total += shards->observationCount();
     }
 
     return total;
@@ -850,6 +1056,17 @@ MtzMerger::MtzMerger()
     freeOnly = false;
     needToScale = true;
     preventRejections = false;
+    mergeMedian = false;
+    localBuffers = FileParser::getKey("MERGE_LOCAL_BUFFERS", false);
+    batchSize = 1;
+    gatherSize = 1;
+    shardDirectory = FileParser::getKey("MERGE_SPILL_DIRECTORY", std::string(""));
+    shardCrystals = std::max(FileParser::getKey("MERGE_SPILL_CRYSTALS", 1000), 1);
+    windowStart = 0;
+    streaming = (FileParser::getKey("MERGE_STREAMING", false) &&
+                 !FileParser::getKey("MERGE_MEDIAN", false) &&
+                 !shardDirectory.length());
+    rejectionPass = false;
 }
 
 // MARK: Things to call from other classes.
@@ -879,10 +1096,15 @@ void MtzMerger::merge()
 
     int observations = totalObservations();
 
-    if (needToScale)
+    if (needToScale && !streaming && !shards)
     {
         createUnmergedMtz();
     }
+    else if (needToScale)
+    {
+        logged << "Not writing unmerged MTZ: observations are not kept in memory." << std::endl;
+        sendLog(LogLevelDetailed);
+    }
 
     mergeMillers();
 
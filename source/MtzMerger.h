@@ -12,6 +12,7 @@
 #include <stdio.h>
 #include "parameters.h"
 #include "LoggableObject.h"
+#include "Reflection.h"
 #include <mutex>
 
 typedef enum
@@ -48,6 +49,40 @@ private:
     bool freeOnly;
     bool needToScale;
     bool preventRejections;
+    bool mergeMedian;
+    bool localBuffers;
+
+    /* In MERGE_LOCAL_BUFFERS mode, each batch of crystals collects its
+     * observations here instead of adding them to the shared reflections,
+     * tagged with the position of the merged reflection and kept in one
+     * list per range of gatherSize reflections. Each range is then gathered
+     * by one thread, batch by batch, so observations reach each reflection
+     * in crystal order without any locking. */
+    typedef std::vector<std::vector<BufferedMiller> > BatchBuffer;
+
+    std::vector<BatchBuffer> batchBuffers;
+    int batchSize;
+    int gatherSize;
+
+    /* In MERGE_STREAMING mode, observations are folded into running totals
+     * on each reflection instead of being kept. Reflections which might
+     * have outliers to reject are marked in needsRejection, and only their
+     * observations are gathered again in a second pass over the crystals,
+     * from the crystals accepted on the first pass (mtzAccepted), since
+     * scaling may since have changed what isMtzAccepted() would say. */
+    bool streaming;
+    bool rejectionPass;
+    std::vector<char> needsRejection;
+    std::vector<char> mtzAccepted;
+
+    /* With MERGE_SPILL_DIRECTORY set, groups of shardCrystals crystals are
+     * written to on-disk shards instead, which are joined a window of
+     * reflections at a time when merging. */
+    std::string shardDirectory;
+    int shardCrystals;
+    MergeShardsPtr shards;
+    std::vector<char> shardFailed;
+    int windowStart;
 
     void splitAllMtzs(std::vector<MtzPtr> &firstHalfMtzs, std::vector<MtzPtr> &secondHalfMtzs);
     MtzRejectionReason isMtzAccepted(MtzPtr mtz);
@@ -56,21 +91,31 @@ private:
     bool mtzIsPruned(MtzPtr mtz);
     void summary();
     void writeParameterCSV();
-    void groupMillerThread(int offset);
+    void groupMillersForMtz(int mtzNum, BatchBuffer *buffer = NULL);
     void groupMillers();
-    void addMtzMillers(MtzPtr mtz);
+    void collectObservations();
+    void writeShard(int shardNum);
+    static void writeShardWrapper(void *object, int shardNum);
+    void mergeWindow(int start, int end);
+    static void mergeWindowWrapper(void *object, int start, int end);
+    static void mergeWindowReflectionWrapper(void *object, int offset);
+    void addMtzMillers(MtzPtr mtz, BatchBuffer *buffer = NULL);
+    void groupMillersForBatch(int batchNum);
+    void gatherMillersForRange(int rangeNum);
+    static void groupMillersForBatchWrapper(void *object, int batchNum);
+    static void gatherMillersForRangeWrapper(void *object, int rangeNum);
     void makeEmptyReflectionShells(MtzPtr whichMtz);
     double maxResolution();
-    static void groupMillerThreadWrapper(MtzMerger *object, int offset);
+    static void groupMillersWrapper(void *object, int mtzNum);
     std::string makeFilename(std::string prefix);
 
     void scaleIndividual(MtzPtr mtz);
     void fixSigmas();
     void removeReflections();
-    void mergeMillersThread(int offset);
+    void mergeMillersForReflection(int reflNum);
     void mergeMillers();
     int totalObservations();
-    static void mergeMillersThreadWrapper(MtzMerger *object, int offset);
+    static void mergeMillersWrapper(void *object, int reflNum);
     static void writeAnomalousMtz(MtzPtr negative, MtzPtr positive, MtzPtr mean, std::string filename);
     void createAnomalousDiffMtz(MtzPtr negative, MtzPtr positive);
     void createUnmergedMtz();
@@ -30,6 +30,9 @@
 #include "Detector.h"
 #include "GeometryParser.h"
 #include "GeometryRefiner.h"
+#include "ThreadPool.h"
+#include "ImagePipeline.h"
+#include "IndexingSolution.h"
 
 int MtzRefiner::imageLimit;
 int MtzRefiner::cycleNum;
@@ -39,6 +42,8 @@ MtzRefiner::MtzRefiner()
     // TODO Auto-generated constructor stub
     int logInt = FileParser::getKey("VERBOSITY_LEVEL", 0);
     Logger::mainLogger->changePriorityLevel((LogLevel)logInt);
+    int guaranteedInt = FileParser::getKey("LOG_GUARANTEED_LEVEL", (int)LogLevelDebug);
+    Logger::mainLogger->changeGuaranteedLevel((LogLevel)guaranteedInt);
 
     imageLimit = FileParser::getKey("IMAGE_LIMIT", 0);
 
@@ -51,52 +56,43 @@ MtzRefiner::MtzRefiner()
 
 // MARK: Refinement
 
-void MtzRefiner::cycleThreadWrapper(MtzRefiner *object, int offset)
+void MtzRefiner::cycleImageWrapper(void *object, int imageNum)
 {
-    object->cycleThread(offset);
+    static_cast<MtzRefiner *>(object)->cycleImage(imageNum);
 }
 
-void MtzRefiner::cycleThread(int offset)
+void MtzRefiner::cycleImage(int imageNum)
 {
-    int img_num = (int)images.size();
-
     std::vector<int> targets = FileParser::getKey("TARGET_FUNCTIONS", std::vector<int>());
 
-    int maxThreads = FileParser::getMaxThreads();
+    ImagePtr image = images[imageNum];
 
-    for (int i = offset; i < img_num; i += maxThreads)
+    for (int j = 0; j < image->mtzCount(); j++)
     {
-        std::ostringstream logged;
+        MtzPtr mtz = image->mtz(j);
 
-                ImagePtr image = images[i];
-
-                for (int j = 0; j < image->mtzCount(); j++)
-                {
-                        MtzPtr mtz = image->mtz(j);
-
-                        if (!mtz->isRejected())
-                        {
-                                bool silent = (targets.size() > 0);
+        if (!mtz->isRejected())
+        {
+            bool silent = (targets.size() > 0);
 
-                                mtz->refinePartialities();
+            mtz->refinePartialities();
 
-                                if (targets.size() > 0)
-                                {
-                                        ScoreType firstScore = mtz->getScoreType();
-                                        for (int i = 0; i < targets.size(); i++)
-                                        {
-                                                silent = (i < targets.size() - 1);
-                                                mtz->setDefaultScoreType((ScoreType)targets[i]);
+            if (targets.size() > 0)
+            {
+                ScoreType firstScore = mtz->getScoreType();
+                for (int i = 0; i < targets.size(); i++)
+                {
+                    silent = (i < targets.size() - 1);
+                    mtz->setDefaultScoreType((ScoreType)targets[i]);
 
-                                                mtz->refinePartialities();
-                                        }
+                    mtz->refinePartialities();
+                }
 
-                                        mtz->setDefaultScoreType(firstScore);
-                                }
+                mtz->setDefaultScoreType(firstScore);
+            }
 
-                                mtz->setRefineOrientations(false);
-                        }
-                }
+            mtz->setRefineOrientations(false);
+        }
     }
 }
 
@@ -107,21 +103,11 @@ void MtzRefiner::cycle()
     time_t startcputime;
     time(&startcputime);
 
-    boost::thread_group threads;
-
-    int maxThreads = FileParser::getMaxThreads();
-
     std::ostringstream logged;
     logged << "Filename\tScore type\t\tCorrel\tRfactor\tPart correl\tHits" << std::endl;
     Logger::mainLogger->addStream(&logged);
 
-    for (int i = 0; i < maxThreads; i++)
-    {
-        boost::thread *thr = new boost::thread(cycleThreadWrapper, this, i);
-        threads.add_thread(thr);
-    }
-
-    threads.join_all();
+    ThreadPool::getPool()->parallelFor(cycleImageWrapper, this, (int)images.size());
 
     time_t endcputime;
     time(&endcputime);
@@ -1032,30 +1018,19 @@ void MtzRefiner::merge(int cycle)
 
 // MARK: Integrating images
 
-void MtzRefiner::integrateImagesWrapper(MtzRefiner *object,
-                                        vector<MtzPtr> *&mtzSubset, int offset)
+void MtzRefiner::integrateImageWrapper(void *object, int imageNum)
 {
-    object->integrateImages(mtzSubset, offset);
+    static_cast<MtzRefiner *>(object)->integrateImage(imageNum);
 }
 
-void MtzRefiner::integrateImages(vector<MtzPtr> *&mtzSubset,
-                                 int offset)
+void MtzRefiner::integrateImage(int imageNum)
 {
-    int maxThreads = FileParser::getMaxThreads();
-
-    for (int i = offset; i < images.size(); i += maxThreads)
-    {
-        std::ostringstream logged;
-        logged << "Integrating image " << i << std::endl;
-        Logger::mainLogger->addStream(&logged);
-
-        images[i]->refineOrientations();
-
-        vector<MtzPtr> mtzs = images[i]->currentMtzs();
+    std::ostringstream logged;
+    logged << "Integrating image " << imageNum << std::endl;
+    Logger::mainLogger->addStream(&logged);
 
-        mtzSubset->insert(mtzSubset->end(), mtzs.begin(), mtzs.end());
-        images[i]->dropImage();
-    }
+    images[imageNum]->refineOrientations();
+    images[imageNum]->dropImage();
 }
 
 void MtzRefiner::maximumImageThread(MtzRefiner *me, ImagePtr maxImage, int offset)
@@ -1137,20 +1112,7 @@ void MtzRefiner::integrate()
     logged << images.size() << " images with " << crystals << " crystal orientations." << std::endl;
     sendLog();
 
-    int maxThreads = FileParser::getMaxThreads();
-
-    boost::thread_group threads;
-    vector<vector<MtzPtr> > managerSubsets;
-    managerSubsets.resize(maxThreads);
-
-    for (int i = 0; i < maxThreads; i++)
-    {
-        boost::thread *thr = new boost::thread(integrateImagesWrapper, this,
-                                               &managerSubsets[i], i);
-        threads.add_thread(thr);
-    }
-
-    threads.join_all();
+    ThreadPool::getPool()->parallelFor(integrateImageWrapper, this, (int)images.size());
 
     writeNewOrientations(false, true);
 
@@ -1397,15 +1359,12 @@ void MtzRefiner::writeNewOrientations(bool includeRots, bool detailed)
     writeAllNewOrientations();
 }
 
-void MtzRefiner::findSpotsThread(MtzRefiner *me, int offset)
+void MtzRefiner::findSpotsWrapper(void *object, int imageNum)
 {
-    double maxThreads = FileParser::getMaxThreads();
+    MtzRefiner *me = static_cast<MtzRefiner *>(object);
 
-    for (int i = offset; i < me->images.size(); i += maxThreads)
-    {
-        me->images[i]->processSpotList();
-        me->images[i]->dropImage();
-    }
+    me->images[imageNum]->processSpotList();
+    me->images[imageNum]->dropImage();
 }
 
 void MtzRefiner::index()
@@ -1415,6 +1374,21 @@ void MtzRefiner::index()
     logged << "N: Total images loaded: " << images.size() << std::endl;
     sendLog();
 
+    bool streaming = FileParser::getKey("STREAMING_PIPELINE", false);
+
+    if (streaming)
+    {
+        int queueSize = FileParser::getKey("PIPELINE_QUEUE_SIZE", 4);
+        IndexingSolution::setupStandardVectors();
+
+        ImagePipeline pipeline(images, queueSize, FileParser::getMaxThreads());
+        pipeline.run();
+
+        writeNewOrientations(false, true);
+        integrationSummary();
+        return;
+    }
+
     if (!indexManager)
         indexManager = new IndexManager(images);
 
@@ -1433,16 +1407,7 @@ void MtzRefiner::powderPattern()
     if (!indexManager)
         indexManager = new IndexManager(images);
 
-    double maxThreads = FileParser::getMaxThreads();
-    boost::thread_group threads;
-
-    for (int i = 0; i < maxThreads; i++)
-    {
-        boost::thread *thr = new boost::thread(findSpotsThread, this, i);
-        threads.add_thread(thr);
-    }
-
-    threads.join_all();
+    ThreadPool::getPool()->parallelFor(findSpotsWrapper, this, (int)images.size());
 
     indexManager->powderPattern();
 }
@@ -1450,14 +1415,9 @@ void MtzRefiner::powderPattern()
 // MARK: SACLA stuff for April 2016
 
 
-void MtzRefiner::integrateSpotsThread(MtzRefiner *me, int offset)
+void MtzRefiner::integrateSpotsWrapper(void *object, int imageNum)
 {
-    double maxThreads = FileParser::getMaxThreads();
-
-    for (int i = offset; i < me->images.size(); i += maxThreads)
-    {
-        me->images[i]->integrateSpots();
-    }
+    static_cast<MtzRefiner *>(object)->images[imageNum]->integrateSpots();
 }
 
 void MtzRefiner::integrateSpots()
@@ -1465,17 +1425,7 @@ void MtzRefiner::integrateSpots()
     loadPanels();
     this->readMatricesAndImages();
     std::cout << "N: Total images loaded: " << images.size() << std::endl;
-    double maxThreads = FileParser::getMaxThreads();
-
-    boost::thread_group threads;
-
-    for (int i = 0; i < maxThreads; i++)
-    {
-        boost::thread *thr = new boost::thread(integrateSpotsThread, this, i);
-        threads.add_thread(thr);
-    }
-
-    threads.join_all();
+    ThreadPool::getPool()->parallelFor(integrateSpotsWrapper, this, (int)images.size());
 
     std::cout << "Finished integrating spots." << std::endl;
 }
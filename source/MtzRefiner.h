@@ -26,7 +26,7 @@ private:
     static int imageLimit;
     static int imageMax(size_t lineCount);
     static void readSingleImageV2(std::string *filename, vector<ImagePtr> *newImages, vector<MtzPtr> *newMtzs, int offset, bool v3 = false, MtzRefiner *me = NULL);
-    static void findSpotsThread(MtzRefiner *me, int offset);
+    static void findSpotsWrapper(void *object, int imageNum);
     void readFromHdf5(std::vector<ImagePtr> *newImages);
     bool readRefinedMtzs;
         std::vector<MtzPtr> getAllMtzs();
@@ -37,7 +37,7 @@ private:
     bool isPython;
     static int imageSkip(size_t totalCount);
     static void radialAverageThread(MtzRefiner *me, int offset);
-    static void integrateSpotsThread(MtzRefiner *me, int offset);
+    static void integrateSpotsWrapper(void *object, int imageNum);
     Hdf5ManagerProcessingPtr hdf5ProcessingPtr;
     void readDataFromOrientationMatrixList(std::string *filename, bool areImages, std::vector<ImagePtr> *targetImages);
         void redumpBins();
@@ -52,8 +52,8 @@ public:
         bool loadInitialMtz(bool force = false);
 
         void cycle();
-        void cycleThread(int offset);
-        static void cycleThreadWrapper(MtzRefiner *object, int offset);
+        void cycleImage(int imageNum);
+        static void cycleImageWrapper(void *object, int imageNum);
 
     void refine();
         void refineCycle(bool once = false);
@@ -75,8 +75,8 @@ public:
     static void fakeSpotsThread(std::vector<ImagePtr> *images, int offset);
     void fakeSpots();
     void integrationSummary();
-        static void integrateImagesWrapper(MtzRefiner *object, vector<MtzPtr> *&mtzSubset, int offset);
-        void integrateImages(vector<MtzPtr> *&mtzSubset, int offset);
+        static void integrateImageWrapper(void *object, int imageNum);
+        void integrateImage(int imageNum);
         void readMatricesAndImages(std::string *filename = NULL, bool areImages = true, std::vector<ImagePtr> *targetImages = NULL);
         void refineUnitCell();
 
@@ -0,0 +1,149 @@
+//
+//  ObjectPool.cpp
+//   cppxfel - a collection of processing algorithms for XFEL diffraction data.
+
+//    Copyright (C) 2017  Helen Ginn
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+
+#include "ObjectPool.h"
+#include <stdlib.h>
+#include <new>
+
+// every block is aligned for any type which might be placed in it
+#define OBJECT_POOL_ALIGNMENT 16
+
+ObjectPool::ObjectPool()
+{
+    liveBlocks = 0;
+    owned = true;
+}
+
+ObjectPoolPtr ObjectPool::create()
+{
+    return ObjectPoolPtr(new ObjectPool(), ownersReleased);
+}
+
+void ObjectPool::ownersReleased(ObjectPool *pool)
+{
+    bool unused = false;
+
+    {
+        std::lock_guard<std::mutex> lock(pool->poolMutex);
+        pool->owned = false;
+        unused = (pool->liveBlocks == 0);
+    }
+
+    if (unused)
+    {
+        delete pool;
+    }
+}
+
+ObjectPool::~ObjectPool()
+{
+    for (int i = 0; i < slabs.size(); i++)
+    {
+        free(slabs[i]);
+    }
+}
+
+ObjectPool::BlockSize *ObjectPool::blockSize(size_t bytes)
+{
+    for (int i = 0; i < sizes.size(); i++)
+    {
+        if (sizes[i].bytes == bytes)
+        {
+            return &sizes[i];
+        }
+    }
+
+    BlockSize size;
+    size.bytes = bytes;
+    size.nextSlabBlocks = OBJECT_POOL_FIRST_SLAB_BLOCKS;
+    size.freeBlocks = NULL;
+    sizes.push_back(size);
+
+    return &sizes.back();
+}
+
+void ObjectPool::addSlab(BlockSize *size)
+{
+    int blocks = size->nextSlabBlocks;
+    char *slab = (char *)malloc(blocks * size->bytes);
+
+    if (slab == NULL)
+    {
+        throw std::bad_alloc();
+    }
+
+    slabs.push_back(slab);
+
+    // thread the new blocks onto the free list, first block first
+    for (int i = blocks - 1; i >= 0; i--)
+    {
+        void *block = slab + i * size->bytes;
+        *(void **)block = size->freeBlocks;
+        size->freeBlocks = block;
+    }
+
+    if (size->nextSlabBlocks < OBJECT_POOL_MAX_SLAB_BLOCKS)
+    {
+        size->nextSlabBlocks *= 2;
+    }
+}
+
+void *ObjectPool::allocate(size_t bytes)
+{
+    bytes = (bytes + OBJECT_POOL_ALIGNMENT - 1) / OBJECT_POOL_ALIGNMENT * OBJECT_POOL_ALIGNMENT;
+
+    std::lock_guard<std::mutex> lock(poolMutex);
+
+    BlockSize *size = blockSize(bytes);
+
+    if (size->freeBlocks == NULL)
+    {
+        addSlab(size);
+    }
+
+    void *block = size->freeBlocks;
+    size->freeBlocks = *(void **)block;
+    liveBlocks++;
+
+    return block;
+}
+
+void ObjectPool::release(void *block, size_t bytes)
+{
+    bytes = (bytes + OBJECT_POOL_ALIGNMENT - 1) / OBJECT_POOL_ALIGNMENT * OBJECT_POOL_ALIGNMENT;
+
+    bool unused = false;
+
+    {
+        std::lock_guard<std::mutex> lock(poolMutex);
+
+        BlockSize *size = blockSize(bytes);
+        *(void **)block = size->freeBlocks;
+        size->freeBlocks = block;
+        liveBlocks--;
+        unused = (!owned && liveBlocks == 0);
+    }
+
+    if (unused)
+    {
+        delete this;
+    }
+}
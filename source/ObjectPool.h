@@ -0,0 +1,134 @@
+//
+//  ObjectPool.h
+//   cppxfel - a collection of processing algorithms for XFEL diffraction data.
+
+//    Copyright (C) 2017  Helen Ginn
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+
+#ifndef __cppxfel__ObjectPool__
+#define __cppxfel__ObjectPool__
+
+#include <stdio.h>
+#include <vector>
+#include <mutex>
+#include <boost/make_shared.hpp>
+#include "parameters.h"
+
+// blocks in the first slab for each block size; later slabs double up to
+// OBJECT_POOL_MAX_SLAB_BLOCKS.
+#define OBJECT_POOL_FIRST_SLAB_BLOCKS 64
+#define OBJECT_POOL_MAX_SLAB_BLOCKS 8192
+
+/* Hands out fixed-size blocks for the many small objects belonging to one
+ * crystal (Millers, Reflections, Shoeboxes and their shared_ptr counts).
+ * Blocks are carved out of large slabs and kept on a free list for each
+ * block size once released, so a crystal which is built up and thrown away
+ * repeatedly reuses the same memory and does not go to the system allocator
+ * (and its locks) for every object. Slabs are only returned when the pool
+ * itself goes, which is once the last ObjectPoolPtr (from create()) has been
+ * dropped and the last block has been released, so objects may safely
+ * outlive the crystal they came from. Use through PoolAllocator. */
+
+class ObjectPool
+{
+private:
+    typedef struct
+    {
+        size_t bytes;
+        int nextSlabBlocks;
+        void *freeBlocks;
+    } BlockSize;
+
+    std::vector<BlockSize> sizes;
+    std::vector<char *> slabs;
+    std::mutex poolMutex;
+    size_t liveBlocks;
+    bool owned;
+
+    BlockSize *blockSize(size_t bytes);
+    void addSlab(BlockSize *size);
+    static void ownersReleased(ObjectPool *pool);
+
+    ObjectPool();
+    ~ObjectPool();
+
+public:
+    static ObjectPoolPtr create();
+
+    void *allocate(size_t bytes);
+    void release(void *block, size_t bytes);
+};
+
+/* Standard allocator interface on top of an ObjectPool, for use with
+ * boost::allocate_shared so that an object and its reference count share
+ * one pooled block:
+ *
+ *     MillerPtr miller = boost::allocate_shared<Miller>(PoolAllocator<Miller>(pool), ...);
+ */
+
+template<typename T>
+class PoolAllocator
+{
+public:
+    typedef T value_type;
+
+    // a plain pointer, so that copying the allocator (which allocate_shared
+    // does several times per object) costs nothing; the pool keeps itself
+    // alive while it has blocks out.
+    ObjectPool *pool;
+
+    PoolAllocator(ObjectPoolPtr newPool)
+    {
+        pool = &*newPool;
+    }
+
+    template<typename U>
+    PoolAllocator(const PoolAllocator<U> &other)
+    {
+        pool = other.pool;
+    }
+
+    template<typename U>
+    struct rebind
+    {
+        typedef PoolAllocator<U> other;
+    };
+
+    T *allocate(size_t n)
+    {
+        return static_cast<T *>(pool->allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T *block, size_t n)
+    {
+        pool->release(block, n * sizeof(T));
+    }
+
+    template<typename U>
+    bool operator==(const PoolAllocator<U> &other) const
+    {
+        return pool == other.pool;
+    }
+
+    template<typename U>
+    bool operator!=(const PoolAllocator<U> &other) const
+    {
+        return pool != other.pool;
+    }
+};
+
+#endif /* defined(__cppxfel__ObjectPool__) */
@@ -0,0 +1,647 @@
+//
+//  ObservationStore.cpp
+//   cppxfel - a collection of processing algorithms for XFEL diffraction data.
+
+//    Copyright (C) 2017  Helen Ginn
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "ObservationStore.h"
+#include "MtzManager.h"
+#include "Reflection.h"
+#include "Miller.h"
+#include "FileParser.h"
+#include "StatisticsManager.h"
+#include <float.h>
+
+ObservationStore::ObservationStore()
+{
+    model = PartialityModelScaled;
+    smoothFunction = false;
+}
+
+void ObservationStore::snapshot(MtzManager *mtz, MtzManager *reference)
+{
+    model = Miller::getPartialityModel();
+    smoothFunction = FileParser::getKey("SMOOTH_FUNCTION", false);
+
+    int reflCount = mtz->reflectionCount();
+    int total = 0;
+
+    for (int i = 0; i < reflCount; i++)
+    {
+        total += mtz->reflection(i)->millerCount();
+    }
+
+    hs.resize(total); ks.resize(total); ls.resize(total);
+    rawIntensities.resize(total);
+    sigmas.resize(total);
+    partialities.resize(total);
+    wavelengths.resize(total);
+    resolutions.resize(total);
+    scales.resize(total);
+    partialCutoffs.resize(total);
+    bFactorScales.resize(total);
+    flags.resize(total);
+
+    reflOffsets.resize(reflCount + 1);
+    reflResolutions.resize(reflCount);
+    refFound.resize(reflCount);
+    refIntensities.resize(reflCount);
+    refPartialities.resize(reflCount);
+    refResolutions.resize(reflCount);
+
+    int obs = 0;
+
+    for (int i = 0; i < reflCount; i++)
+    {
+        ReflectionPtr refl = mtz->reflection(i);
+        reflOffsets[i] = obs;
+        reflResolutions[i] = refl->getResolution();
+
+        ReflectionPtr refRefl;
+
+        if (reference != NULL)
+        {
+            refRefl = reference->findReflectionWithId(refl);
+        }
+
+        refFound[i] = (refRefl && refRefl->millerCount() > 0);
+        refIntensities[i] = refFound[i] ? refRefl->meanIntensity() : nan(" ");
+        refPartialities[i] = refFound[i] ? refRefl->meanPartiality() : nan(" ");
+        refResolutions[i] = refFound[i] ? refRefl->getResolution() : 0;
+
+        for (int j = 0; j < refl->millerCount(); j++)
+        {
+            MillerPtr miller = refl->miller(j);
+            vec hkl = miller->getHKL();
+
+            hs[obs] = hkl.h;
+            ks[obs] = hkl.k;
+            ls[obs] = hkl.l;
+            rawIntensities[obs] = miller->getRawestIntensity();
+            sigmas[obs] = miller->getSigma();
+            partialities[obs] = miller->getPartiality();
+            wavelengths[obs] = miller->getWavelength();
+            resolutions[obs] = miller->getResolution();
+            scales[obs] = miller->getScale();
+            partialCutoffs[obs] = miller->getPartialCutoff();
+            bFactorScales[obs] = miller->getBFactorScale();
+            flags[obs] = ((miller->isFree() ? ObservationFlagFree : 0) |
+                          (miller->isRejected() ? ObservationFlagRejected : 0));
+
+            obs++;
+        }
+    }
+
+    reflOffsets[reflCount] = obs;
+}
+
+void ObservationStore::readPartialities(MtzManager *mtz)
+{
+    int obs = 0;
+
+    for (int i = 0; i < mtz->reflectionCount(); i++)
+    {
+        ReflectionPtr refl = mtz->reflection(i);
+
+        for (int j = 0; j < refl->millerCount(); j++)
+        {
+            MillerPtr miller = refl->miller(j);
+            partialities[obs] = miller->getPartiality();
+            wavelengths[obs] = miller->getWavelength();
+            obs++;
+        }
+    }
+}
+
+void ObservationStore::writeBack(MtzManager *mtz)
+{
+    int obs = 0;
+
+    for (int i = 0; i < mtz->reflectionCount(); i++)
+    {
+        ReflectionPtr refl = mtz->reflection(i);
+
+        for (int j = 0; j < refl->millerCount(); j++)
+        {
+            MillerPtr miller = refl->miller(j);
+            miller->setPartiality(partialities[obs]);
+            miller->setWavelength(wavelengths[obs]);
+            miller->setScale(scales[obs]);
+            obs++;
+        }
+    }
+}
+
+/* Same as Miller::superGaussian when the MtzManager table is set up. */
+
+double ObservationStore::lookupSuperGaussian(BeamShape &beam, double x, double mean)
+{
+    if (x != x || mean != mean)
+        return 0;
+
+    double standardisedX = fabs((x - mean) / beam.sigma);
+
+    if (standardisedX > MAX_SUPER_GAUSSIAN)
+        return 0;
+
+    if (!std::isfinite(standardisedX) || standardisedX != standardisedX)
+        return 0;
+
+    const double step = SUPER_GAUSSIAN_STEP;
+
+    int lookupInt = standardisedX / step;
+    return beam.table[lookupInt];
+}
+
+/* Same as Miller::calculatePartiality (not binary), except that the
+ * integral over the whole beam is only worked out once per call to
+ * calculatePartialities as it does not depend on the reflection. */
+
+double ObservationStore::integrateBeam(BeamShape &beam, double pB, double qB)
+{
+    const int sampling = 10;
+    double limitP = beam.limitP;
+    double pqMin = std::min(pB - beam.mean, qB - beam.mean);
+    double pqMax = std::max(pB - beam.mean, qB - beam.mean);
+
+    if ((pqMin > 0 && pqMax > pqMin && limitP < pqMin) ||
+        (pqMax < 0 && pqMin < pqMax && -limitP > pqMax))
+    {
+        return 0;
+    }
+
+    double pDiff = fabs(qB - pB);
+    double bValue = -limitP + beam.mean;
+    double bIncrement = limitP * 2 / (double)sampling;
+    double squash = 1 / pDiff;
+    double offset = (qB + pB) / 2;
+
+    if (limitP > pDiff / 2)
+    {
+        bValue = std::min(pB, qB);
+        bIncrement = fabs(pDiff) / (double)sampling;
+    }
+
+    double integralAll = 0;
+
+    for (int i = 0; i < sampling; i++)
+    {
+        double pValue = (bValue - offset) * squash;
+        double evalP = std::max(0., 1 - 4 * pValue * pValue);
+        double evalE = lookupSuperGaussian(beam, bValue, beam.mean);
+        double slice = (evalE * evalP) * bIncrement;
+        integralAll += slice;
+
+        bValue += bIncrement;
+    }
+
+    integralAll /= beam.integralBeam;
+
+    return integralAll;
+}
+
+/* Batch version of Miller::recalculatePartiality for the whole crystal.
+ * The first pass only does geometry (rotation, Ewald sphere limits for
+ * the reflection and for its normalisation position) over contiguous
+ * arrays; the second integrates the beam between those limits. The
+ * MtzManager super-gaussian table must already be set up. */
+
+void ObservationStore::calculatePartialities(MatrixPtr rotatedMatrix, double mosaicity,
+                                             double spotSize, double wavelength,
+                                             double bandwidth, double exponent)
+{
+    if (model == PartialityModelFixed)
+        return;
+
+    int count = observationCount();
+
+    limitLows.resize(count);
+    limitHighs.resize(count);
+    normLows.resize(count);
+    normHighs.resize(count);
+
+    const double *c = rotatedMatrix->components;
+    double absSpotSize = fabs(spotSize);
+    double radMos = fabs(mosaicity) * M_PI / 180;
+    double invWavelength = 1 / wavelength;
+
+    for (int i = 0; i < count; i++)
+    {
+        double h = hs[i];
+        double k = ks[i];
+        double l = ls[i];
+
+        double x = c[0] * h + c[4] * k + c[8] * l;
+        double y = c[1] * h + c[5] * k + c[9] * l;
+        double z = c[2] * h + c[6] * k + c[10] * l;
+
+        double dStarSq = x * x + y * y + z * z;
+        double dStar = pow(dStarSq, 0.5);
+
+        double rlpRadius = dStarSq / (0 - 2 * z);
+        wavelengths[i] = (z == 0) ? 0 : 1 / rlpRadius;
+
+        // limiting wavelengths for the reflection itself
+        double radius = (absSpotSize + fabs(radMos * dStar));
+        double centredL = z - (0 - invWavelength);
+        double length = pow(x * x + y * y + centredL * centredL, 0.5);
+        double radiusOverLength = radius / length;
+        double newL = z + invWavelength;
+
+        double inH = (1 - radiusOverLength) * x;
+        double inK = (1 - radiusOverLength) * y;
+        double inL = z - radiusOverLength * newL;
+        double outH = (1 + radiusOverLength) * x;
+        double outK = (1 + radiusOverLength) * y;
+        double outL = z + radiusOverLength * newL;
+
+        double inRadius = (inH * inH + inK * inK + inL * inL) / (0 - 2 * inL);
+        double outRadius = (outH * outH + outK * outK + outL * outL) / (0 - 2 * outL);
+        limitHighs[i] = (inL == 0) ? 0 : 1 / inRadius;
+        limitLows[i] = (outL == 0) ? 0 : 1 / outRadius;
+
+        // and for the same resolution lying on the Ewald sphere
+        double normK = sqrt((4 * pow(dStar, 2) - pow(dStar, 4) * pow(wavelength, 2)) / 4);
+        double normL = 0 - pow(dStar, 2) * wavelength / 2;
+        double normDStar = pow(normK * normK + normL * normL, 0.5);
+
+        radius = (absSpotSize + fabs(radMos * normDStar));
+        centredL = normL - (0 - invWavelength);
+        length = pow(normK * normK + centredL * centredL, 0.5);
+        radiusOverLength = radius / length;
+        newL = normL + invWavelength;
+
+        inK = (1 - radiusOverLength) * normK;
+        inL = normL - radiusOverLength * newL;
+        outK = (1 + radiusOverLength) * normK;
+        outL = normL + radiusOverLength * newL;
+
+        inRadius = (0 * 0 + inK * inK + inL * inL) / (0 - 2 * inL);
+        outRadius = (0 * 0 + outK * outK + outL * outL) / (0 - 2 * outL);
+        normHighs[i] = (inL == 0) ? 0 : 1 / inRadius;
+        normLows[i] = (outL == 0) ? 0 : 1 / outRadius;
+    }
+
+    BeamShape beam;
+    beam.mean = wavelength;
+    beam.exponent = exponent;
+    beam.sigma = bandwidth * wavelength / 2;
+    beam.table = &MtzManager::superGaussianTable[0];
+
+    double correction_sigma = pow(M_PI, (2 / exponent - 1));
+    const double lnNum = 3.0;
+    double limit = correction_sigma * pow(lnNum, 1 / exponent);
+    beam.limitP = limit * beam.sigma;
+
+    const int sampling = 10;
+    double bValue = -beam.limitP;
+    double bIncrement = beam.limitP * 2 / (double)sampling;
+    beam.integralBeam = 0;
+
+    for (int i = 0; i < sampling; i++)
+    {
+        double evalE = lookupSuperGaussian(beam, bValue, 0);
+        beam.integralBeam += evalE * bIncrement;
+
+        bValue += bIncrement;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        double integral = integrateBeam(beam, limitLows[i], limitHighs[i]);
+        partialities[i] = integral;
+
+        if (integral > 0)
+        {
+            partialities[i] /= integrateBeam(beam, normLows[i], normHighs[i]);
+        }
+    }
+}
+
+void ObservationStore::setScale(double scale)
+{
+    if (scale != scale)
+        return;
+
+    for (int i = 0; i < observationCount(); i++)
+    {
+        scales[i] = scale;
+    }
+}
+
+void ObservationStore::applyScaleFactor(double scaleFactor)
+{
+    for (int i = 0; i < observationCount(); i++)
+    {
+        double newScale = scales[i] * scaleFactor;
+
+        if (newScale == newScale)
+            scales[i] = newScale;
+    }
+}
+
+void ObservationStore::setBFactor(double bFactor)
+{
+    if (bFactor != bFactor)
+        return;
+
+    calculateBFactorScales(bFactor);
+}
+
+void ObservationStore::calculateBFactorScales(double bFactor)
+{
+    float bFloat = bFactor;
+
+    for (int i = 0; i < observationCount(); i++)
+    {
+        if (bFloat == 0)
+        {
+            bFactorScales[i] = 1;
+            continue;
+        }
+
+        double resn = resolutions[i];
+        double four_d_squared = 4 * pow(1 / resn, 2);
+
+        bFactorScales[i] = exp(-2 * bFloat * 1 / four_d_squared);
+    }
+}
+
+int ObservationStore::acceptedCount(int refl)
+{
+    int count = 0;
+
+    for (int i = reflOffsets[refl]; i < reflOffsets[refl + 1]; i++)
+    {
+        if (accepted(i))
+            count++;
+    }
+
+    return count;
+}
+
+double ObservationStore::meanPartiality(int refl)
+{
+    double total = 0;
+    int count = 0;
+
+    for (int i = reflOffsets[refl]; i < reflOffsets[refl + 1]; i++)
+    {
+        if (accepted(i))
+        {
+            total += partialities[i];
+            count++;
+        }
+    }
+
+    total /= count;
+
+    return total;
+}
+
+double ObservationStore::meanIntensity(int refl)
+{
+    double totalIntensity = 0;
+    double totalWeights = 0;
+
+    for (int i = reflOffsets[refl]; i < reflOffsets[refl + 1]; i++)
+    {
+        if (!accepted(i))
+            continue;
+
+        double weight = this->weight(i);
+        double intensity = this->intensity(i);
+
+        if (weight <= 0)
+            continue;
+
+        totalIntensity += intensity * weight;
+        totalWeights += weight;
+    }
+
+    totalIntensity /= totalWeights;
+
+    return totalIntensity;
+}
+
+/* Same as MtzManager::scaleToMtz against the snapshot reference. Returns
+ * the gradient applied to the observations, or NaN if nothing changed. */
+
+double ObservationStore::scaleToReference()
+{
+    double x_squared = 0;
+    double x_y = 0;
+    int num = 0;
+
+    for (int r = 0; r < reflectionCount(); r++)
+    {
+        if (!refFound[r] || acceptedCount(r) == 0)
+            continue;
+
+        num++;
+
+        for (int i = reflOffsets[r]; i < reflOffsets[r + 1]; i++)
+        {
+            if (isFree(i) || !accepted(i))
+                continue;
+
+            double int1 = intensity(i);
+            double int2 = refIntensities[r];
+            double weight = partialities[i];
+
+            if ((int1 != int1) || (int2 != int2) || (weight != weight))
+                continue;
+
+            x_squared += int1 * int2 * weight;
+            x_y += int2 * int2 * weight;
+        }
+    }
+
+    if (num <= 1)
+        return nan(" ");
+
+    double grad = (x_y / x_squared);
+
+    if (grad < 0)
+        grad = -1;
+
+    applyScaleFactor(grad);
+
+    return grad;
+}
+
+double ObservationStore::rSplit(double low, double high)
+{
+    double minD = 0;
+    double maxD = 0;
+    StatisticsManager::convertResolutions(low, high, &minD, &maxD);
+
+    double sum_numerator = 0;
+    double sum_denominator = 0;
+
+    for (int r = 0; r < reflectionCount(); r++)
+    {
+        if (!refFound[r] || acceptedCount(r) == 0)
+            continue;
+
+        int start = reflOffsets[r];
+
+        if (start == reflOffsets[r + 1] || isFree(start))
+            continue;
+
+        if (refResolutions[r] > maxD || refResolutions[r] < minD)
+            continue;
+
+        double weight = meanPartiality(r);
+
+        for (int i = start; i < reflOffsets[r + 1]; i++)
+        {
+            if (!accepted(i))
+                continue;
+
+            double int1 = 0;
+            double int2 = 0;
+
+            if (!smoothFunction)
+            {
+                int1 = intensity(i);
+                int2 = refIntensities[r];
+            }
+            else
+            {
+                int1 = rawIntensities[i] * scales[i];
+                int2 = refIntensities[r] * partialities[i];
+            }
+
+            if (int1 == 0 || weight == 0 || weight != weight)
+                continue;
+
+            if (int1 != int1 || int2 != int2)
+                continue;
+
+            if (int1 + int2 < 0)
+                continue;
+
+            sum_numerator += fabs(int1 - int2) * weight;
+            sum_denominator += (int1 + int2) * weight / 2;
+        }
+    }
+
+    return sum_numerator / (sum_denominator * sqrt(2));
+}
+
+/* Same as StatisticsManager::cc_pearson against the snapshot reference. */
+
+double ObservationStore::correlation(double low, double high)
+{
+    double invHigh = (high == 0) ? FLT_MAX : 1 / high;
+    double invLow = (low == 0) ? 0 : 1 / low;
+
+    std::vector<int> common;
+    std::vector<double> means;
+    std::vector<double> weights;
+
+    for (int r = 0; r < reflectionCount(); r++)
+    {
+        if (!refFound[r] || acceptedCount(r) == 0)
+            continue;
+
+        common.push_back(r);
+    }
+
+    if (common.size() <= 2)
+        return -1;
+
+    means.resize(common.size());
+    weights.resize(common.size());
+
+    double sum_x = 0;
+    double sum_y = 0;
+    double weight_counted = 0;
+
+    for (int n = 0; n < common.size(); n++)
+    {
+        int r = common[n];
+        means[n] = nan(" ");
+
+        if (!(reflResolutions[r] > invLow && reflResolutions[r] < invHigh))
+            continue;
+
+        double weight = meanPartiality(r) * refPartialities[r];
+        weights[n] = weight;
+
+        if (weight < 0)
+            continue;
+
+        double mean1 = meanIntensity(r);
+        double mean2 = refIntensities[r];
+        means[n] = mean1;
+
+        if (mean1 != mean1 || mean2 != mean2 || weight != weight)
+            continue;
+
+        sum_x += mean1 * weight;
+        sum_y += mean2 * weight;
+        weight_counted += weight;
+    }
+
+    double mean_x = sum_x / weight_counted;
+    double mean_y = sum_y / weight_counted;
+
+    double sum_x_y_minus_mean_x_y = 0;
+    double sum_x_minus_mean_x_sq = 0;
+    double sum_y_minus_mean_y_sq = 0;
+
+    for (int n = 0; n < common.size(); n++)
+    {
+        int r = common[n];
+
+        if (!(reflResolutions[r] > invLow && reflResolutions[r] < invHigh))
+            continue;
+
+        double amp_x = means[n];
+        double amp_y = refIntensities[r];
+        double weight = weights[n];
+
+        if (weight < 0)
+            continue;
+
+        if (amp_x != amp_x || amp_y != amp_y)
+            continue;
+
+        if (weight != weight)
+            continue;
+
+        sum_x_y_minus_mean_x_y += weight * (amp_x - mean_x) * (amp_y - mean_y);
+        sum_x_minus_mean_x_sq += weight * pow(amp_x - mean_x, 2);
+        sum_y_minus_mean_y_sq += weight * pow(amp_y - mean_y, 2);
+    }
+
+    sum_x_y_minus_mean_x_y /= weight_counted;
+    sum_x_minus_mean_x_sq /= weight_counted;
+    sum_y_minus_mean_y_sq /= weight_counted;
+
+    double r = sum_x_y_minus_mean_x_y
+    / (sqrt(sum_x_minus_mean_x_sq * sum_y_minus_mean_y_sq));
+
+    if (r < 0)
+        r = 0;
+    if (r != r)
+        r = -1;
+
+    return r;
+}
@@ -0,0 +1,189 @@
+//
+//  ObservationStore.h
+//   cppxfel - a collection of processing algorithms for XFEL diffraction data.
+
+//    Copyright (C) 2017  Helen Ginn
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifndef __cppxfel__ObservationStore__
+#define __cppxfel__ObservationStore__
+
+#include <stdio.h>
+#include <cmath>
+#include "parameters.h"
+
+/* Flat snapshot of one crystal's Miller observations, taken at the start of
+ * post-refinement for a given ambiguity. Observations are grouped by
+ * reflection in the same order as MtzManager's reflection list, and the
+ * matching reference intensities are looked up once when the snapshot is
+ * made. Target functions (R split and correlation) read these arrays rather
+ * than walking Reflection and Miller objects; the partiality, wavelength and
+ * scale are written back to the Millers once refinement has finished.
+ * calculatePartialities() repeats Miller::recalculatePartiality for every
+ * observation at once, in the same order of operations. */
+
+typedef enum
+{
+    ObservationFlagFree = 1 << 0,
+    ObservationFlagRejected = 1 << 1,
+} ObservationFlag;
+
+class ObservationStore
+{
+private:
+    PartialityModel model;
+    bool smoothFunction;
+
+    // per observation
+    std::vector<short> hs;
+    std::vector<short> ks;
+    std::vector<short> ls;
+    std::vector<float> rawIntensities;
+    std::vector<float> sigmas;
+    std::vector<double> partialities;
+    std::vector<double> wavelengths;
+    std::vector<float> resolutions;
+    std::vector<double> scales;
+    std::vector<float> partialCutoffs;
+    std::vector<double> bFactorScales;
+    std::vector<unsigned char> flags;
+
+    // per reflection
+    std::vector<int> reflOffsets;
+    std::vector<double> reflResolutions;
+    std::vector<unsigned char> refFound;
+    std::vector<double> refIntensities;
+    std::vector<double> refPartialities;
+    std::vector<double> refResolutions;
+
+    // scratch space for calculatePartialities
+    std::vector<double> limitLows;
+    std::vector<double> limitHighs;
+    std::vector<double> normLows;
+    std::vector<double> normHighs;
+
+    typedef struct
+    {
+        double mean;
+        double sigma;
+        double exponent;
+        double limitP;
+        double integralBeam;
+        const double *table;
+    } BeamShape;
+
+    void calculateBFactorScales(double bFactor);
+    static double lookupSuperGaussian(BeamShape &beam, double x, double mean);
+    static double integrateBeam(BeamShape &beam, double pB, double qB);
+
+public:
+    ObservationStore();
+
+    void snapshot(MtzManager *mtz, MtzManager *reference);
+    void readPartialities(MtzManager *mtz);
+    void writeBack(MtzManager *mtz);
+
+    void calculatePartialities(MatrixPtr rotatedMatrix, double mosaicity,
+                               double spotSize, double wavelength,
+                               double bandwidth, double exponent);
+
+    void setScale(double scale);
+    void applyScaleFactor(double scaleFactor);
+    void setBFactor(double bFactor);
+
+    double meanIntensity(int refl);
+    double meanPartiality(int refl);
+    int acceptedCount(int refl);
+
+    double scaleToReference();
+    double rSplit(double low, double high);
+    double correlation(double low, double high);
+
+    int observationCount()
+    {
+        return (int)rawIntensities.size();
+    }
+
+    int reflectionCount()
+    {
+        return (int)reflResolutions.size();
+    }
+
+    bool accepted(int i)
+    {
+        if (model == PartialityModelNone)
+            return true;
+
+        if (partialities[i] < partialCutoffs[i])
+            return false;
+
+        if (flags[i] & ObservationFlagRejected)
+            return false;
+
+        if (rawIntensities[i] != rawIntensities[i])
+            return false;
+
+        if (sigmas[i] == 0)
+            return false;
+
+        return true;
+    }
+
+    /* Matches Miller::intensity() for accepted observations without
+     * polarisation correction, which the store does not support. */
+    double intensity(int i)
+    {
+        if (!accepted(i))
+            return 0;
+
+        double modifier = scales[i];
+        double partiality = partialities[i];
+
+        modifier /= bFactorScales[i];
+
+        if (model != PartialityModelBinary)
+        {
+            if (rawIntensities[i] > 0)
+                modifier /= partiality;
+            else
+                modifier *= partiality;
+        }
+        else
+        {
+            modifier *= (partiality < partialCutoffs[i]) ? 0 : 1;
+        }
+
+        if (partiality == 0)
+            modifier = 0;
+
+        return modifier * rawIntensities[i];
+    }
+
+    double weight(int i)
+    {
+        if (!accepted(i))
+            return 0;
+
+        return partialities[i] / scales[i] * bFactorScales[i];
+    }
+
+    bool isFree(int i)
+    {
+        return (flags[i] & ObservationFlagFree);
+    }
+};
+
+#endif /* defined(__cppxfel__ObservationStore__) */
@@ -0,0 +1,277 @@
+//
+//  OrientationIndex.cpp
+//   cppxfel - a collection of processing algorithms for XFEL diffraction data.
+
+//    Copyright (C) 2017  Helen Ginn
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "OrientationIndex.h"
+#include "IndexingSolution.h"
+#include <algorithm>
+#include <cmath>
+
+// cell coordinates are packed into 15 bits each of the key
+#define ORIENTATION_CELL_BITS 15
+#define ORIENTATION_CELL_LIMIT (1 << (ORIENTATION_CELL_BITS - 1))
+
+// how far from orthonormal a copy may be and still be binned
+#define ORIENTATION_ROTATION_TOLERANCE 1e-6
+
+OrientationIndex::OrientationIndex()
+{
+    solutions = 0;
+    maxDifference = IndexingSolution::similarRotationDifference();
+
+    // for proper rotations the difference is 8 sin^2(angle / 2) and the
+    // distance between their quaternions 2 sin(angle / 4); a little extra
+    // on the search radius covers rounding.
+    double sinHalfAngle = sqrt(std::max(maxDifference, 0.) / 8);
+    double quarterAngle = asin(std::min(sinHalfAngle, 1.)) / 2;
+    radius = 2 * sin(quarterAngle) * 1.01 + 1e-6;
+}
+
+bool OrientationIndex::quaternionForRotation(Matrix &rotation, double *quat)
+{
+    double m[3][3];
+
+    for (int i = 0; i < 3; i++)
+    {
+        for (int j = 0; j < 3; j++)
+        {
+            m[i][j] = rotation.components[i * 4 + j];
+
+            if (!std::isfinite(m[i][j]))
+            {
+                return false;
+            }
+        }
+    }
+
+    for (int i = 0; i < 3; i++)
+    {
+        for (int j = 0; j < 3; j++)
+        {
+            double dot = m[0][i] * m[0][j] + m[1][i] * m[1][j] + m[2][i] * m[2][j];
+
+            if (fabs(dot - (i == j)) > ORIENTATION_ROTATION_TOLERANCE)
+            {
+                return false;
+            }
+        }
+    }
+
+    double det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+    m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+    m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+
+    if (det <= 0)
+    {
+        return false;
+    }
+
+    double trace = m[0][0] + m[1][1] + m[2][2];
+
+    if (trace > 0)
+    {
+        double s = sqrt(trace + 1) * 2;
+        quat[0] = s / 4;
+        quat[1] = (m[2][1] - m[1][2]) / s;
+        quat[2] = (m[0][2] - m[2][0]) / s;
+        quat[3] = (m[1][0] - m[0][1]) / s;
+    }
+    else if (m[0][0] > m[1][1] && m[0][0] > m[2][2])
+    {
+        double s = sqrt(1 + m[0][0] - m[1][1] - m[2][2]) * 2;
+        quat[0] = (m[2][1] - m[1][2]) / s;
+        quat[1] = s / 4;
+        quat[2] = (m[0][1] + m[1][0]) / s;
+        quat[3] = (m[0][2] + m[2][0]) / s;
+    }
+    else if (m[1][1] > m[2][2])
+    {
+        double s = sqrt(1 + m[1][1] - m[0][0] - m[2][2]) * 2;
+        quat[0] = (m[0][2] - m[2][0]) / s;
+        quat[1] = (m[0][1] + m[1][0]) / s;
+        quat[2] = s / 4;
+        quat[3] = (m[1][2] + m[2][1]) / s;
+    }
+    else
+    {
+        double s = sqrt(1 + m[2][2] - m[0][0] - m[1][1]) * 2;
+        quat[0] = (m[1][0] - m[0][1]) / s;
+        quat[1] = (m[0][2] + m[2][0]) / s;
+        quat[2] = (m[1][2] + m[2][1]) / s;
+        quat[3] = s / 4;
+    }
+
+    double length = sqrt(quat[0] * quat[0] + quat[1] * quat[1] +
+                         quat[2] * quat[2] + quat[3] * quat[3]);
+
+    for (int i = 0; i < 4; i++)
+    {
+        quat[i] /= length;
+    }
+
+    return true;
+}
+
+int OrientationIndex::cellOf(double value)
+{
+    double cell = floor(value / radius);
+
+    if (cell < -ORIENTATION_CELL_LIMIT)
+    {
+        return -ORIENTATION_CELL_LIMIT;
+    }
+
+    if (cell > ORIENTATION_CELL_LIMIT - 1)
+    {
+        return ORIENTATION_CELL_LIMIT - 1;
+    }
+
+    return (int)cell;
+}
+
+long long OrientationIndex::cellKey(int *cell)
+{
+    long long key = 0;
+
+    for (int i = 0; i < 4; i++)
+    {
+        key = (key << ORIENTATION_CELL_BITS) + cell[i] + ORIENTATION_CELL_LIMIT;
+    }
+
+    return key;
+}
+
+// Adds every related copy of the solution's rotation, returning the
+// number the solution is known by in similarSolutions().
+int OrientationIndex::addSolution(MatrixPtr solution)
+{
+    for (int k = 0; k < IndexingSolution::symOperatorCount(); k++)
+    {
+        for (int l = 0; l < IndexingSolution::ambiguityCount(); l++)
+        {
+            Matrix rotated;
+            IndexingSolution::relatedRotation(solution, k, l, &rotated);
+
+            int copy = (int)rotations.size();
+            rotations.push_back(rotated);
+            owners.push_back(solutions);
+
+            double quat[4];
+
+            if (!quaternionForRotation(rotated, quat))
+            {
+                unbinned.push_back(copy);
+                continue;
+            }
+
+            int cell[4];
+
+            for (int i = 0; i < 4; i++)
+            {
+                cell[i] = cellOf(quat[i]);
+            }
+
+            std::pair<long long, int> entry = std::make_pair(cellKey(cell), copy);
+            cells.insert(std::upper_bound(cells.begin(), cells.end(), entry), entry);
+        }
+    }
+
+    solutions++;
+
+    return solutions - 1;
+}
+
+void OrientationIndex::binnedCopiesNear(double *quat, std::vector<int> *found)
+{
+    int min[4]; int max[4];
+
+    for (int i = 0; i < 4; i++)
+    {
+        min[i] = cellOf(quat[i] - radius);
+        max[i] = cellOf(quat[i] + radius);
+    }
+
+    int cell[4];
+
+    for (cell[0] = min[0]; cell[0] <= max[0]; cell[0]++)
+    {
+        for (cell[1] = min[1]; cell[1] <= max[1]; cell[1]++)
+        {
+            for (cell[2] = min[2]; cell[2] <= max[2]; cell[2]++)
+            {
+                for (cell[3] = min[3]; cell[3] <= max[3]; cell[3]++)
+                {
+                    std::pair<long long, int> first = std::make_pair(cellKey(cell), -1);
+                    std::vector<std::pair<long long, int> >::iterator it;
+                    it = std::lower_bound(cells.begin(), cells.end(), first);
+
+                    for (; it != cells.end() && it->first == first.first; it++)
+                    {
+                        found->push_back(it->second);
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Solutions with any copy similar to the given solution, in the order
+// they were added.
+void OrientationIndex::similarSolutions(MatrixPtr solution, std::vector<int> *found)
+{
+    found->clear();
+
+    Matrix rotation = *solution->getRotation();
+    std::vector<int> candidates;
+    double quat[4];
+
+    if (quaternionForRotation(rotation, quat))
+    {
+        binnedCopiesNear(quat, &candidates);
+
+        for (int i = 0; i < 4; i++)
+        {
+            quat[i] = -quat[i];
+        }
+
+        binnedCopiesNear(quat, &candidates);
+        candidates.insert(candidates.end(), unbinned.begin(), unbinned.end());
+    }
+    else
+    {
+        for (int i = 0; i < rotations.size(); i++)
+        {
+            candidates.push_back(i);
+        }
+    }
+
+    for (int i = 0; i < candidates.size(); i++)
+    {
+        int copy = candidates[i];
+        double difference = IndexingSolution::rotationDifference(rotation, rotations[copy]);
+
+        if (difference < maxDifference)
+        {
+            found->push_back(owners[copy]);
+        }
+    }
+
+    std::sort(found->begin(), found->end());
+    found->erase(std::unique(found->begin(), found->end()), found->end());
+}
@@ -0,0 +1,66 @@
+//
+//  OrientationIndex.h
+//   cppxfel - a collection of processing algorithms for XFEL diffraction data.
+
+//    Copyright (C) 2017  Helen Ginn
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifndef __cppxfel__OrientationIndex__
+#define __cppxfel__OrientationIndex__
+
+#include <stdio.h>
+#include <vector>
+#include "parameters.h"
+#include "Matrix.h"
+
+/* Keeps every symmetry and ambiguity related copy of a set of orientation
+ * matrices, binned by the quaternion of each copy, so that the solutions
+ * close to a new orientation (as judged by
+ * IndexingSolution::matrixSimilarToMatrix) can be found without comparing
+ * against every copy of every solution. A quaternion and its negative are
+ * the same rotation, so a search looks around both. Copies which are not
+ * proper rotations (or a search matrix which is not) have no meaningful
+ * quaternion and are compared directly instead. */
+
+class OrientationIndex
+{
+private:
+    std::vector<Matrix> rotations;
+    std::vector<int> owners;
+    std::vector<std::pair<long long, int> > cells;
+    std::vector<int> unbinned;
+    double maxDifference;
+    double radius;
+    int solutions;
+
+    static bool quaternionForRotation(Matrix &rotation, double *quat);
+    int cellOf(double value);
+    long long cellKey(int *cell);
+    void binnedCopiesNear(double *quat, std::vector<int> *found);
+
+public:
+    OrientationIndex();
+
+    int addSolution(MatrixPtr solution);
+    void similarSolutions(MatrixPtr solution, std::vector<int> *found);
+
+    int solutionCount()
+    {
+        return solutions;
+    }
+};
+
+#endif /* defined(__cppxfel__OrientationIndex__) */
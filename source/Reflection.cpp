@@ -309,9 +309,12 @@ Reflection::Reflection()
     resolution = 0;
     activeAmbiguity = 0;
 
+    static CachedKey<double> rejectSigmaKey("OUTLIER_REJECTION_SIGMA", OUTLIER_REJECTION_SIGMA);
+    static CachedKey<bool> shouldRejectKey("OUTLIER_REJECTION", true);
+
     millerMutex = MutexPtr(new std::mutex());
-    rejectSigma = FileParser::getKey("OUTLIER_REJECTION_SIGMA", OUTLIER_REJECTION_SIGMA);
-    shouldReject = FileParser::getKey("OUTLIER_REJECTION", true);
+    rejectSigma = rejectSigmaKey.get();
+    shouldReject = shouldRejectKey.get();
 }
 
 MillerPtr Reflection::acceptedMiller(int num)
@@ -926,6 +929,164 @@ void Reflection::clearLiteMillers()
     std::vector<LiteMiller>().swap(liteMillers);
 }
 
+void Reflection::accumulate(MergeAccumulator *accumulator, double intensity, double weight)
+{
+    if (accumulator->count == 0)
+    {
+        accumulator->minIntensity = intensity;
+        accumulator->maxIntensity = intensity;
+    }
+
+    accumulator->count++;
+    accumulator->weightSum += weight;
+
+    if (accumulator->weightSum != 0)
+    {
+        double fraction = weight / accumulator->weightSum;
+        accumulator->weightedMean += fraction * (intensity - accumulator->weightedMean);
+    }
+
+    double delta = intensity - accumulator->mean;
+    accumulator->mean += delta / accumulator->count;
+    accumulator->squaredDeviations += delta * (intensity - accumulator->mean);
+
+    if (intensity < accumulator->minIntensity)
+    {
+        accumulator->minIntensity = intensity;
+    }
+
+    if (intensity > accumulator->maxIntensity)
+    {
+        accumulator->maxIntensity = intensity;
+    }
+}
+
+MergeAccumulator Reflection::combinedAccumulator(MergeAccumulator &first, MergeAccumulator &second)
+{
+    if (first.count == 0)
+    {
+        return second;
+    }
+
+    if (second.count == 0)
+    {
+        return first;
+    }
+
+    MergeAccumulator combined;
+    combined.count = first.count + second.count;
+    combined.weightSum = first.weightSum + second.weightSum;
+    combined.weightedMean = 0;
+
+    if (combined.weightSum != 0)
+    {
+        combined.weightedMean = (first.weightedMean * first.weightSum +
+                                 second.weightedMean * second.weightSum) / combined.weightSum;
+    }
+
+    // parallel form of Welford's update (Chan et al.)
+    double delta = second.mean - first.mean;
+    combined.mean = first.mean + delta * second.count / combined.count;
+    combined.squaredDeviations = first.squaredDeviations + second.squaredDeviations +
+    delta * delta * first.count * second.count / combined.count;
+
+    combined.minIntensity = std::min(first.minIntensity, second.minIntensity);
+    combined.maxIntensity = std::max(first.maxIntensity, second.maxIntensity);
+
+    return combined;
+}
+
+void Reflection::accumulateMiller(MillerPtr miller)
+{
+    LiteMiller liteMiller = liteMillerFor(miller);
+
+    millerMutex->lock();
+
+    accumulateLiteMiller(liteMiller);
+
+    millerMutex->unlock();
+}
+
+void Reflection::accumulateLiteMiller(LiteMiller &liteMiller)
+{
+    if (accumulators.size() == 0)
+    {
+        MergeAccumulator empty;
+        memset(&empty, 0, sizeof(MergeAccumulator));
+        accumulators.resize(2, empty);
+    }
+
+    accumulate(&accumulators[liteMiller.friedel], liteMiller.intensity, liteMiller.weight);
+}
+
+/* Gives the same statistics as liteMerge from the accumulated totals. When
+ * outlier rejection applies and an observation lies outside the rejection
+ * bounds, liteMerge needs the observations themselves: nothing is written
+ * and false is returned, so that the caller can gather the observations of
+ * this reflection again and use liteMerge instead. */
+bool Reflection::streamMerge(double *intensity, double *countingSigma, double *sigma, int *rejected, signed char friedel)
+{
+    if (rejected != NULL)
+    {
+        *rejected = 0;
+    }
+
+    if (accumulators.size() == 0)
+    {
+        return true;
+    }
+
+    MergeAccumulator merged;
+
+    if (friedel == -1)
+    {
+        merged = combinedAccumulator(accumulators[0], accumulators[1]);
+    }
+    else
+    {
+        merged = accumulators[friedel != 0];
+    }
+
+    double mean = (merged.weightSum != 0) ? merged.weightedMean : std::nan(" ");
+
+    // spread of the observations about the weighted mean
+    double squaredSum = merged.squaredDeviations +
+    merged.count * pow(merged.mean - mean, 2);
+    double stdev = sqrt(squaredSum / merged.count);
+
+    bool shouldRejectLocal = (rejected != NULL) && shouldReject;
+
+    if (shouldRejectLocal && accumulatedCount() >= MIN_MILLER_COUNT)
+    {
+        int minIntensity = mean - stdev * rejectSigma;
+        int maxIntensity = mean + stdev * rejectSigma;
+
+        if (merged.count > 0 && (merged.minIntensity < minIntensity ||
+                                 merged.maxIntensity > maxIntensity))
+        {
+            return false;
+        }
+    }
+
+    stdev /= sqrt(merged.count);
+
+    if (merged.count == 1)
+    {
+        stdev = -1;
+    }
+
+    *intensity = mean;
+    *countingSigma = stdev;
+    *sigma = merged.weightSum;
+
+    return true;
+}
+
+void Reflection::clearAccumulators()
+{
+    std::vector<MergeAccumulator>().swap(accumulators);
+}
+
 void Reflection::merge(WeightType weighting, double *intensity, double *sigma,
                    bool calculateRejections)
 {
@@ -964,7 +1125,8 @@ void Reflection::merge(WeightType weighting, double *intensity, double *sigma,
         return;
     }
 
-    shouldReject = FileParser::getKey("OUTLIER_REJECTION", true);
+    static CachedKey<bool> shouldRejectKey("OUTLIER_REJECTION", true);
+    shouldReject = shouldRejectKey.get();
 
     if (shouldReject)
     {
@@ -1088,7 +1250,7 @@ void Reflection::detailedDescription()
     std::cout << std::endl;
 }
 
-int Reflection::checkSpotOverlaps(std::vector<SpotPtr> *spots, bool actuallyDelete)
+int Reflection::checkSpotOverlaps(SpotGrid *spots, bool actuallyDelete)
 {
     int count = 0;
 
@@ -1120,6 +1282,17 @@ int Reflection::checkOverlaps()
 }
 
 void Reflection::addLiteMiller(MillerPtr miller)
+{
+    LiteMiller liteMiller = liteMillerFor(miller);
+
+    millerMutex->lock();
+
+    liteMillers.push_back(liteMiller);
+
+    millerMutex->unlock();
+}
+
+LiteMiller Reflection::liteMillerFor(MillerPtr miller)
 {
     double intensity = miller->intensity();
     double weight = miller->getWeight();
@@ -1138,9 +1311,5 @@ void Reflection::addLiteMiller(MillerPtr miller)
     miller->positiveFriedel(&(liteMiller.friedel));
     liteMiller.weight = weight;
 
-    millerMutex->lock();
-
-    liteMillers.push_back(liteMiller);
-
-    millerMutex->unlock();
+    return liteMiller;
 }
@@ -24,11 +24,34 @@ struct LiteMiller
     bool friedel;
 } ;
 
+// an observation tagged with the position of its merged reflection
+struct BufferedMiller
+{
+    int reflNum;
+    LiteMiller liteMiller;
+} ;
+
+/* Running totals for merging one reflection without keeping its
+ * observations: the weighted mean is updated in place, and the plain mean
+ * and sum of squared deviations (Welford) give the spread about it. The
+ * extremes tell whether any observation could be rejected as an outlier. */
+struct MergeAccumulator
+{
+    int count;
+    double weightSum;
+    double weightedMean;
+    double mean;
+    double squaredDeviations;
+    double minIntensity;
+    double maxIntensity;
+} ;
+
 class Reflection
 {
 private:
 
     std::vector<LiteMiller> liteMillers;
+    std::vector<MergeAccumulator> accumulators;
         vector<MillerPtr> millers;
         double resolution;
     float negativeFriedelIntensity;
@@ -44,6 +67,8 @@ private:
     static std::vector<MatrixPtr> flipMatrices;
     static double rejectSigma;
     static bool shouldReject;
+    static void accumulate(MergeAccumulator *accumulator, double intensity, double weight);
+    static MergeAccumulator combinedAccumulator(MergeAccumulator &first, MergeAccumulator &second);
     unsigned char activeAmbiguity;
     vector<unsigned int> reflectionIds;
     MutexPtr millerMutex;
@@ -58,6 +83,16 @@ public:
         void addMiller(MillerPtr miller);
     void addMillerCarefully(MillerPtr miller);
     void addLiteMiller(MillerPtr miller);
+    static LiteMiller liteMillerFor(MillerPtr miller);
+
+    // no locking: only for when one thread alone adds to this reflection
+    void addLiteMiller(LiteMiller &liteMiller)
+    {
+        liteMillers.push_back(liteMiller);
+    }
+
+    void accumulateMiller(MillerPtr miller);
+    void accumulateLiteMiller(LiteMiller &liteMiller);
 
         int millerCount();
         ReflectionPtr copy(bool copyMillers = false);
@@ -66,7 +101,7 @@ public:
     static int reflectionIdForCoordinates(int h, int k, int l);
 
     int checkOverlaps();
-    int checkSpotOverlaps(std::vector<SpotPtr> *spots, bool actuallyDelete = true);
+    int checkSpotOverlaps(SpotGrid *spots, bool actuallyDelete = true);
     void reflectionDescription();
         void calculateResolution(MtzManager *mtz);
         void clearMillers();
@@ -91,6 +126,8 @@ public:
     void medianMerge(double *intensity, double *sigma, int *rejected, signed char friedel);
     void liteMerge(double *intensity, double *countingSigma, double *sigma, int *rejected, signed char friedel = -1);
     void clearLiteMillers();
+    bool streamMerge(double *intensity, double *countingSigma, double *sigma, int *rejected, signed char friedel = -1);
+    void clearAccumulators();
         double standardDeviation(WeightType weighting);
 
     void detailedDescription();
@@ -170,6 +207,16 @@ public:
         return (int)liteMillers.size();
     }
 
+    int accumulatedCount()
+    {
+        if (accumulators.size() == 0)
+        {
+            return 0;
+        }
+
+        return accumulators[0].count + accumulators[1].count;
+    }
+
     static MatrixPtr getFlipMatrix(int i);
 
     static bool reflLessThan(ReflectionPtr refl1, ReflectionPtr refl2)
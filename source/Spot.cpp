@@ -436,13 +436,18 @@ vec Spot::estimatedVector()
 
 double Spot::integrate()
 {
-    int foregroundLength = FileParser::getKey("SHOEBOX_FOREGROUND_PADDING",
-                                              SHOEBOX_FOREGROUND_PADDING);
-    int neitherLength = FileParser::getKey("SHOEBOX_NEITHER_PADDING",
-                                           SHOEBOX_NEITHER_PADDING);
-    int backgroundLength = FileParser::getKey("SHOEBOX_BACKGROUND_PADDING",
-                                              SHOEBOX_BACKGROUND_PADDING);
-    bool shoeboxEven = FileParser::getKey("SHOEBOX_MAKE_EVEN", false);
+    static CachedKey<int> foregroundKey("SHOEBOX_FOREGROUND_PADDING",
+                                        SHOEBOX_FOREGROUND_PADDING);
+    static CachedKey<int> neitherKey("SHOEBOX_NEITHER_PADDING",
+                                     SHOEBOX_NEITHER_PADDING);
+    static CachedKey<int> backgroundKey("SHOEBOX_BACKGROUND_PADDING",
+                                        SHOEBOX_BACKGROUND_PADDING);
+    static CachedKey<bool> shoeboxEvenKey("SHOEBOX_MAKE_EVEN", false);
+
+    int foregroundLength = foregroundKey.get();
+    int neitherLength = neitherKey.get();
+    int backgroundLength = backgroundKey.get();
+    bool shoeboxEven = shoeboxEvenKey.get();
 
     ShoeboxPtr shoebox = ShoeboxPtr(new Shoebox(MillerPtr()));
     shoebox->simpleShoebox(foregroundLength, neitherLength, backgroundLength, shoeboxEven);
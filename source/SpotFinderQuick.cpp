@@ -8,6 +8,10 @@
 
 #include "SpotFinderQuick.h"
 #include "Image.h"
+#include "ThreadPool.h"
+
+std::vector<SpotFinderQuick::MaskPtr> SpotFinderQuick::spareMasks;
+std::mutex SpotFinderQuick::maskMutex;
 
 template<class Value>
 void SpotFinderQuick::findSignalToNoise(Value *data, size_t position, int xDim, int yDim, float *signalToNoiseRatio, float *background, float *backgroundVariance)
@@ -39,49 +43,50 @@ void SpotFinderQuick::findSignalToNoise(Value *data, size_t position, int xDim,
 
 void SpotFinderQuick::findSpecificSpots(std::vector<SpotPtr> *spots)
 {
-    int xDim = image->getXDim();
-    int yDim = image->getYDim();
-    float minSeparationSquared = minSeparation * minSeparation;
-    int peakToEnter = 0;
-
-    bool useShort = true;
-    int *data = NULL;
-    short int *shortData = image->getShortDataPtr();
+    switch (image->getPixelType())
+    {
+        case PixelTypeShort:
+            findSpotsInData(image->getShortDataPtr(), spots);
+            break;
+        case PixelTypeFloat:
+            findSpotsInData(image->getFloatDataPtr(), spots);
+            break;
+        default:
+            findSpotsInData(image->getDataPtr(), spots);
+            break;
+    }
+}
 
-    size_t *pixelTracker = (size_t *)malloc(maxPixels * sizeof(size_t));
-    peaks = (Peak *)malloc(sizeof(Peak) * maxHits);
+/* First pass: every pixel over the threshold which is higher than its
+ * neighbours and clears the signal to noise threshold becomes a candidate.
+ * Each strip of rows is independent, reading its halo (neighbours and
+ * background ring) straight from the rest of the image. */
 
-    // calloc sets mem to 0... 1 will be used as masked
-    int *trackerMask = (int *)calloc(xDim * yDim, sizeof(int));
+template<class Value>
+void SpotFinderQuick::findCandidates(Value *data, int strip)
+{
+    int xDim = image->getXDim();
+    int yDim = image->getYDim();
 
-    int reachedSNRThreshold = 0;
+    std::vector<Candidate> &candidates = stripCandidates[strip];
+    candidates.clear();
     int reachedThreshold = 0;
-    int tooBig = 0;
-    int tooSmall = 0;
-
-    if (shortData == NULL)
-    {
-        useShort = false;
-        data = image->getDataPtr();
-    }
 
     int shifts[] = { - xDim - 1, - xDim, - xDim + 1,
         -1, 1,
         + xDim + 1, + xDim, +xDim + 1 };
 
-    for (int i = 0; i < yDim; i++)
+    int startRow = strip * SPOT_FINDING_STRIP_ROWS;
+    int endRow = std::min(startRow + SPOT_FINDING_STRIP_ROWS, yDim);
+
+    for (int i = startRow; i < endRow; i++)
     {
         for (int j = 0; j < xDim; j++)
         {
-            if (peakToEnter + 1 > maxHits)
-            {
-                break;
-            }
-
             bool mustContinue = false;
             size_t position = i * xDim + j;
 
-            short int value = (useShort ? shortData[position] : data[position]);
+            Value value = data[position];
 
             if (value < threshold)
             {
@@ -97,7 +102,7 @@ void SpotFinderQuick::findSpecificSpots(std::vector<SpotPtr> *spots)
                 if (otherPosition >= xDim * yDim)
                     continue;
 
-                short int otherValue = (useShort ? shortData[otherPosition] : data[otherPosition]);
+                Value otherValue = data[otherPosition];
 
                 if (value <= otherValue)
                 {
@@ -111,27 +116,80 @@ void SpotFinderQuick::findSpecificSpots(std::vector<SpotPtr> *spots)
                 continue;
             }
 
+            Candidate candidate;
             float signalToNoiseRatio = 0;
-            float background = 0;
-            float backgroundVariance = 0;
+            candidate.position = position;
+            candidate.thresholdCount = reachedThreshold;
 
-            if (shortData)
-            {
-                findSignalToNoise(shortData, position, xDim, yDim, &signalToNoiseRatio, &background, &backgroundVariance);
-            }
-            else
-            {
-                findSignalToNoise(data, position, xDim, yDim, &signalToNoiseRatio, &background, &backgroundVariance);
-            }
+            findSignalToNoise(data, position, xDim, yDim, &signalToNoiseRatio,
+                              &candidate.background, &candidate.backgroundVariance);
 
             if (signalToNoiseRatio < signalToNoiseThreshold)
             {
                 continue;
             }
 
+            candidates.push_back(candidate);
+        }
+    }
+
+    stripThresholdCounts[strip] = reachedThreshold;
+}
+
+/* Second pass, in raster order as before: grow each candidate into a
+ * spot, so earlier spots still claim their pixels first. */
+
+template<class Value>
+void SpotFinderQuick::findSpotsInData(Value *data, std::vector<SpotPtr> *spots)
+{
+    if (data == NULL)
+    {
+        return;
+    }
+
+    int xDim = image->getXDim();
+    int yDim = image->getYDim();
+    float minSeparationSquared = minSeparation * minSeparation;
+    int peakToEnter = 0;
+
+    int stripCount = (yDim + SPOT_FINDING_STRIP_ROWS - 1) / SPOT_FINDING_STRIP_ROWS;
+    stripCandidates.resize(stripCount);
+    stripThresholdCounts.resize(stripCount);
+    pixelData = data;
+
+    ThreadPool::getPool()->parallelFor(findCandidatesWrapper<Value>, this, stripCount);
+
+    size_t *pixelTracker = (size_t *)malloc(maxPixels * sizeof(size_t));
+    peaks = (Peak *)malloc(sizeof(Peak) * maxHits);
+
+    // 0 is unclaimed, 1 is claimed by a spot
+    MaskPtr trackerMask = takeTrackerMask(xDim * yDim);
+    std::vector<size_t> claimed;
+
+    int reachedSNRThreshold = 0;
+    int reachedThreshold = 0;
+    int tooBig = 0;
+    int tooSmall = 0;
+    bool reachedMaxHits = false;
+
+    int shifts[] = { - xDim - 1, - xDim, - xDim + 1,
+        -1, 1,
+        + xDim + 1, + xDim, +xDim + 1 };
+
+    for (int s = 0; s < stripCount && !reachedMaxHits; s++)
+    {
+        for (int c = 0; c < stripCandidates[s].size(); c++)
+        {
+            Candidate &candidate = stripCandidates[s][c];
+            bool mustContinue = false;
+            size_t position = candidate.position;
+            int i = position / xDim;
+            int j = position % xDim;
+
             reachedSNRThreshold++;
 
-            float backgroundSigma = sqrt(backgroundVariance);
+            float background = candidate.background;
+            float backgroundSigma = sqrt(candidate.backgroundVariance);
 
             float centreOfMassX = i;
             float centreOfMassY = j;
@@ -155,17 +213,18 @@ void SpotFinderQuick::findSpecificSpots(std::vector<SpotPtr> *spots)
                         continue;
                     }
 
-                    if (trackerMask[relativeToCurrentPixel] == 1)
+                    if ((*trackerMask)[relativeToCurrentPixel] == 1)
                     {
                         continue;
                     }
 
-                    int currentPixelValue = (useShort ? shortData[relativeToCurrentPixel] : data[relativeToCurrentPixel]);
+                    Value currentPixelValue = data[relativeToCurrentPixel];
                     float currentSignalToNoise = (currentPixelValue - background) / backgroundSigma;
 
                     if (currentSignalToNoise > signalToNoiseThreshold)
                     {
-                        trackerMask[relativeToCurrentPixel] = 1;
+                        (*trackerMask)[relativeToCurrentPixel] = 1;
+                        claimed.push_back(relativeToCurrentPixel);
 
                         if (totalPixelsToCheck == maxPixels)
                         {
@@ -207,15 +266,12 @@ void SpotFinderQuick::findSpecificSpots(std::vector<SpotPtr> *spots)
             }
             while (lastCheckedIndex != totalPixelsToCheck);
 
-        //    std::cout << totalPixelsToCheck << std::endl;
-
             if (totalPixelsToCheck >= maxPixels)
             {
                 tooBig++;
                 continue;
             }
 
-
             if (totalPixelsToCheck < minPixels)
             {
                 tooSmall++;
@@ -245,6 +301,19 @@ void SpotFinderQuick::findSpecificSpots(std::vector<SpotPtr> *spots)
             peaks[peakToEnter].totalSignal = totalSignal;
 
             peakToEnter++;
+
+            // the serial search stopped at the next pixel it looked at
+            if (peakToEnter + 1 > maxHits)
+            {
+                reachedThreshold += candidate.thresholdCount;
+                reachedMaxHits = true;
+                break;
+            }
+        }
+
+        if (!reachedMaxHits)
+        {
+            reachedThreshold += stripThresholdCounts[s];
         }
     }
 
@@ -259,7 +328,44 @@ void SpotFinderQuick::findSpecificSpots(std::vector<SpotPtr> *spots)
     totalPeaks = peakToEnter + 1;
 
     free(pixelTracker);
-    free(trackerMask);
+    returnTrackerMask(trackerMask, claimed);
+}
+
+/* Tracker masks are the size of the whole image, so they are kept for the
+ * next image rather than allocated and zeroed each time. Only the pixels
+ * a spot claimed need clearing before a mask is handed back. */
+
+SpotFinderQuick::MaskPtr SpotFinderQuick::takeTrackerMask(size_t size)
+{
+    MaskPtr mask;
+
+    {
+        std::lock_guard<std::mutex> lock(maskMutex);
+
+        if (spareMasks.size())
+        {
+            mask = spareMasks.back();
+            spareMasks.pop_back();
+        }
+    }
+
+    if (!mask || mask->size() != size)
+    {
+        mask = MaskPtr(new std::vector<unsigned char>(size, 0));
+    }
+
+    return mask;
+}
+
+void SpotFinderQuick::returnTrackerMask(MaskPtr mask, std::vector<size_t> &claimed)
+{
+    for (int i = 0; i < claimed.size(); i++)
+    {
+        (*mask)[claimed[i]] = 0;
+    }
+
+    std::lock_guard<std::mutex> lock(maskMutex);
+    spareMasks.push_back(mask);
 }
 
 void SpotFinderQuick::calculateBackgroundShifts()
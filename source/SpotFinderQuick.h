@@ -12,6 +12,9 @@
 #include <stdio.h>
 #include "SpotFinder.h"
 
+// rows of the image searched for spot candidates by each task
+#define SPOT_FINDING_STRIP_ROWS 64
+
 class SpotFinderQuick : public SpotFinder
 {
 private:
@@ -25,8 +28,38 @@ private:
 
     std::vector<int> backgroundShifts;
 
+    typedef struct
+    {
+        size_t position;
+        float background;
+        float backgroundVariance;
+        int thresholdCount;
+    } Candidate;
+
+    typedef boost::shared_ptr<std::vector<unsigned char> > MaskPtr;
+    static std::vector<MaskPtr> spareMasks;
+    static std::mutex maskMutex;
+    static MaskPtr takeTrackerMask(size_t size);
+    static void returnTrackerMask(MaskPtr mask, std::vector<size_t> &claimed);
+
+    void *pixelData;
+    std::vector<std::vector<Candidate> > stripCandidates;
+    std::vector<int> stripThresholdCounts;
+
     template<class Value>
     void findSignalToNoise(Value *data, size_t position, int xDim, int yDim, float *signalToNoiseRatio, float *background, float *backgroundVariance);
+    template<class Value>
+    void findCandidates(Value *data, int strip);
+    template<class Value>
+    void findSpotsInData(Value *data, std::vector<SpotPtr> *spots);
+
+    template<class Value>
+    static void findCandidatesWrapper(void *object, int strip)
+    {
+        SpotFinderQuick *me = static_cast<SpotFinderQuick *>(object);
+        me->findCandidates(static_cast<Value *>(me->pixelData), strip);
+    }
+
     void calculateBackgroundShifts();
 public:
     SpotFinderQuick(ImagePtr image) : SpotFinder(image)
@@ -39,6 +72,7 @@ public:
         minSeparation = 3;
         maxPixels = FileParser::getKey("SPOT_FINDING_MAX_PIXELS", 40);
         maxHits = 500;
+        pixelData = NULL;
 
         // For cheetah, Takanori Nakane says:
         // "In LCLS, 4. For SACLA, 4 leads to many false positives"
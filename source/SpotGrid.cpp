@@ -0,0 +1,161 @@
+//
+//  SpotGrid.cpp
+//   cppxfel - a collection of processing algorithms for XFEL diffraction data.
+
+//    Copyright (C) 2017  Helen Ginn
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+
+#include "SpotGrid.h"
+#include "Spot.h"
+#include "Vector.h"
+#include <algorithm>
+#include <cmath>
+
+// cell coordinates are packed into 21 bits each of the key
+#define SPOT_GRID_CELL_BITS 21
+#define SPOT_GRID_CELL_LIMIT (1 << (SPOT_GRID_CELL_BITS - 1))
+
+SpotGrid::SpotGrid(std::vector<SpotPtr> &newSpots, double newCellSize, bool reciprocal)
+{
+    spots = newSpots;
+    cellSize = newCellSize;
+    removals = 0;
+
+    positions.resize(spots.size());
+    removed.resize(spots.size(), false);
+    cells.reserve(spots.size());
+
+    for (int i = 0; i < spots.size(); i++)
+    {
+        if (reciprocal)
+        {
+            positions[i] = spots[i]->estimatedVector();
+        }
+        else
+        {
+            Coord xy = spots[i]->getRawXY();
+            positions[i] = new_vector(xy.first, xy.second, 0);
+        }
+
+        vec pos = positions[i];
+
+        if (!std::isfinite(pos.h) || !std::isfinite(pos.k) || !std::isfinite(pos.l))
+        {
+            continue;
+        }
+
+        long long key = cellKey(cellOf(pos.h), cellOf(pos.k), cellOf(pos.l));
+        cells.push_back(std::make_pair(key, i));
+    }
+
+    std::sort(cells.begin(), cells.end());
+}
+
+int SpotGrid::cellOf(double value)
+{
+    double cell = floor(value / cellSize);
+
+    if (cell < -SPOT_GRID_CELL_LIMIT)
+    {
+        return -SPOT_GRID_CELL_LIMIT;
+    }
+
+    if (cell > SPOT_GRID_CELL_LIMIT - 1)
+    {
+        return SPOT_GRID_CELL_LIMIT - 1;
+    }
+
+    return (int)cell;
+}
+
+long long SpotGrid::cellKey(int x, int y, int z)
+{
+    long long key = x + SPOT_GRID_CELL_LIMIT;
+    key = (key << SPOT_GRID_CELL_BITS) + y + SPOT_GRID_CELL_LIMIT;
+    key = (key << SPOT_GRID_CELL_BITS) + z + SPOT_GRID_CELL_LIMIT;
+
+    return key;
+}
+
+// Spots not yet removed which lie strictly within halfWidth of the centre
+// along every axis, in their original order.
+void SpotGrid::spotsNear(vec centre, double halfWidth, std::vector<int> *found)
+{
+    found->clear();
+
+    if (!std::isfinite(centre.h) || !std::isfinite(centre.k) || !std::isfinite(centre.l))
+    {
+        return;
+    }
+
+    int minX = cellOf(centre.h - halfWidth); int maxX = cellOf(centre.h + halfWidth);
+    int minY = cellOf(centre.k - halfWidth); int maxY = cellOf(centre.k + halfWidth);
+    int minZ = cellOf(centre.l - halfWidth); int maxZ = cellOf(centre.l + halfWidth);
+
+    for (int x = minX; x <= maxX; x++)
+    {
+        for (int y = minY; y <= maxY; y++)
+        {
+            for (int z = minZ; z <= maxZ; z++)
+            {
+                std::pair<long long, int> first = std::make_pair(cellKey(x, y, z), -1);
+                std::vector<std::pair<long long, int> >::iterator it;
+                it = std::lower_bound(cells.begin(), cells.end(), first);
+
+                for (; it != cells.end() && it->first == first.first; it++)
+                {
+                    int i = it->second;
+                    vec pos = positions[i];
+
+                    if (removed[i] || fabs(pos.h - centre.h) >= halfWidth ||
+                        fabs(pos.k - centre.k) >= halfWidth ||
+                        fabs(pos.l - centre.l) >= halfWidth)
+                    {
+                        continue;
+                    }
+
+                    found->push_back(i);
+                }
+            }
+        }
+    }
+
+    std::sort(found->begin(), found->end());
+}
+
+void SpotGrid::removeSpot(int i)
+{
+    if (!removed[i])
+    {
+        removed[i] = true;
+        removals++;
+    }
+}
+
+void SpotGrid::remainingSpots(std::vector<SpotPtr> *remaining)
+{
+    remaining->clear();
+    remaining->reserve(spots.size() - removals);
+
+    for (int i = 0; i < spots.size(); i++)
+    {
+        if (!removed[i])
+        {
+            remaining->push_back(spots[i]);
+        }
+    }
+}
@@ -0,0 +1,78 @@
+//
+//  SpotGrid.h
+//   cppxfel - a collection of processing algorithms for XFEL diffraction data.
+
+//    Copyright (C) 2017  Helen Ginn
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+
+#ifndef __cppxfel__SpotGrid__
+#define __cppxfel__SpotGrid__
+
+#include <stdio.h>
+#include <vector>
+#include "parameters.h"
+
+/* Buckets a set of spots into cubic cells so that the spots near a point
+ * can be found without looking at every spot. Positions are either the
+ * raw pixel coordinates on the image (z = 0), which are distinct across
+ * detector panels, or the estimated reciprocal lattice vectors. Spots can
+ * be marked as removed as they are matched up, and are then left out of
+ * later searches; remainingSpots() gives back the rest in their original
+ * order. */
+
+class SpotGrid
+{
+private:
+    std::vector<SpotPtr> spots;
+    std::vector<vec> positions;
+    std::vector<bool> removed;
+    std::vector<std::pair<long long, int> > cells;
+    double cellSize;
+    int removals;
+
+    int cellOf(double value);
+    long long cellKey(int x, int y, int z);
+
+public:
+    SpotGrid(std::vector<SpotPtr> &newSpots, double newCellSize, bool reciprocal = false);
+
+    void spotsNear(vec centre, double halfWidth, std::vector<int> *found);
+    void removeSpot(int i);
+    void remainingSpots(std::vector<SpotPtr> *remaining);
+
+    vec position(int i)
+    {
+        return positions[i];
+    }
+
+    bool isRemoved(int i)
+    {
+        return removed[i];
+    }
+
+    int removedCount()
+    {
+        return removals;
+    }
+
+    int spotCount()
+    {
+        return (int)spots.size();
+    }
+};
+
+#endif /* defined(__cppxfel__SpotGrid__) */
@@ -12,6 +12,8 @@
 #include "FileParser.h"
 #include "Detector.h"
 #include "PNGFile.h"
+#include "UnitCellLattice.h"
+#include <float.h>
 
 double SpotVector::trustComparedToStandardVector(SpotVectorPtr standardVector)
 {
@@ -52,6 +54,23 @@ SpotVector::SpotVector(SpotPtr first, SpotPtr second)
     firstDistance = cachedDistance;
 }
 
+// for when the spots' estimated vectors are already to hand
+SpotVector::SpotVector(SpotPtr first, SpotPtr second, vec firstVector, vec secondVector)
+{
+    firstSpot = first;
+    secondSpot = second;
+    update = false;
+    approxResolution = 0;
+    minDistanceTolerance = 0;
+    minAngleTolerance = 0;
+        _isIntraPanelVector = -1;
+
+    spotDiff = copy_vector(secondVector);
+    take_vector_away_from_vector(firstVector, &spotDiff);
+    calculateUnitVector();
+    firstDistance = cachedDistance;
+}
+
 void SpotVector::calculateUnitVector()
 {
     cachedDistance = length_of_vector(spotDiff);
@@ -212,18 +231,37 @@ std::string SpotVector::description()
     return "(" + f_to_str(spotDiff.h) + ", " + f_to_str(spotDiff.k) + ", " + f_to_str(spotDiff.l) + ")";
 }
 
-void SpotVector::addSimilarLengthStandardVectors(std::vector<SpotVectorPtr> standardVectors, double tolerance)
+// Trust is one over the difference in length, so every standard vector
+// trusted more than the tolerance lies within 1 / tolerance of this length
+// (give or take rounding).
+double SpotVector::trustSearchWidth()
+{
+    double tolerance = getMinDistanceTolerance();
+
+    if (tolerance <= 0)
+    {
+        return FLT_MAX;
+    }
+
+    return 1.001 / tolerance;
+}
+
+void SpotVector::addSimilarLengthStandardVectors(UnitCellLatticePtr lattice)
 {
     sameLengthStandardVectors.clear();
-    tolerance = this->getMinDistanceTolerance();
+    double tolerance = this->getMinDistanceTolerance();
+
+    std::vector<int> candidates;
+    lattice->standardVectorsNearDistance(distance(), trustSearchWidth(), &candidates);
 
-    for (int i = 0; i < standardVectors.size(); i++)
+    for (int i = 0; i < candidates.size(); i++)
     {
-        double trust = trustComparedToStandardVector(standardVectors[i]);
+        SpotVectorPtr standardVector = lattice->standardVector(candidates[i]);
+        double trust = trustComparedToStandardVector(standardVector);
 
         if (trust > tolerance)
         {
-            sameLengthStandardVectors.push_back(standardVectors[i]);
+            sameLengthStandardVectors.push_back(standardVector);
         }
     }
 
@@ -40,6 +40,7 @@ public:
     }
 
     SpotVector(SpotPtr first, SpotPtr second);
+    SpotVector(SpotPtr first, SpotPtr second, vec firstVector, vec secondVector);
     SpotVector(vec transformedHKL, vec normalHKL);
 
     bool hasCommonSpotWithVector(SpotVectorPtr spotVector2);
@@ -59,7 +60,8 @@ public:
     SpotVectorPtr copy();
     SpotVectorPtr vectorRotatedByMatrix(MatrixPtr mat);
     std::string description();
-    void addSimilarLengthStandardVectors(std::vector<SpotVectorPtr> standardVectors, double tolerance);
+    void addSimilarLengthStandardVectors(UnitCellLatticePtr lattice);
+    double trustSearchWidth();
     double cosineWithVector(SpotVectorPtr spotVector2);
     double cosineWithVertical();
     SpotVectorPtr differenceFromVector(SpotVectorPtr spotVec);
@@ -74,7 +76,7 @@ public:
         return firstDistance;
     }
 
-    std::vector<SpotVectorPtr> standardVectorsOfSameDistance()
+    std::vector<SpotVectorPtr> &standardVectorsOfSameDistance()
     {
         return sameLengthStandardVectors;
     }
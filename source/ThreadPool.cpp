@@ -0,0 +1,250 @@
+//
+//  ThreadPool.cpp
+//   cppxfel - a collection of processing algorithms for XFEL diffraction data.
+
+//    Copyright (C) 2017  Helen Ginn
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "ThreadPool.h"
+#include "FileParser.h"
+
+ThreadPoolPtr ThreadPool::mainPool;
+std::mutex ThreadPool::poolMutex;
+
+ThreadPool::ThreadPool(int threadCount)
+{
+    if (threadCount < 1)
+    {
+        threadCount = 1;
+    }
+
+    queuedTasks = 0;
+    shuttingDown = false;
+
+    // the last queue belongs to whichever thread is not a worker
+    // but is calling parallelFor, as it joins in with the work.
+    queues.resize(threadCount);
+
+    for (int i = 0; i < threadCount; i++)
+    {
+        queueMutexes.push_back(MutexPtr(new std::mutex()));
+    }
+
+    for (int i = 0; i < threadCount - 1; i++)
+    {
+        boost::thread *thr = new boost::thread(workerLoop, this, i);
+        workerIndices[thr->get_id()] = i;
+        threads.add_thread(thr);
+    }
+
+    logged << "Started thread pool with " << threadCount << " threads." << std::endl;
+    sendLog(LogLevelDetailed);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(waitMutex);
+        shuttingDown = true;
+    }
+
+    waitCondition.notify_all();
+    threads.join_all();
+}
+
+ThreadPoolPtr ThreadPool::getPool()
+{
+    std::lock_guard<std::mutex> lock(poolMutex);
+
+    if (!mainPool)
+    {
+        mainPool = ThreadPoolPtr(new ThreadPool(FileParser::getMaxThreads()));
+    }
+
+    return mainPool;
+}
+
+int ThreadPool::grainForCount(int count)
+{
+    int threads = getPool()->threadCount();
+    int grain = count / (threads * 8);
+
+    return (grain < 1) ? 1 : grain;
+}
+
+int ThreadPool::workerIndex()
+{
+    std::map<boost::thread::id, int>::iterator it;
+    it = workerIndices.find(boost::this_thread::get_id());
+
+    if (it == workerIndices.end())
+    {
+        return (int)queues.size() - 1;
+    }
+
+    return it->second;
+}
+
+bool ThreadPool::takeTask(int index, Task *task)
+{
+    int queueCount = (int)queues.size();
+    bool found = false;
+
+    for (int i = 0; i < queueCount && !found; i++)
+    {
+        int q = (index + i) % queueCount;
+        std::lock_guard<std::mutex> lock(*queueMutexes[q]);
+
+        if (queues[q].size() == 0)
+        {
+            continue;
+        }
+
+        // own work from the front, stolen work from the back
+        if (i == 0)
+        {
+            *task = queues[q].front();
+            queues[q].pop_front();
+        }
+        else
+        {
+            *task = queues[q].back();
+            queues[q].pop_back();
+        }
+
+        found = true;
+    }
+
+    if (found)
+    {
+        std::lock_guard<std::mutex> lock(waitMutex);
+        queuedTasks--;
+    }
+
+    return found;
+}
+
+void ThreadPool::runTask(Task &task)
+{
+    for (int i = task.start; i < task.end; i++)
+    {
+        task.job->function(task.job->object, i);
+    }
+
+    std::lock_guard<std::mutex> lock(waitMutex);
+    task.job->remaining--;
+
+    if (task.job->remaining == 0)
+    {
+        waitCondition.notify_all();
+    }
+}
+
+void ThreadPool::workerLoop(ThreadPool *me, int index)
+{
+    while (true)
+    {
+        Task task;
+
+        if (me->takeTask(index, &task))
+        {
+            me->runTask(task);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(me->waitMutex);
+
+        if (me->shuttingDown)
+        {
+            break;
+        }
+
+        if (me->queuedTasks > 0)
+        {
+            continue;
+        }
+
+        me->waitCondition.wait(lock);
+    }
+}
+
+void ThreadPool::parallelFor(TaskFunction function, void *object, int count, int grain)
+{
+    if (count <= 0)
+    {
+        return;
+    }
+
+    if (grain < 1)
+    {
+        grain = 1;
+    }
+
+    int index = workerIndex();
+    int queueCount = (int)queues.size();
+    int taskCount = (count + grain - 1) / grain;
+
+    Job job;
+    job.function = function;
+    job.object = object;
+    job.remaining = taskCount;
+
+    for (int i = 0; i < taskCount; i++)
+    {
+        Task task;
+        task.job = &job;
+        task.start = i * grain;
+        task.end = std::min(task.start + grain, count);
+
+        int q = (index + i) % queueCount;
+        std::lock_guard<std::mutex> lock(*queueMutexes[q]);
+        queues[q].push_back(task);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(waitMutex);
+        queuedTasks += taskCount;
+    }
+
+    waitCondition.notify_all();
+
+    // help out until every task of this job has finished, which may
+    // include tasks belonging to other jobs in the meantime.
+    while (true)
+    {
+        Task task;
+
+        if (takeTask(index, &task))
+        {
+            runTask(task);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(waitMutex);
+
+        if (job.remaining == 0)
+        {
+            break;
+        }
+
+        if (queuedTasks > 0)
+        {
+            continue;
+        }
+
+        waitCondition.wait(lock);
+    }
+}
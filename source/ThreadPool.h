@@ -0,0 +1,90 @@
+//
+//  ThreadPool.h
+//   cppxfel - a collection of processing algorithms for XFEL diffraction data.
+
+//    Copyright (C) 2017  Helen Ginn
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifndef __cppxfel__ThreadPool__
+#define __cppxfel__ThreadPool__
+
+#include <stdio.h>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <boost/thread/thread.hpp>
+#include "parameters.h"
+#include "LoggableObject.h"
+
+/* Shared pool of MAX_THREADS worker threads, created once on first use.
+ * Each worker owns a queue of tasks; it takes work from the front of its
+ * own queue and steals from the back of the others when it runs dry, so
+ * one slow image no longer holds up a whole stripe of the data set.
+ * The thread calling parallelFor() helps out until its job is finished,
+ * which means jobs may be submitted from inside other jobs. */
+
+class ThreadPool : public LoggableObject
+{
+private:
+    typedef struct
+    {
+        TaskFunction function;
+        void *object;
+        int remaining;
+    } Job;
+
+    typedef struct
+    {
+        Job *job;
+        int start;
+        int end;
+    } Task;
+
+    static ThreadPoolPtr mainPool;
+    static std::mutex poolMutex;
+
+    std::vector<std::deque<Task> > queues;
+    std::vector<MutexPtr> queueMutexes;
+    std::map<boost::thread::id, int> workerIndices;
+    boost::thread_group threads;
+
+    std::mutex waitMutex;
+    std::condition_variable waitCondition;
+    int queuedTasks;
+    bool shuttingDown;
+
+    bool takeTask(int index, Task *task);
+    void runTask(Task &task);
+    int workerIndex();
+    static void workerLoop(ThreadPool *me, int index);
+
+public:
+    ThreadPool(int threadCount);
+    ~ThreadPool();
+
+    static ThreadPoolPtr getPool();
+
+    void parallelFor(TaskFunction function, void *object, int count, int grain = 1);
+    static int grainForCount(int count);
+
+    int threadCount()
+    {
+        return (int)queues.size();
+    }
+};
+
+#endif /* defined(__cppxfel__ThreadPool__) */
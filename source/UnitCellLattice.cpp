@@ -18,6 +18,12 @@
 #include "Miller.h"
 #include "RefinementStrategy.h"
 #include "misc.h"
+#include <fstream>
+#include <iomanip>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define ANGLE_FUNNEL_START 1.5
 #define ANGLE_DISTANCE_BUFFER 0.005
@@ -26,6 +32,14 @@ bool UnitCellLattice::setupLattice = false;
 std::vector<MatrixPtr> UnitCellLattice::symOperators;
 UnitCellLatticePtr UnitCellLattice::mainLattice;
 
+UnitCellLattice::~UnitCellLattice()
+{
+    if (mappedCache)
+    {
+        munmap(mappedCache, mappedCacheBytes);
+    }
+}
+
 void UnitCellLattice::getMaxMillerIndicesForResolution(double resolution, int *hMax, int *kMax, int *lMax)
 {
     double lengths[3];
@@ -201,6 +215,11 @@ void UnitCellLattice::weightUnitCell()
         double intervals = LOOKUP_INTERVALS;
         double total = pow(intervals, 3);
 
+        if (mapLookupCache())
+        {
+                return;
+        }
+
         memset(lookupIntervals, 0, total * sizeof(float));
         lookupIntervalPtr = &lookupIntervals[0];
 
@@ -227,6 +246,145 @@ void UnitCellLattice::weightUnitCell()
         double seconds = endTime - startTime;
         logged << "Pre-calculation took " << seconds << " seconds." << std::endl;
         sendLog();
+
+        writeLookupCache();
+}
+
+void UnitCellLattice::makeLookupCacheHeader(LookupCacheHeader *header)
+{
+    memset(header, 0, sizeof(LookupCacheHeader));
+    memcpy(header->magic, "CXFLOOK", 7);
+
+    header->version = LOOKUP_CACHE_VERSION;
+    header->intervals = LOOKUP_INTERVALS;
+    header->spaceGroup = getSpaceGroupNum();
+    header->unitCell[0] = _aDim;
+    header->unitCell[1] = _bDim;
+    header->unitCell[2] = _cDim;
+    header->unitCell[3] = _alpha;
+    header->unitCell[4] = _beta;
+    header->unitCell[5] = _gamma;
+    header->indexingRlp = FileParser::getKey("INDEXING_RLP_SIZE", 0.001);
+    header->maxAngleDistance = maxAngleDistance;
+    header->maxReciprocalDistance = FileParser::getKey("MAX_RECIPROCAL_DISTANCE", 0.15);
+}
+
+std::string UnitCellLattice::lookupCacheFilename(LookupCacheHeader *header)
+{
+    std::string directory = FileParser::getKey("LOOKUP_CACHE_DIRECTORY", std::string(""));
+
+    if (!directory.length())
+    {
+        return "";
+    }
+
+    // FNV-1a hash of the header, so that each set of parameters has its own file
+    unsigned int hash = 2166136261u;
+    unsigned char *bytes = (unsigned char *)header;
+
+    for (int i = 0; i < sizeof(LookupCacheHeader); i++)
+    {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+
+    std::ostringstream filename;
+    filename << directory << "/lookup_" << std::hex << std::setw(8)
+    << std::setfill('0') << hash << ".dat";
+
+    return filename.str();
+}
+
+bool UnitCellLattice::mapLookupCache()
+{
+    LookupCacheHeader header;
+    makeLookupCacheHeader(&header);
+    std::string filename = lookupCacheFilename(&header);
+
+    if (!filename.length())
+    {
+        return false;
+    }
+
+    int fd = open(filename.c_str(), O_RDONLY);
+
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    size_t fileBytes = sizeof(LookupCacheHeader) + sizeof(lookupIntervals);
+    struct stat info;
+    void *map = MAP_FAILED;
+
+    if (fstat(fd, &info) == 0 && (size_t)info.st_size == fileBytes)
+    {
+        // shared, so that jobs on the same node share the page cache
+        map = mmap(NULL, fileBytes, PROT_READ, MAP_SHARED, fd, 0);
+    }
+
+    close(fd);
+
+    if (map == MAP_FAILED)
+    {
+        return false;
+    }
+
+    if (memcmp(map, &header, sizeof(LookupCacheHeader)) != 0)
+    {
+        munmap(map, fileBytes);
+        logged << "Ignoring lookup cache " << filename << " which was made with other settings." << std::endl;
+        sendLog();
+        return false;
+    }
+
+    if (mappedCache)
+    {
+        munmap(mappedCache, mappedCacheBytes);
+    }
+
+    mappedCache = map;
+    mappedCacheBytes = fileBytes;
+    lookupIntervalPtr = (float *)((char *)map + sizeof(LookupCacheHeader));
+
+    logged << "Read vector pair scores from lookup cache " << filename << "." << std::endl;
+    sendLog();
+
+    return true;
+}
+
+void UnitCellLattice::writeLookupCache()
+{
+    LookupCacheHeader header;
+    makeLookupCacheHeader(&header);
+    std::string filename = lookupCacheFilename(&header);
+
+    if (!filename.length())
+    {
+        return;
+    }
+
+    // written under another name first, as other jobs may be reading it
+    std::string tempName = filename + "." + i_to_str(getpid()) + ".tmp";
+    std::ofstream file(tempName.c_str(), std::ios::out | std::ios::binary);
+
+    if (file.is_open())
+    {
+        file.write((char *)&header, sizeof(LookupCacheHeader));
+        file.write((char *)lookupIntervals, sizeof(lookupIntervals));
+        file.close();
+    }
+
+    if (!file.good() || rename(tempName.c_str(), filename.c_str()) != 0)
+    {
+        remove(tempName.c_str());
+        logged << "Could not write lookup cache to " << filename << "." << std::endl;
+        sendLog();
+        return;
+    }
+
+    logged << "Written vector pair scores to lookup cache " << filename << "." << std::endl;
+    sendLog();
 }
 
 void UnitCellLattice::updateUnitCellData()
@@ -264,6 +422,46 @@ void UnitCellLattice::updateUnitCellData()
     }
 
     std::sort(orderedDistances.begin(), orderedDistances.end(), std::less<double>());
+
+    sortVectorLengths();
+}
+
+// Lets observed vectors find the standard vectors of about the same length
+// with a binary search rather than by trying every one of them.
+void UnitCellLattice::sortVectorLengths()
+{
+    standardLengths.clear();
+    uniqueSymLengths.clear();
+
+    for (int i = 0; i < standardVectorCount(); i++)
+    {
+        standardLengths.push_back(std::make_pair(standardVector(i)->distance(), i));
+    }
+
+    for (int i = 0; i < uniqueSymVectorCount(); i++)
+    {
+        uniqueSymLengths.push_back(std::make_pair(uniqueSymVector(i)->distance(), i));
+    }
+
+    std::sort(standardLengths.begin(), standardLengths.end());
+    std::sort(uniqueSymLengths.begin(), uniqueSymLengths.end());
+}
+
+void UnitCellLattice::vectorsNearDistance(std::vector<std::pair<double, int> > &lengths, double distance,
+                                          double halfWidth, std::vector<int> *indices)
+{
+    indices->clear();
+
+    std::pair<double, int> lowest = std::make_pair(distance - halfWidth, -1);
+    std::vector<std::pair<double, int> >::iterator it;
+    it = std::lower_bound(lengths.begin(), lengths.end(), lowest);
+
+    for (; it != lengths.end() && it->first <= distance + halfWidth; it++)
+    {
+        indices->push_back(it->second);
+    }
+
+    std::sort(indices->begin(), indices->end());
 }
 
 void UnitCellLattice::setup()
@@ -379,6 +577,8 @@ void UnitCellLattice::setup()
             minDistance = length_of_vector(hkl);
     }
 
+    sortVectorLengths();
+
     setupLock.unlock();
     setupLattice = true;
 }
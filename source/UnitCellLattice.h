@@ -15,6 +15,7 @@
 #include "Matrix.h"
 #include "parameters.h"
 #define LOOKUP_INTERVALS 240
+#define LOOKUP_CACHE_VERSION 1
 
 class UnitCellLattice : public FreeLattice, public hasSymmetry, public LoggableObject
 {
@@ -33,10 +34,15 @@ private:
     double powderStep;
     PowderHistogram histogram;
     std::vector<SpotVectorPtr> uniqueSymVectors;
+    std::vector<std::pair<double, int> > standardLengths;
+    std::vector<std::pair<double, int> > uniqueSymLengths;
     CSVPtr weightedUnitCell;
     CSVPtr weightedAngles;
         CSVPtr angleCSV;
     void updateUnitCellData();
+    void sortVectorLengths();
+    static void vectorsNearDistance(std::vector<std::pair<double, int> > &lengths, double distance,
+                                    double halfWidth, std::vector<int> *indices);
     double distanceToAngleRatio;
     std::mutex setupLock;
     static bool setupLattice;
@@ -44,6 +50,29 @@ private:
         float *lookupIntervalPtr;
         int counter;
 
+    /* Everything the lookup table depends on, written at the start of the
+     * cache file and compared byte for byte when it is read back. */
+    typedef struct
+    {
+        char magic[8];
+        int version;
+        int intervals;
+        int spaceGroup;
+        int padding;
+        double unitCell[6];
+        double indexingRlp;
+        double maxAngleDistance;
+        double maxReciprocalDistance;
+    } LookupCacheHeader;
+
+    void *mappedCache;
+    size_t mappedCacheBytes;
+
+    void makeLookupCacheHeader(LookupCacheHeader *header);
+    std::string lookupCacheFilename(LookupCacheHeader *header);
+    bool mapLookupCache();
+    void writeLookupCache();
+
     double _aDim;
     double _bDim;
     double _cDim;
@@ -55,10 +84,13 @@ private:
 
         UnitCellLattice() : FreeLattice()
     {
+        mappedCache = NULL;
+        mappedCacheBytes = 0;
         setup();
     }
 
 public:
+    ~UnitCellLattice();
     void setup();
     void getMaxMillerIndicesForResolution(double resolution, int *hMax, int *kMax, int *lMax);
     void weightUnitCell();
@@ -91,6 +123,18 @@ public:
         return spotVectors[i];
     }
 
+    /* Indices, in ascending order, of the standard (or unique symmetry)
+     * vectors whose length lies within halfWidth of the distance. */
+    void standardVectorsNearDistance(double distance, double halfWidth, std::vector<int> *indices)
+    {
+        vectorsNearDistance(standardLengths, distance, halfWidth, indices);
+    }
+
+    void uniqueSymVectorsNearDistance(double distance, double halfWidth, std::vector<int> *indices)
+    {
+        vectorsNearDistance(uniqueSymLengths, distance, halfWidth, indices);
+    }
+
     int symOperatorCount()
     {
         return (int)symOperators.size();
@@ -12,6 +12,7 @@
 #include <fstream>
 #include <unistd.h>
 #include "Hdf5ManagerCheetahSacla.h"
+#include "CrystalPack.h"
 #include <execinfo.h>
 #include <signal.h>
 
@@ -420,6 +421,60 @@ void new_main(int argc, char *argv[])
 
     }
 
+    if (strcmp(argv[1], "-pack") == 0)
+    {
+        if (argc < 4)
+        {
+            std::cout << "arguments: -pack <pack> <file1> {<file2> ...}." << std::endl;
+            exit(1);
+        }
+
+        CrystalPack pack(argv[2]);
+
+        if (pack.openForWriting())
+        {
+            for (int i = 3; i < argc; i++)
+            {
+                MtzManager *mtz = new MtzManager();
+                mtz->setFilename(argv[i]);
+                mtz->loadReflections();
+                pack.addCrystal(mtz, argv[i], true);
+                delete mtz;
+            }
+        }
+    }
+
+    if (strcmp(argv[1], "-unpack") == 0)
+    {
+        if (argc < 3)
+        {
+            std::cout << "arguments: -unpack <pack>." << std::endl;
+            exit(1);
+        }
+
+        CrystalPack pack(argv[2]);
+
+        if (pack.openForReading())
+        {
+            for (int i = 0; i < pack.crystalCount(); i++)
+            {
+                std::string name = pack.crystalName(i);
+
+                // only the last copy of each crystal
+                if (pack.crystalForName(name) != i)
+                {
+                    continue;
+                }
+
+                MtzManager *mtz = new MtzManager();
+                mtz->setFilename(name);
+                pack.loadCrystal(i, mtz);
+                mtz->writeToFile(name, true);
+                delete mtz;
+            }
+        }
+    }
+
         if (strcmp(argv[1], "-bfactor") == 0)
         {
                 if (argc <= 2)
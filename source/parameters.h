@@ -196,6 +196,7 @@ class Hdf5ManagerProcessing;
 class Hdf5ManagerCheetahLCLS;
 class Hdf5ManagerCheetahSacla;
 class Hdf5ManagerCheetah;
+class Hdf5Prefetcher;
 class Hdf5Crystal;
 class PNGFile;
 class TextManager;
@@ -204,6 +205,13 @@ class SpotFinderQuick;
 class SpotFinder;
 class Reflection;
 class NelderMead;
+class ThreadPool;
+class ObservationStore;
+class MergeShards;
+class CrystalPack;
+class ObjectPool;
+class SpotGrid;
+class OrientationIndex;
 
 typedef boost::shared_ptr<SpectrumBeam> SpectrumBeamPtr;
 typedef boost::shared_ptr<RefinementStepSearch> RefinementStepSearchPtr;
@@ -217,6 +225,8 @@ typedef boost::weak_ptr<Miller> MillerWeakPtr;
 typedef boost::shared_ptr<Reflection> ReflectionPtr;
 typedef boost::weak_ptr<Reflection> ReflectionWeakPtr;
 typedef boost::shared_ptr<Shoebox>ShoeboxPtr;
+typedef boost::shared_ptr<ObjectPool> ObjectPoolPtr;
+typedef boost::shared_ptr<OrientationIndex> OrientationIndexPtr;
 typedef boost::shared_ptr<Spot> SpotPtr;
 typedef boost::shared_ptr<Detector>DetectorPtr;
 typedef boost::weak_ptr<Detector>DetectorWeakPtr;
@@ -236,6 +246,11 @@ typedef boost::shared_ptr<IndexingSolution> IndexingSolutionPtr;
 typedef boost::shared_ptr<std::mutex> MutexPtr;
 typedef boost::shared_ptr<UnitCellLattice> UnitCellLatticePtr;
 typedef boost::shared_ptr<Hdf5ManagerProcessing> Hdf5ManagerProcessingPtr;
+typedef boost::shared_ptr<Hdf5Prefetcher> Hdf5PrefetcherPtr;
+typedef boost::shared_ptr<ThreadPool> ThreadPoolPtr;
+typedef boost::shared_ptr<ObservationStore> ObservationStorePtr;
+typedef boost::shared_ptr<MergeShards> MergeShardsPtr;
+typedef boost::shared_ptr<CrystalPack> CrystalPackPtr;
 typedef std::shared_ptr<PNGFile> PNGFilePtr;
 typedef std::shared_ptr<CSV> CSVPtr;
 typedef std::shared_ptr<TextManager> TextManagerPtr;
@@ -259,6 +274,7 @@ typedef std::pair<std::pair<SpotVectorPtr, VectorDistance>, double> Match;
 
 typedef double (*Getter)(void *);
 typedef void (*Setter)(void *, double newValue);
+typedef void (*TaskFunction)(void *, int);
 
 typedef std::map<int, std::pair<int, int> > PowderHistogram;
 